@@ -1,4 +1,5 @@
 #include "alloc.hpp"
+#include "cache.hpp"
 #include "values.hpp"
 
 namespace fn {
@@ -79,9 +80,11 @@ void alloc_table(istate* S, u32 stack_pos, u32 init_cap) {
     res->size = 0;
     res->cap = init_cap;
     res->rehash = 3 * init_cap / 4;
+    res->version = 0;
     res->data = data_handle->obj;
     release_handle(data_handle);
     res->metatable = V_NIL;
+    res->shape = root_table_shape(S, init_cap);
     S->stack[stack_pos] = vbox_table(res);
 }
 
@@ -106,8 +109,88 @@ static void reify_bc_const(istate* S, const scanner_string_table& sst,
     }
 }
 
+// make the placeholder stub for a function that will be compiled when it's
+// first called. It has no code and a single sub_funs entry to hold the
+// compiled stub.
+static gc_handle<function_stub>* gen_lazy_stub(istate* S,
+        const scanner_string_table& sst, const bc_compiler_output& compiled) {
+    auto sub_funs_sz = sizeof(function_stub*);
+    auto code_info_sz = round_to_align(sizeof(code_info));
+    auto sz = round_to_align(sizeof(function_stub) + sub_funs_sz
+            + code_info_sz);
+    auto o = (function_stub*)alloc_nursery_object(S, sz);
+    init_gc_header(&o->h, GC_TYPE_FUN_STUB, sz);
+    o->foreign = nullptr;
+    o->num_params = 0;
+    o->num_opt = 0;
+    o->vari = false;
+    o->simple = false;
+    o->space = 0;
+    o->ns_id = S->ns_id;
+    o->name = nullptr;
+    o->filename = S->filename;
+    o->code_length = 0;
+    o->code = (u8*)raw_ptr_add(o, sizeof(function_stub));
+    o->num_const = 0;
+    o->const_arr = (value*)raw_ptr_add(o, sizeof(function_stub));
+    o->num_sub_funs = 1;
+    o->sub_funs = (function_stub**)raw_ptr_add(o, sizeof(function_stub));
+    o->sub_funs[0] = nullptr;
+    o->num_upvals = 0;
+    o->num_flat_upvals = 0;
+    o->upvals = (u8*)raw_ptr_add(o, sizeof(function_stub) + sub_funs_sz);
+    o->upvals_direct = (bool*)o->upvals;
+    o->ci_length = 1;
+    o->ci_arr = (code_info*)raw_ptr_add(o, sizeof(function_stub)
+            + sub_funs_sz);
+    o->ci_arr[0] = code_info{0, source_loc{0, 0, false, 0}, false,
+            inline_origin{}};
+    o->num_method_caches = 0;
+    o->method_caches = nullptr;
+    o->num_field_caches = 0;
+    o->field_caches = nullptr;
+    o->jit_count = 0;
+    o->jit = nullptr;
+    o->memo_id = 0;
+    o->code_id = compiled.code_id;
+    o->lazy = compiled.lazy;
+
+    auto h = get_handle(S->alloc, o);
+    push_str(S, scanner_name(sst, compiled.name_id));
+    h->obj->name = vstr(peek(S));
+    pop(S);
+    return h;
+}
+
+// compute the key hashes of the field caches from the constants used by the
+// instructions that own them
+static void init_field_hashes(function_stub* stub) {
+    auto code = stub->code;
+    for (u32 pc = 0; pc < stub->code_length; pc += instr_width(code[pc])) {
+        u32 operands;
+        switch (code[pc]) {
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+            operands = pc + 1;
+            break;
+        case OP_LOCAL_GET_FIELD:
+            operands = pc + 2;
+            break;
+        default:
+            continue;
+        }
+        u16 cid, cache_id;
+        memcpy(&cid, &code[operands], sizeof(u16));
+        memcpy(&cache_id, &code[operands + 2], sizeof(u16));
+        stub->field_caches[cache_id].hash = hash(stub->const_arr[cid]);
+    }
+}
+
 gc_handle<function_stub>* gen_function_stub(istate* S,
         const scanner_string_table& sst, const bc_compiler_output& compiled) {
+    if (compiled.lazy) {
+        return gen_lazy_stub(S, sst, compiled);
+    }
     auto& alloc = S->alloc;
     // compute the size of the object
     // FIXME: there might be a better way to write this...
@@ -115,11 +198,17 @@ gc_handle<function_stub>* gen_function_stub(istate* S,
     auto code_sz = round_to_align(compiled.code.size);
     auto const_sz = sizeof(value) * compiled.const_table.size;
     auto sub_funs_sz = sizeof(function_stub*) * compiled.sub_funs.size;
-    auto upvals_sz = sizeof(upvalue_cell*) * compiled.num_upvals;
-    auto upvals_direct_sz = round_to_align(sizeof(bool) * compiled.num_upvals);
+    // upvalue cells and flat upvalues share the upvalue arrays
+    auto num_all_upvals = compiled.num_upvals + compiled.num_flat_upvals;
+    auto upvals_sz = sizeof(upvalue_cell*) * num_all_upvals;
+    auto upvals_direct_sz = round_to_align(sizeof(bool) * num_all_upvals);
     auto code_info_sz = round_to_align(sizeof(code_info) * compiled.ci_arr.size);
+    auto num_mcache = compiled.num_method_caches * METHOD_CACHE_WAYS;
+    auto mcache_sz = sizeof(method_cache_entry) * num_mcache;
+    auto fcache_sz = sizeof(field_cache_entry) * compiled.num_field_caches;
     auto sz = round_to_align(sizeof(function_stub) + code_sz + const_sz
-            + sub_funs_sz + upvals_sz + upvals_direct_sz + code_info_sz);
+            + sub_funs_sz + upvals_sz + upvals_direct_sz + code_info_sz
+            + mcache_sz + fcache_sz);
 
     // set up the object
     auto o = (function_stub*)alloc_nursery_object(S, sz);
@@ -128,6 +217,7 @@ gc_handle<function_stub>* gen_function_stub(istate* S,
     o->num_params = compiled.params.size;
     o->num_opt = compiled.num_opt;
     o->vari = compiled.has_vari;
+    o->simple = compiled.num_opt == 0 && !compiled.has_vari;
     o->space = compiled.stack_required;
     o->ns_id = S->ns_id;
     // TODO: sort this out
@@ -155,6 +245,7 @@ gc_handle<function_stub>* gen_function_stub(istate* S,
         o->sub_funs[i] = nullptr;
     }
     o->num_upvals = compiled.num_upvals;
+    o->num_flat_upvals = compiled.num_flat_upvals;
     o->upvals = (u8*)raw_ptr_add(o, sizeof(function_stub) + code_sz + const_sz
             + sub_funs_sz);
     o->upvals_direct = (bool*)raw_ptr_add(o, sizeof(function_stub) + code_sz
@@ -162,10 +253,34 @@ gc_handle<function_stub>* gen_function_stub(istate* S,
     o->ci_length = compiled.ci_arr.size;
     o->ci_arr = (code_info*)raw_ptr_add(o, sizeof(function_stub) + code_sz
             + const_sz + sub_funs_sz + upvals_sz + upvals_direct_sz);
+    o->num_method_caches = num_mcache;
+    o->method_caches = (method_cache_entry*)raw_ptr_add(o,
+            sizeof(function_stub) + code_sz + const_sz + sub_funs_sz
+            + upvals_sz + upvals_direct_sz + code_info_sz);
+    for (u32 i = 0; i < num_mcache; ++i) {
+        o->method_caches[i] = method_cache_entry{V_NIL, V_NIL, 0};
+    }
+    o->num_field_caches = compiled.num_field_caches;
+    o->field_caches = (field_cache_entry*)raw_ptr_add(o,
+            sizeof(function_stub) + code_sz + const_sz + sub_funs_sz
+            + upvals_sz + upvals_direct_sz + code_info_sz + mcache_sz);
+    for (u32 i = 0; i < compiled.num_field_caches; ++i) {
+        o->field_caches[i] = field_cache_entry{nullptr, 0, 0};
+    }
+    o->jit_count = 0;
+    o->jit = nullptr;
+    o->memo_id = compiled.memo_id;
+    o->code_id = compiled.code_id;
+    o->lazy = nullptr;
     memcpy(o->upvals, compiled.upvals.data,
             compiled.upvals_direct.size*sizeof(u8));
     memcpy(o->upvals_direct, compiled.upvals_direct.data,
             compiled.upvals_direct.size*sizeof(bool));
+    memcpy(o->upvals + compiled.num_upvals, compiled.flat_upvals.data,
+            compiled.flat_upvals_direct.size*sizeof(u8));
+    memcpy(o->upvals_direct + compiled.num_upvals,
+            compiled.flat_upvals_direct.data,
+            compiled.flat_upvals_direct.size*sizeof(bool));
     memcpy(o->ci_arr, compiled.ci_arr.data,
             compiled.ci_arr.size*sizeof(code_info));
 
@@ -182,6 +297,7 @@ gc_handle<function_stub>* gen_function_stub(istate* S,
         h->obj->const_arr[i] = v;
         pop(S);
     }
+    init_field_hashes(h->obj);
     for (u32 i = 0; i < compiled.sub_funs.size; ++i) {
         auto h2 = gen_function_stub(S, sst, compiled.sub_funs[i]);
         h->obj->sub_funs[i] = h2->obj;
@@ -232,12 +348,14 @@ void alloc_foreign_fun(istate* S,
     auto stub = (function_stub*)alloc_nursery_object(S, stub_sz);
     init_gc_header(&stub->h, GC_TYPE_FUN_STUB, stub_sz);
     stub->num_upvals = 0;
+    stub->num_flat_upvals = 0;
     stub->name = vstr(peek(S));
     pop(S);
     stub->filename = S->filename;
     stub->foreign = foreign;
     stub->num_params = num_params;
     stub->vari = vari;
+    stub->simple = false;
 
     stub->code_length = 0;
     stub->num_const = 0;
@@ -248,8 +366,19 @@ void alloc_foreign_fun(istate* S,
             sizeof(function_stub));
     stub->ci_arr[0] = code_info{
         0,
-        source_loc{0, 0, false, 0}
+        source_loc{0, 0, false, 0},
+        false,
+        inline_origin{}
     };
+    stub->num_method_caches = 0;
+    stub->method_caches = nullptr;
+    stub->num_field_caches = 0;
+    stub->field_caches = nullptr;
+    stub->jit_count = 0;
+    stub->jit = nullptr;
+    stub->memo_id = 0;
+    stub->code_id = hash(name);
+    stub->lazy = nullptr;
     auto stub_handle = get_handle(S->alloc, stub);
 
     auto sz = round_to_align(sizeof(fn_function));
@@ -258,6 +387,7 @@ void alloc_foreign_fun(istate* S,
     res->stub = stub_handle->obj;
     res->init_vals = nullptr;
     res->upvals = nullptr;
+    res->flat_upvals = nullptr;
     release_handle(stub_handle);
 
     // FIXME: allocate foreign fun upvals
@@ -289,6 +419,14 @@ void alloc_fun(istate* S, u32 enclosing, constant_id fid) {
     // open upvalues first so that no collections will happen while we add them
     // later
     auto stub = vfunction(S->stack[enclosing])->stub->sub_funs[fid];
+    if (stub->lazy && stub->sub_funs[0]) {
+        // the function has already been compiled through another closure, so
+        // use the compiled stub from now on
+        stub = stub->sub_funs[0];
+        auto enc = vfunction(S->stack[enclosing])->stub;
+        enc->sub_funs[fid] = stub;
+        write_guard(get_gc_card_header((gc_header*)enc), &stub->h);
+    }
     auto m = stub->num_upvals;
     for (u32 i = 0; i < m; ++i) {
         if (stub->upvals_direct[i]) {
@@ -298,10 +436,11 @@ void alloc_fun(istate* S, u32 enclosing, constant_id fid) {
         }
     }
 
-    // size of upvals + initvals arrays
+    // size of upvals + initvals + flat upvals arrays
     auto sz = round_to_align(sizeof(fn_function)
             + stub->num_opt*sizeof(value)
-            + stub->num_upvals*sizeof(upvalue_cell*));
+            + stub->num_upvals*sizeof(upvalue_cell*)
+            + stub->num_flat_upvals*sizeof(value));
     auto res = (fn_function*)alloc_nursery_object(S, sz);
     init_gc_header(&res->h, GC_TYPE_FUN, sz);
 
@@ -314,8 +453,21 @@ void alloc_fun(istate* S, u32 enclosing, constant_id fid) {
         res->init_vals[i] = V_NIL;
     }
     res->upvals = (upvalue_cell**)(stub->num_opt*sizeof(value) + (u8*)res->init_vals);
+    res->flat_upvals = (value*)(stub->num_upvals*sizeof(upvalue_cell*)
+            + (u8*)res->upvals);
     res->stub = stub;
 
+    // copy flat upvalues. The function is in the nursery, so no write guard is
+    // needed.
+    for (u32 i = 0; i < stub->num_flat_upvals; ++i) {
+        auto j = stub->num_upvals + i;
+        if (stub->upvals_direct[j]) {
+            res->flat_upvals[i] = S->stack[S->bp + stub->upvals[j]];
+        } else {
+            res->flat_upvals[i] = enc_fun->flat_upvals[stub->upvals[j]];
+        }
+    }
+
     // set up upvalues
     for (u32 i = 0; i < res->stub->num_upvals; ++i) {
         if (res->stub->upvals_direct[i]) {
@@ -349,7 +501,13 @@ istate* alloc_istate(const string& filename, const string& wd) {
     res->pc = 0;
     res->bp = 0;
     res->sp = 0;
+    res->stack = (value*)malloc(INITIAL_STACK_SIZE * sizeof(value));
+    res->stack_size = INITIAL_STACK_SIZE;
     res->callee = nullptr;
+    res->growing_frames = 0;
+    res->jit = nullptr;
+    res->op_prof = nullptr;
+    res->cache = new_bytecode_cache();
     res->filename = nullptr;
     res->wd = nullptr;
     res->filename = create_string(res, filename);
@@ -26,7 +26,8 @@ u8 get_frame_pointer(istate* S) {
 }
 
 u8 stack_space(istate* S) {
-    return STACK_SIZE - S->sp;
+    auto res = S->stack_size - S->sp;
+    return res > 255 ? 255 : res;
 }
 
 void push_copy(istate* S, u8 i) {
@@ -34,7 +34,7 @@ struct dyn_array {
     }
 
     dyn_array(const dyn_array<t>& other)
-        : capacity{other.capacity}
+        : capacity{other.size}
         , size{other.size}
         , data{(t*)malloc(size*sizeof(t))} {
         for (u32 i = 0; i < size; ++i) {
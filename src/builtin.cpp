@@ -1,5 +1,6 @@
 #include "builtin.hpp"
 
+#include "bytes.hpp"
 #include "namespace.hpp"
 #include "gc.hpp"
 #include "obj.hpp"
@@ -86,18 +87,18 @@ fn_fun(add, "+", "(& args)") {
             frac = true;
             break;
         } else {
-            ierror(S, "Argument to - not a number.");
+            ierror(S, "Argument to + not a number.");
             return;
         }
     }
     if (!frac) {
         push(S, vbox_int(resi));
     } else {
-        f64 resf = resi;
+        f64 resf = (i32)resi;
         for (; i < S->sp; ++i) {
             auto v = S->stack[i];
             if (!vis_number(v)) {
-                ierror(S, "Argument to - not a number.");
+                ierror(S, "Argument to + not a number.");
                 return;
             } else {
                 resf += vcast_float(v);
@@ -108,33 +109,53 @@ fn_fun(add, "+", "(& args)") {
 }
 
 fn_fun(sub, "-", "(& args)") {
-    f64 res = 0;
     if (S->sp - S->bp == 0) {
         push_int(S, 0);
         return;
-    } else {
-        auto v = S->stack[S->bp];
-        if (!vis_number(v)) {
-            ierror(S, "Argument to - not a number.");
-            return;
-        }
-        res = vcast_float(v);
-
+    }
+    auto v = S->stack[S->bp];
+    if (!vis_number(v)) {
+        ierror(S, "Argument to - not a number.");
+        return;
     }
     // arity 1 => perform negation
     if (S->sp - S->bp == 1) {
-        push_float(S, -res);
+        if (vis_int(v)) {
+            push(S, vbox_int(-(u32)vint(v)));
+        } else {
+            push_float(S, -vfloat(v));
+        }
         return;
     }
+    // like +, stay in integers until we see a float
+    u32 resi = 0;
+    f64 resf = 0;
+    bool frac = vis_float(v);
+    if (frac) {
+        resf = vfloat(v);
+    } else {
+        resi = vint(v);
+    }
     for (u32 i = S->bp + 1; i < S->sp; ++i) {
-        auto v = S->stack[i];
-        if (!vis_number(v)) {
+        v = S->stack[i];
+        if (!frac && vis_int(v)) {
+            resi -= vint(v);
+        } else if (vis_number(v)) {
+            if (!frac) {
+                resf = (i32)resi;
+                frac = true;
+            }
+            resf -= vcast_float(v);
+        } else {
             ierror(S, "Argument to - not a number.");
             return;
         }
-        res -= vcast_float(v);
     }
-    push_float(S, res);
+    if (frac) {
+        push_float(S, resf);
+    } else {
+        push(S, vbox_int(resi));
+    }
 }
 
 fn_fun(mul, "*", "(& args)") {
@@ -142,7 +163,7 @@ fn_fun(mul, "*", "(& args)") {
         push_int(S, 1);
         return;
     }
-    i32 resi = 1;
+    u32 resi = 1;
     bool frac = false;
     u32 i;
     for (i = S->bp; i < S->sp; ++i) {
@@ -153,18 +174,18 @@ fn_fun(mul, "*", "(& args)") {
             frac = true;
             break;
         } else {
-            ierror(S, "Argument to - not a number.");
+            ierror(S, "Argument to * not a number.");
             return;
         }
     }
     if (!frac) {
         push(S, vbox_int(resi));
     } else {
-        f64 resf = resi;
+        f64 resf = (i32)resi;
         for (; i < S->sp; ++i) {
             auto v = S->stack[i];
             if (!vis_number(v)) {
-                ierror(S, "Argument to - not a number.");
+                ierror(S, "Argument to * not a number.");
                 return;
             } else {
                 resf *= vcast_float(v);
@@ -204,6 +225,52 @@ fn_fun(div, "/", "(& args)") {
     push_float(S, res);
 }
 
+fn_fun(lt, "<", "(x0 & args)") {
+    auto x0 = get(S, 0);
+    if (!vis_number(x0)) {
+        ierror(S, "Arguments to < not a number.");
+        return;
+    }
+    auto n = vcast_float(x0);
+    for (u32 i = S->bp + 1; i < S->sp; ++i) {
+        auto x1 = S->stack[i];
+        if (!vis_number(x1)) {
+            ierror(S, "Arguments to < not a number.");
+            return;
+        }
+        auto m = vcast_float(x1);
+        if (n >= m) {
+            push(S, V_NO);
+            return;
+        }
+        n = m;
+    }
+    push(S, V_YES);
+}
+
+fn_fun(gt, ">", "(x0 & args)") {
+    auto x0 = get(S, 0);
+    if (!vis_number(x0)) {
+        ierror(S, "Arguments to > not a number.");
+        return;
+    }
+    auto n = vcast_float(x0);
+    for (u32 i = S->bp + 1; i < S->sp; ++i) {
+        auto x1 = S->stack[i];
+        if (!vis_number(x1)) {
+            ierror(S, "Arguments to > not a number.");
+            return;
+        }
+        auto m = vcast_float(x1);
+        if (n <= m) {
+            push(S, V_NO);
+            return;
+        }
+        n = m;
+    }
+    push(S, V_YES);
+}
+
 fn_fun(le, "<=", "(x0 & args)") {
     auto x0 = get(S, 0);
     if (!vis_number(x0)) {
@@ -455,6 +522,62 @@ fn_fun(def_string_meta, "def-string-meta", "(x)") {
     S->G->string_meta = peek(S);
 }
 
+bool builtin_binary_op(u8& op, fn_function* fun) {
+    auto f = fun->stub->foreign;
+    if (f == fn__add) {
+        op = OP_ADD;
+    } else if (f == fn__sub) {
+        op = OP_SUB;
+    } else if (f == fn__mul) {
+        op = OP_MUL;
+    } else if (f == fn__eq) {
+        op = OP_EQ;
+    } else if (f == fn__lt) {
+        op = OP_LT;
+    } else if (f == fn__le) {
+        op = OP_LE;
+    } else if (f == fn__gt) {
+        op = OP_GT;
+    } else if (f == fn__ge) {
+        op = OP_GE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool builtin_list_access(bool& is_head, fn_function* fun) {
+    auto f = fun->stub->foreign;
+    if (f == fn__head) {
+        is_head = true;
+    } else if (f == fn__tail) {
+        is_head = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool builtin_table(fn_function* fun) {
+    return fun->stub->foreign == fn__Table;
+}
+
+bool builtin_pure(fn_function* fun) {
+    auto f = fun->stub->foreign;
+    return f == fn__add || f == fn__sub || f == fn__mul || f == fn__div
+        || f == fn__pow || f == fn__mod || f == fn__ceil
+        || f == fn__eq || f == fn__lt || f == fn__le || f == fn__gt
+        || f == fn__ge || f == fn__fn_not;
+}
+
+bool builtin_deterministic(fn_function* fun) {
+    auto f = fun->stub->foreign;
+    return builtin_pure(fun) || f == fn__same_q || f == fn__list_q
+        || f == fn__symbol_q || f == fn__intern || f == fn__symname
+        || f == fn__List || f == fn__cons || f == fn__head || f == fn__tail
+        || f == fn__empty_q || f == fn__error;
+}
+
 void install_internal(istate* S) {
     switch_ns(S, cached_sym(S, SC_FN_INTERNAL));
     fn_add_builtin(S, require);
@@ -484,8 +607,8 @@ void install_internal(istate* S) {
     fn_add_builtin(S, ceil);
     // fn_add_builtin(S, frac_part);
 
-    // fn_add_builtin(S, gt);
-    // fn_add_builtin(S, lt);
+    fn_add_builtin(S, gt);
+    fn_add_builtin(S, lt);
     fn_add_builtin(S, ge);
     fn_add_builtin(S, le);
 
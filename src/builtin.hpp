@@ -10,6 +10,22 @@ namespace fn {
 void install_internal(istate* S);
 void install_builtin(istate* S);
 
+// if fun is one of the builtins implemented by a binary arithmetic or
+// comparison instruction, put that instruction in op and return true.
+bool builtin_binary_op(u8& op, fn_function* fun);
+// true if fun is a builtin without side effects, whose result depends only on
+// its arguments. The compiler calls these at compile time when all their
+// arguments are constants.
+bool builtin_pure(fn_function* fun);
+// if fun is head or tail, set is_head to say which and return true
+bool builtin_list_access(bool& is_head, fn_function* fun);
+// true if fun is the builtin Table
+bool builtin_table(fn_function* fun);
+// true if fun is a builtin without side effects whose result is determined by
+// its arguments. Unlike builtin_pure(), this includes builtins which build
+// lists and symbols or raise errors, so their results aren't always constants.
+bool builtin_deterministic(fn_function* fun);
+
 }
 
 #endif
@@ -35,6 +35,9 @@ enum OPCODES : u8 {
     OP_UPVALUE,
     // set-upvalue BYTE, set the BYTEth upvalue to the value on top of the stack
     OP_SET_UPVALUE,
+    // flat-upvalue BYTE, get the BYTEth flat upvalue, i.e. a captured value
+    // stored in the function object itself
+    OP_FLAT_UPVALUE,
     // closure SHORT. instantiate a closure using SHORT as the function id. Also
     // takes the function's init values as arguments on the stack. Init vals are
     // ordered with the last one in the parameter list on the top of the stack.
@@ -42,6 +45,9 @@ enum OPCODES : u8 {
     // close BYTE. pop the stack BYTE times, closing any open upvalues in the
     // process
     OP_CLOSE,
+    // close-from BYTE. close any open upvalues for local variables with index
+    // BYTE or higher, leaving the stack as is
+    OP_CLOSE_FROM,
 
     // NOTE: might be better if set_macro, set_global had argument orders switched
 
@@ -54,6 +60,13 @@ enum OPCODES : u8 {
     // obj-set. add or update an entry. stack arguments ->[new-value] key obj
     // ...
     OP_OBJ_SET,
+    // get-field SHORT1 SHORT2. Like obj-get, but the key is the constant
+    // SHORT1. SHORT2 identifies the inline cache. stack arguments ->[obj]
+    OP_GET_FIELD,
+    // set-field SHORT1 SHORT2. Like obj-set with the key given by the constant
+    // SHORT1. SHORT2 identifies the inline cache. stack arguments ->[new-value]
+    // obj
+    OP_SET_FIELD,
     // macro-get, get the function associated to a symbol, raising an error if there
     // is none. stack arguments ->[symbol]
     OP_MACRO,
@@ -61,7 +74,9 @@ enum OPCODES : u8 {
     // ->[function] symbol.
     OP_SET_MACRO,
 
-    // perform method calls. Stack: ->[arg-n] ... arg-0 object symbol
+    // callm BYTE SHORT, perform a method call with BYTE arguments (counting the
+    // object). SHORT identifies the call site's inline cache in the function
+    // stub. Stack: ->[arg-n] ... arg-1 object symbol
     OP_CALLM,
     OP_TCALLM,
 
@@ -75,18 +90,71 @@ enum OPCODES : u8 {
     OP_YES,
 
 
+    // arithmetic. These implement calls to the corresponding builtins with two
+    // arguments. Integers and floats are handled inline. Stack arguments
+    // ->[y] x
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    // comparisons. Same calling convention as above. Push yes or no.
+    OP_EQ,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    // typed arithmetic and comparisons. The compiler emits these in place of
+    // the ones above when it has proven the types of both operands (see NOTE:
+    // (Type inference) in compile.cpp), so they don't check them. The int
+    // versions require two ints. The float versions require two numbers, at
+    // least one of them a float, and always produce a float.
+    OP_ADD_INT,
+    OP_SUB_INT,
+    OP_MUL_INT,
+    OP_ADD_FLOAT,
+    OP_SUB_FLOAT,
+    OP_MUL_FLOAT,
+    OP_LT_INT,
+    OP_LE_INT,
+    OP_GT_INT,
+    OP_GE_INT,
+
+
     // control flow & function calls
 
     // jump SHORT, add signed SHORT to ip
     OP_JUMP,
     // cjump SHORT, if top of the stack is falsey, add signed SHORT to ip
     OP_CJUMP,
+    // guard-int BYTE SHORT, if the BYTEth local variable isn't an int, add
+    // signed SHORT to ip. Used to check the types of parameters on entry to a
+    // function specialized for ints.
+    OP_GUARD_INT,
+    // guard-self U32 SHORT, if global variable U32 doesn't hold the running
+    // function, add signed SHORT to ip. Used by the self tail calls of
+    // functions bound with def, which only loop while the global still holds
+    // them.
+    OP_GUARD_SELF,
+    // guard-global U32 U64 SHORT, if global variable U32 doesn't hold a
+    // function whose stub's code_id is U64, add signed SHORT to ip. Used in
+    // front of code compiled for the function a global held at compile time
+    // (see NOTE: (Guarded globals) in compile.cpp).
+    OP_GUARD_GLOBAL,
     // call BYTE, perform a function call. Uses BYTE+1 elements on the stack,
     // one for the function, one for each positional argument.
     // -> [func] pos-arg-n ... pos-arg-1
     OP_CALL,
     // tcall BYTE, perform a tail call
     OP_TCALL,
+    // call-known U32 BYTE, call the function held by global variable U32 with
+    // BYTE positional arguments. Uses BYTE elements on the stack. The function
+    // is inserted below them and the call proceeds as for call.
+    // -> pos-arg-n ... pos-arg-1
+    OP_CALL_KNOWN,
+    // tail call version of call-known
+    OP_TCALL_KNOWN,
+    // call-foreign U32 BYTE, like call-known for a builtin, i.e. a foreign
+    // function. Tail calls to builtins use tcall-known.
+    OP_CALL_FOREIGN,
     // apply BYTE, apply function. Uses BYTE+2 stack elements. ->[func] args
     // pos-arg-n ... pos-arg-1. Like call, but expands the list args to provide
     // additional positional arguments to the function.
@@ -97,6 +165,31 @@ enum OPCODES : u8 {
     OP_RETURN,
 
 
+    // superinstructions. The compiler fuses these from common instruction
+    // pairs (see fuse_instrs() below). Operands are those of the original
+    // instructions, in order.
+
+    // local2 BYTE1 BYTE2, local BYTE1; local BYTE2
+    OP_LOCAL2,
+    // local-const BYTE SHORT, local BYTE; const SHORT
+    OP_LOCAL_CONST,
+    // global-local U32 BYTE, global U32; local BYTE
+    OP_GLOBAL_LOCAL,
+    // local-get-field BYTE SHORT1 SHORT2, local BYTE; get-field SHORT1 SHORT2
+    OP_LOCAL_GET_FIELD,
+    // eq-cjump SHORT, etc. Compare the top two stack elements and jump if the
+    // comparison is false, i.e. eq; cjump SHORT
+    OP_EQ_CJUMP,
+    OP_LT_CJUMP,
+    OP_LE_CJUMP,
+    OP_GT_CJUMP,
+    OP_GE_CJUMP,
+    OP_LT_INT_CJUMP,
+    OP_LE_INT_CJUMP,
+    OP_GT_INT_CJUMP,
+    OP_GE_INT_CJUMP,
+
+
     // import, stack arguments ->[alias] ns_id, perform an import using the given
     // namespace id (symbol).
     OP_IMPORT,
@@ -119,6 +212,24 @@ inline u8 instr_width(u8 instr) {
     case OP_OBJ_GET:
     case OP_OBJ_SET:
     case OP_IMPORT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_ADD_INT:
+    case OP_SUB_INT:
+    case OP_MUL_INT:
+    case OP_ADD_FLOAT:
+    case OP_SUB_FLOAT:
+    case OP_MUL_FLOAT:
+    case OP_LT_INT:
+    case OP_LE_INT:
+    case OP_GT_INT:
+    case OP_GE_INT:
     case OP_TABLE:
         return 1;
     case OP_LOCAL:
@@ -126,13 +237,14 @@ inline u8 instr_width(u8 instr) {
     case OP_COPY:
     case OP_UPVALUE:
     case OP_SET_UPVALUE:
+    case OP_FLAT_UPVALUE:
     case OP_CLOSE:
+    case OP_CLOSE_FROM:
     case OP_CALL:
     case OP_TCALL:
-    case OP_CALLM:
-    case OP_TCALLM:
     case OP_APPLY:
     case OP_TAPPLY:
+    case OP_LIST:
         return 2;
     case OP_MACRO:
     case OP_SET_MACRO:
@@ -140,16 +252,85 @@ inline u8 instr_width(u8 instr) {
     case OP_JUMP:
     case OP_CJUMP:
     case OP_CLOSURE:
+    case OP_LOCAL2:
+    case OP_EQ_CJUMP:
+    case OP_LT_CJUMP:
+    case OP_LE_CJUMP:
+    case OP_GT_CJUMP:
+    case OP_GE_CJUMP:
+    case OP_LT_INT_CJUMP:
+    case OP_LE_INT_CJUMP:
+    case OP_GT_INT_CJUMP:
+    case OP_GE_INT_CJUMP:
         return 3;
+    case OP_CALLM:
+    case OP_TCALLM:
+    case OP_LOCAL_CONST:
+    case OP_GUARD_INT:
+        return 4;
     case OP_GLOBAL:
     case OP_SET_GLOBAL:
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
         return 5;
+    case OP_GLOBAL_LOCAL:
+    case OP_LOCAL_GET_FIELD:
+    case OP_CALL_KNOWN:
+    case OP_TCALL_KNOWN:
+    case OP_CALL_FOREIGN:
+        return 6;
+    case OP_GUARD_SELF:
+        return 7;
+    case OP_GUARD_GLOBAL:
+        return 15;
     default:
         // TODO: shouldn't get here. maybe raise a warning?
         return 1;
     }
 }
 
+// gives the superinstruction for the instruction prev followed by next, or
+// OP_NOP if there is none. The pairs were chosen by counting executed
+// instruction pairs over the test programs and examples.
+inline u8 fuse_instrs(u8 prev, u8 next) {
+    switch (prev) {
+    case OP_LOCAL:
+        switch (next) {
+        case OP_LOCAL:
+            return OP_LOCAL2;
+        case OP_CONST:
+            return OP_LOCAL_CONST;
+        case OP_GET_FIELD:
+            return OP_LOCAL_GET_FIELD;
+        }
+        break;
+    case OP_GLOBAL:
+        if (next == OP_LOCAL) {
+            return OP_GLOBAL_LOCAL;
+        }
+        break;
+    case OP_EQ:
+        return next == OP_CJUMP ? OP_EQ_CJUMP : OP_NOP;
+    case OP_LT:
+        return next == OP_CJUMP ? OP_LT_CJUMP : OP_NOP;
+    case OP_LE:
+        return next == OP_CJUMP ? OP_LE_CJUMP : OP_NOP;
+    case OP_GT:
+        return next == OP_CJUMP ? OP_GT_CJUMP : OP_NOP;
+    case OP_GE:
+        return next == OP_CJUMP ? OP_GE_CJUMP : OP_NOP;
+    case OP_LT_INT:
+        return next == OP_CJUMP ? OP_LT_INT_CJUMP : OP_NOP;
+    case OP_LE_INT:
+        return next == OP_CJUMP ? OP_LE_INT_CJUMP : OP_NOP;
+    case OP_GT_INT:
+        return next == OP_CJUMP ? OP_GT_INT_CJUMP : OP_NOP;
+    case OP_GE_INT:
+        return next == OP_CJUMP ? OP_GE_INT_CJUMP : OP_NOP;
+    }
+    return OP_NOP;
+}
+
 }
 
 
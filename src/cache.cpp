@@ -0,0 +1,834 @@
+#include "cache.hpp"
+
+#include "alloc.hpp"
+#include "bytes.hpp"
+#include "namespace.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fn {
+
+namespace fs = std::filesystem;
+
+// "FNC" followed by a zero byte, as read on a little-endian machine
+constexpr u32 FNC_MAGIC = 0x00434e46;
+
+// kinds of saved toplevel forms
+enum fnc_form_kind : u8 {
+    // (namespace ...) at the start of a file
+    FNC_NAMESPACE,
+    // a compiled function
+    FNC_FUNCTION
+};
+
+struct fnc_header {
+    u32 magic;
+    u32 version;
+    // number of opcodes, as a sanity check on the bytecode
+    u32 num_ops;
+    u32 pad;
+    u64 src_hash;
+    u64 env_key;
+    u64 body_size;
+    u64 checksum;
+};
+
+static u64 mix_key(u64 key, u64 x) {
+    key = (key ^ x) * 0x9e3779b97f4a7c15;
+    return key ^ (key >> 29);
+}
+
+bytecode_cache* new_bytecode_cache() {
+    auto res = new bytecode_cache;
+    res->enabled = true;
+    res->env_key = FNC_VERSION;
+    return res;
+}
+
+void free_bytecode_cache(bytecode_cache* C) {
+    for (auto w : C->writers) {
+        delete w;
+    }
+    delete C;
+}
+
+void disable_bytecode_cache(istate* S) {
+    S->cache->enabled = false;
+}
+
+// where to keep the .fnc file for a source file. If the source file's
+// directory isn't writable, it goes in the user's cache directory instead.
+static string fnc_path(const string& path) {
+    fs::path p{path};
+    auto dir = p.parent_path();
+    if (access(dir.empty() ? "." : dir.c_str(), W_OK) == 0) {
+        return p.extension() == ".fn" ? path + "c" : path + ".fnc";
+    }
+    string cache_dir;
+    if (auto xdg = getenv("XDG_CACHE_HOME")) {
+        cache_dir = string{xdg} + "/fn";
+    } else if (auto home = getenv("HOME")) {
+        cache_dir = string{home} + "/.cache/fn";
+    } else {
+        return "";
+    }
+    std::ostringstream os;
+    os << cache_dir << '/' << std::hex << hash<string>(path) << ".fnc";
+    return os.str();
+}
+
+static bool read_file(const string& path, string& out) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in) {
+        return false;
+    }
+    std::ostringstream os;
+    os << in.rdbuf();
+    out = os.str();
+    return true;
+}
+
+static u64 hash_source(const string& src) {
+    return hash_bytes((const u8*)src.data(), src.size());
+}
+
+
+/// writing
+
+template<typename T> static void put(dyn_array<u8>& buf, T x) {
+    buf.ensure_capacity(buf.size + sizeof(T));
+    memcpy(&buf.data[buf.size], &x, sizeof(T));
+    buf.size += sizeof(T);
+}
+
+static void put_bytes(dyn_array<u8>& buf, const u8* bytes, u32 len) {
+    put<u32>(buf, len);
+    buf.ensure_capacity(buf.size + len);
+    memcpy(&buf.data[buf.size], bytes, len);
+    buf.size += len;
+}
+
+static void put_str(dyn_array<u8>& buf, const string& str) {
+    put_bytes(buf, (const u8*)str.data(), str.size());
+}
+
+static void put_loc(dyn_array<u8>& buf, const source_loc& loc) {
+    put<i32>(buf, loc.line);
+    put<i32>(buf, loc.col);
+}
+
+// write an AST. If names is null, strings and symbols are written as
+// scanner_string_table IDs, otherwise they're written out using names.
+static void put_ast(dyn_array<u8>& buf, const ast::node* node,
+        istate* names) {
+    put<u8>(buf, node->kind);
+    put_loc(buf, node->loc);
+    switch (node->kind) {
+    case ast::ak_int:
+        put<i32>(buf, node->datum.i);
+        break;
+    case ast::ak_float:
+        put<f64>(buf, node->datum.f);
+        break;
+    case ast::ak_string:
+    case ast::ak_symbol:
+        if (names) {
+            put_str(buf, symname(names, node->datum.str_id));
+        } else {
+            put<u32>(buf, node->datum.str_id);
+        }
+        break;
+    case ast::ak_list:
+        put<u32>(buf, node->list_length);
+        for (u32 i = 0; i < node->list_length; ++i) {
+            put_ast(buf, node->datum.list[i], names);
+        }
+        break;
+    }
+}
+
+// call f on the global ID operand of each instruction in code that has one
+template<typename F> static void for_global_ids(u8* code, u32 len, F f) {
+    for (u32 pc = 0; pc < len; pc += instr_width(code[pc])) {
+        auto op = code[pc];
+        if ((op == OP_GLOBAL || op == OP_SET_GLOBAL || op == OP_GLOBAL_LOCAL
+                        || op == OP_CALL_KNOWN || op == OP_TCALL_KNOWN
+                        || op == OP_CALL_FOREIGN || op == OP_GUARD_SELF
+                        || op == OP_GUARD_GLOBAL)
+                && pc + 5 <= len) {
+            u32 id;
+            memcpy(&id, &code[pc+1], sizeof(u32));
+            id = f(id);
+            memcpy(&code[pc+1], &id, sizeof(u32));
+        }
+    }
+}
+
+// functions that haven't been compiled are saved as syntax, along with their
+// own string tables
+static void put_lazy(dyn_array<u8>& buf, const lazy_fun* f) {
+    put<u32>(buf, f->sst.by_id.size);
+    for (u32 i = 0; i < f->sst.by_id.size; ++i) {
+        put_str(buf, f->sst.by_id[i]);
+    }
+    put<u32>(buf, f->name);
+    put<u8>(buf, f->self);
+    put_ast(buf, f->form, nullptr);
+}
+
+static void put_bco(cache_writer* w, istate* S, const bc_compiler_output& bco) {
+    auto& buf = w->forms;
+    put<u32>(buf, bco.name_id);
+    put<u8>(buf, bco.lazy != nullptr);
+    if (bco.lazy) {
+        put_lazy(buf, bco.lazy);
+        return;
+    }
+
+    // replace global IDs with indices into the file's table of FQNs
+    dyn_array<u8> code{bco.code};
+    for_global_ids(code.data, code.size, [w, S](u32 gid) {
+        auto e = w->global_index.get2(gid);
+        if (e) {
+            return e->val;
+        }
+        auto idx = w->globals.size;
+        w->globals.push_back(symname(S, S->G->def_ids[gid]));
+        w->global_index.insert(gid, idx);
+        return idx;
+    });
+    put_bytes(buf, code.data, code.size);
+
+    put<u32>(buf, bco.const_table.size);
+    for (u32 i = 0; i < bco.const_table.size; ++i) {
+        auto& k = bco.const_table[i];
+        put<u8>(buf, k.kind);
+        switch (k.kind) {
+        case bck_int:
+            put<i32>(buf, k.d.i);
+            break;
+        case bck_float:
+            put<f64>(buf, k.d.f);
+            break;
+        case bck_string:
+        case bck_symbol:
+            put<u32>(buf, k.d.str_id);
+            break;
+        case bck_quoted:
+            put_ast(buf, k.d.quoted, nullptr);
+            break;
+        }
+    }
+
+    put<u32>(buf, bco.sub_funs.size);
+    for (u32 i = 0; i < bco.sub_funs.size; ++i) {
+        put_bco(w, S, bco.sub_funs[i]);
+    }
+
+    put<u32>(buf, bco.ci_arr.size);
+    for (u32 i = 0; i < bco.ci_arr.size; ++i) {
+        auto& c = bco.ci_arr[i];
+        put<u32>(buf, c.start_addr);
+        put_loc(buf, c.loc);
+        put<u8>(buf, c.inlined);
+        if (c.inlined) {
+            put_str(buf, symname(S, c.origin.name));
+            put_str(buf, symname(S, c.origin.filename));
+            put_loc(buf, c.origin.call_loc);
+        }
+    }
+
+    put<u32>(buf, bco.stack_required);
+    put<u32>(buf, bco.params.size);
+    for (u32 i = 0; i < bco.params.size; ++i) {
+        put_str(buf, symname(S, bco.params[i]));
+    }
+    put<u8>(buf, bco.num_opt);
+    put<u8>(buf, bco.has_vari);
+    if (bco.has_vari) {
+        put_str(buf, symname(S, bco.vari_param));
+    }
+    put<u16>(buf, bco.num_method_caches);
+    put<u16>(buf, bco.num_field_caches);
+    put<u64>(buf, bco.memo_id);
+    put<u64>(buf, bco.code_id);
+    put<u8>(buf, bco.num_upvals);
+    put_bytes(buf, bco.upvals.data, bco.upvals.size);
+    put_bytes(buf, bco.upvals_direct.data, bco.upvals_direct.size);
+    put<u8>(buf, bco.num_flat_upvals);
+    put_bytes(buf, bco.flat_upvals.data, bco.flat_upvals.size);
+    put_bytes(buf, bco.flat_upvals_direct.data, bco.flat_upvals_direct.size);
+}
+
+void cache_namespace(istate* S, symbol_id ns_id) {
+    auto& writers = S->cache->writers;
+    if (!S->cache->enabled || writers.size == 0) {
+        return;
+    }
+    auto w = writers[writers.size - 1];
+    put<u8>(w->forms, FNC_NAMESPACE);
+    put_str(w->forms, symname(S, ns_id));
+    ++w->num_forms;
+}
+
+u32 begin_cache_form(istate* S, dyn_array<symbol_id>& info_log) {
+    auto C = S->cache;
+    if (!C->enabled) {
+        return 0;
+    }
+    if (C->writers.size == 0) {
+        // code that isn't from a file changes the environment without being
+        // accounted for in the environment key
+        disable_bytecode_cache(S);
+        return 0;
+    }
+    S->G->info_log = &info_log;
+    return get_ns(S, S->ns_id)->exports.size;
+}
+
+void end_cache_form(istate* S, u32 token, const scanner_string_table& sst,
+        const bc_compiler_output* bco, dyn_array<symbol_id>& info_log) {
+    auto C = S->cache;
+    S->G->info_log = nullptr;
+    if (!C->enabled || C->writers.size == 0 || !bco) {
+        return;
+    }
+    auto w = C->writers[C->writers.size - 1];
+    auto& buf = w->forms;
+    put<u8>(buf, FNC_FUNCTION);
+
+    // names exported while compiling the form
+    auto& exports = get_ns(S, S->ns_id)->exports;
+    put<u32>(buf, exports.size > token ? exports.size - token : 0);
+    for (u32 i = token; i < exports.size; ++i) {
+        put_str(buf, symname(S, exports[i]));
+    }
+
+    // final state of the globals whose compiler information changed
+    table<symbol_id,bool> seen;
+    dyn_array<symbol_id> fqns;
+    for (auto fqn : info_log) {
+        if (!seen.get2(fqn)) {
+            seen.insert(fqn, true);
+            fqns.push_back(fqn);
+        }
+    }
+    put<u32>(buf, fqns.size);
+    for (auto fqn : fqns) {
+        put_str(buf, symname(S, fqn));
+        auto p = S->G->pure_tab.get2(fqn);
+        put<u64>(buf, p ? p->val : 0);
+        auto e = S->G->inline_tab.get2(fqn);
+        if (e && e->val) {
+            put<u8>(buf, 1);
+            put<u32>(buf, e->val->params.size);
+            for (auto x : e->val->params) {
+                put_str(buf, symname(S, x));
+            }
+            put_str(buf, symname(S, e->val->name));
+            put_str(buf, symname(S, e->val->filename));
+            put<u64>(buf, e->val->code_id);
+            put_ast(buf, e->val->body, S);
+        } else {
+            put<u8>(buf, 0);
+        }
+    }
+
+    put_bco(w, S, *bco);
+    for (u32 i = w->strings.size; i < sst.by_id.size; ++i) {
+        w->strings.push_back(sst.by_id[i]);
+    }
+    ++w->num_forms;
+}
+
+static void add_dep(cache_writer* w, const string& path, u64 hash) {
+    for (auto& d : w->deps) {
+        if (d.path == path) {
+            d.hash = hash;
+            return;
+        }
+    }
+    w->deps.push_back(cache_dep{path, hash});
+}
+
+// write out the .fnc file. Failures are silently ignored.
+static void write_fnc(cache_writer* w) {
+    auto out_path = fnc_path(w->path);
+    if (out_path == "") {
+        return;
+    }
+    dyn_array<u8> body;
+    put<u32>(body, w->deps.size);
+    for (auto& d : w->deps) {
+        put_str(body, d.path);
+        put<u64>(body, d.hash);
+    }
+    put<u32>(body, w->strings.size);
+    for (auto& s : w->strings) {
+        put_str(body, s);
+    }
+    put<u32>(body, w->globals.size);
+    for (auto& s : w->globals) {
+        put_str(body, s);
+    }
+    put<u32>(body, w->num_forms);
+    body.ensure_capacity(body.size + w->forms.size);
+    memcpy(&body.data[body.size], w->forms.data, w->forms.size);
+    body.size += w->forms.size;
+
+    fnc_header h;
+    h.magic = FNC_MAGIC;
+    h.version = FNC_VERSION;
+    h.num_ops = OP_TABLE + 1;
+    h.pad = 0;
+    h.src_hash = w->src_hash;
+    h.env_key = w->env_key;
+    h.body_size = body.size;
+    h.checksum = hash_bytes(body.data, body.size);
+
+    std::error_code ec;
+    fs::create_directories(fs::path{out_path}.parent_path(), ec);
+    auto tmp_path = out_path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out{tmp_path, std::ios::binary};
+        if (!out) {
+            return;
+        }
+        out.write((const char*)&h, sizeof(h));
+        out.write((const char*)body.data, body.size);
+        if (!out) {
+            out.close();
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_path, out_path, ec);
+    if (ec) {
+        fs::remove(tmp_path, ec);
+    }
+}
+
+
+/// reading
+
+struct fnc_reader {
+    const u8* ptr;
+    const u8* end;
+    bool ok;
+};
+
+template<typename T> static T get(fnc_reader& r) {
+    T res{};
+    if ((u64)(r.end - r.ptr) < sizeof(T)) {
+        r.ok = false;
+        return res;
+    }
+    memcpy(&res, r.ptr, sizeof(T));
+    r.ptr += sizeof(T);
+    return res;
+}
+
+static const u8* get_bytes(fnc_reader& r, u32& len) {
+    len = get<u32>(r);
+    if ((u64)(r.end - r.ptr) < len) {
+        r.ok = false;
+        len = 0;
+    }
+    auto res = r.ptr;
+    r.ptr += len;
+    return res;
+}
+
+static string get_str(fnc_reader& r) {
+    u32 len;
+    auto bytes = get_bytes(r, len);
+    return string{(const char*)bytes, len};
+}
+
+static source_loc get_loc(fnc_reader& r) {
+    source_loc res;
+    res.line = get<i32>(r);
+    res.col = get<i32>(r);
+    return res;
+}
+
+// read an AST written by put_ast(). If names is null, strings and symbols are
+// scanner_string_table IDs, which are checked against sst. Otherwise they're
+// interned in names. Returns nullptr on failure.
+static ast::node* get_ast(fnc_reader& r, const scanner_string_table& sst,
+        istate* names) {
+    auto kind = get<u8>(r);
+    auto loc = get_loc(r);
+    if (!r.ok) {
+        return nullptr;
+    }
+    switch (kind) {
+    case ast::ak_int:
+        return ast::mk_int(loc, get<i32>(r));
+    case ast::ak_float:
+        return ast::mk_float(loc, get<f64>(r));
+    case ast::ak_string:
+    case ast::ak_symbol: {
+        u32 id;
+        if (names) {
+            id = intern_id(names, get_str(r));
+        } else {
+            id = get<u32>(r);
+            if (id >= sst.by_id.size) {
+                r.ok = false;
+                return nullptr;
+            }
+        }
+        return kind == ast::ak_string ? ast::mk_string(loc, id)
+            : ast::mk_symbol(loc, id);
+    }
+    case ast::ak_list: {
+        auto len = get<u32>(r);
+        if (!r.ok || len > (u64)(r.end - r.ptr)) {
+            r.ok = false;
+            return nullptr;
+        }
+        auto items = new ast::node*[len];
+        for (u32 i = 0; i < len; ++i) {
+            items[i] = get_ast(r, sst, names);
+            if (!items[i]) {
+                for (u32 j = 0; j < i; ++j) {
+                    ast::free_graph(items[j]);
+                }
+                delete[] items;
+                return nullptr;
+            }
+        }
+        return ast::mk_list(loc, len, items);
+    }
+    default:
+        r.ok = false;
+        return nullptr;
+    }
+}
+
+template<typename T> static void get_array(fnc_reader& r, dyn_array<T>& out) {
+    u32 len;
+    auto bytes = get_bytes(r, len);
+    for (u32 i = 0; i < len; ++i) {
+        out.push_back((T)bytes[i]);
+    }
+}
+
+// state used while loading a .fnc file
+struct fnc_loader {
+    istate* S;
+    fnc_reader r;
+    scanner_string_table sst;
+    dyn_array<string> globals;
+    // global IDs for the entries of globals, or -1 if they haven't been
+    // looked up yet
+    dyn_array<u32> gids;
+};
+
+static lazy_fun* get_lazy(fnc_reader& r, istate* S) {
+    auto f = new lazy_fun;
+    auto num_strings = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_strings; ++i) {
+        scanner_intern(f->sst, get_str(r));
+    }
+    f->name = get<u32>(r);
+    f->self = get<u8>(r);
+    f->form = nullptr;
+    if (r.ok && f->name < f->sst.by_id.size) {
+        f->form = get_ast(r, f->sst, nullptr);
+    }
+    if (!f->form) {
+        delete f;
+        return nullptr;
+    }
+    S->G->lazy_funs.push_back(f);
+    return f;
+}
+
+static bool get_bco(fnc_loader& L, bc_compiler_output& out) {
+    auto& r = L.r;
+    auto S = L.S;
+    out.sst = &L.sst;
+    out.name_id = get<u32>(r);
+    if (out.name_id >= L.sst.by_id.size) {
+        return false;
+    }
+    out.lazy = nullptr;
+    if (get<u8>(r)) {
+        out.lazy = get_lazy(r, S);
+        return out.lazy != nullptr;
+    }
+    get_array(r, out.code);
+    bool globals_ok = true;
+    for_global_ids(out.code.data, out.code.size, [&L, &globals_ok](u32 i) {
+        if (i >= L.globals.size) {
+            globals_ok = false;
+            return i;
+        }
+        if (L.gids[i] == (u32)-1) {
+            L.gids[i] = get_global_id(L.S, intern_id(L.S, L.globals[i]));
+        }
+        return L.gids[i];
+    });
+    if (!globals_ok) {
+        return false;
+    }
+
+    auto num_const = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_const; ++i) {
+        auto kind = (bc_constant_kind)get<u8>(r);
+        bc_output_const::datum d;
+        switch (kind) {
+        case bck_int:
+            d.i = get<i32>(r);
+            break;
+        case bck_float:
+            d.f = get<f64>(r);
+            break;
+        case bck_string:
+        case bck_symbol:
+            d.str_id = get<u32>(r);
+            if (d.str_id >= L.sst.by_id.size) {
+                return false;
+            }
+            break;
+        case bck_quoted:
+            d.quoted = get_ast(r, L.sst, nullptr);
+            if (!d.quoted) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        out.const_table.push_back(bc_output_const{kind, d});
+    }
+
+    auto num_sub_funs = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_sub_funs; ++i) {
+        out.sub_funs.resize(out.sub_funs.size + 1);
+        if (!get_bco(L, out.sub_funs[out.sub_funs.size - 1])) {
+            return false;
+        }
+    }
+
+    auto num_ci = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_ci; ++i) {
+        code_info c{};
+        c.start_addr = get<u32>(r);
+        c.loc = get_loc(r);
+        c.inlined = get<u8>(r);
+        if (c.inlined) {
+            c.origin.name = intern_id(S, get_str(r));
+            c.origin.filename = intern_id(S, get_str(r));
+            c.origin.call_loc = get_loc(r);
+        }
+        out.ci_arr.push_back(c);
+    }
+
+    out.stack_required = get<u32>(r);
+    auto num_params = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_params; ++i) {
+        out.params.push_back(intern_id(S, get_str(r)));
+    }
+    out.num_opt = get<u8>(r);
+    out.has_vari = get<u8>(r);
+    if (out.has_vari) {
+        out.vari_param = intern_id(S, get_str(r));
+    }
+    out.num_method_caches = get<u16>(r);
+    out.num_field_caches = get<u16>(r);
+    out.memo_id = get<u64>(r);
+    out.code_id = get<u64>(r);
+    out.num_upvals = get<u8>(r);
+    get_array(r, out.upvals);
+    get_array(r, out.upvals_direct);
+    out.num_flat_upvals = get<u8>(r);
+    get_array(r, out.flat_upvals);
+    get_array(r, out.flat_upvals_direct);
+    return r.ok;
+}
+
+// replay one saved function form and run it. Returns false if the file is
+// corrupt.
+static bool run_function_form(fnc_loader& L) {
+    auto& r = L.r;
+    auto S = L.S;
+    auto num_exports = get<u32>(r);
+    auto ns = get_ns(S, S->ns_id);
+    for (u32 i = 0; r.ok && i < num_exports; ++i) {
+        add_export(ns, S, intern_id(S, get_str(r)));
+    }
+    auto num_infos = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_infos; ++i) {
+        auto fqn = intern_id(S, get_str(r));
+        auto pure_id = get<u64>(r);
+        inline_fun* f = nullptr;
+        if (get<u8>(r)) {
+            f = new inline_fun;
+            auto num_params = get<u32>(r);
+            for (u32 j = 0; r.ok && j < num_params; ++j) {
+                f->params.push_back(intern_id(S, get_str(r)));
+            }
+            f->name = intern_id(S, get_str(r));
+            f->filename = intern_id(S, get_str(r));
+            f->code_id = get<u64>(r);
+            f->body = get_ast(r, L.sst, S);
+            if (!f->body) {
+                delete f;
+                return false;
+            }
+        }
+        if (!r.ok) {
+            return false;
+        }
+        restore_global_info(S, fqn, pure_id, f);
+    }
+
+    bc_compiler_output bco;
+    if (!get_bco(L, bco)) {
+        return false;
+    }
+    pop(S);
+    reify_function(S, L.sst, bco);
+    call(S, 0);
+    return true;
+}
+
+// check the header and dependencies of a .fnc file
+static bool check_fnc(const u8* data, u64 size, u64 src_hash, u64 env_key) {
+    fnc_header h;
+    if (size < sizeof(h)) {
+        return false;
+    }
+    memcpy(&h, data, sizeof(h));
+    if (h.magic != FNC_MAGIC || h.version != FNC_VERSION
+            || h.num_ops != OP_TABLE + 1 || h.src_hash != src_hash
+            || h.env_key != env_key || h.body_size != size - sizeof(h)
+            || h.checksum != hash_bytes(data + sizeof(h), h.body_size)) {
+        return false;
+    }
+    fnc_reader r{data + sizeof(h), data + size, true};
+    auto num_deps = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_deps; ++i) {
+        auto path = get_str(r);
+        auto hash = get<u64>(r);
+        string src;
+        if (!r.ok || !read_file(path, src) || hash_source(src) != hash) {
+            return false;
+        }
+    }
+    return r.ok;
+}
+
+// Run the code in a .fnc file if it's valid. Returns false if it isn't, in
+// which case nothing has been done.
+static bool load_fnc(istate* S, const string& path, u64 src_hash,
+        u64 env_key) {
+    auto fnc = fnc_path(path);
+    if (fnc == "") {
+        return false;
+    }
+    auto fd = open(fnc.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    u64 size = st.st_size;
+    auto data = (const u8*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (!check_fnc(data, size, src_hash, env_key)) {
+        munmap((void*)data, size);
+        return false;
+    }
+
+    fnc_loader L;
+    L.S = S;
+    L.r = fnc_reader{data + sizeof(fnc_header), data + size, true};
+    auto& r = L.r;
+    // skip the dependencies
+    auto num_deps = get<u32>(r);
+    for (u32 i = 0; i < num_deps; ++i) {
+        get_str(r);
+        get<u64>(r);
+    }
+    auto num_strings = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_strings; ++i) {
+        scanner_intern(L.sst, get_str(r));
+    }
+    auto num_globals = get<u32>(r);
+    for (u32 i = 0; r.ok && i < num_globals; ++i) {
+        L.globals.push_back(get_str(r));
+        L.gids.push_back((u32)-1);
+    }
+    auto num_forms = get<u32>(r);
+
+    // from here on we're committed, since the forms have side effects
+    push_nil(S);
+    for (u32 i = 0; r.ok && i < num_forms; ++i) {
+        auto kind = get<u8>(r);
+        if (kind == FNC_NAMESPACE) {
+            switch_ns(S, intern_id(S, get_str(r)));
+        } else if (kind != FNC_FUNCTION || !run_function_form(L)) {
+            r.ok = false;
+        }
+        if (has_error(S)) {
+            break;
+        }
+    }
+    if (!r.ok) {
+        ierror(S, "Corrupt bytecode cache file: " + fnc);
+    }
+    munmap((void*)data, size);
+    return true;
+}
+
+void interpret_cached(istate* S, const string& path, const string& src) {
+    auto C = S->cache;
+    auto src_hash = hash_source(src);
+    auto env_key = C->env_key;
+    C->env_key = mix_key(env_key, src_hash);
+    if (!C->enabled) {
+        std::istringstream in{src};
+        interpret_stream(S, &in);
+        return;
+    }
+    for (auto w : C->writers) {
+        add_dep(w, path, src_hash);
+    }
+    if (load_fnc(S, path, src_hash, env_key)) {
+        return;
+    }
+
+    auto w = new cache_writer;
+    w->path = path;
+    w->src_hash = src_hash;
+    w->env_key = env_key;
+    w->num_forms = 0;
+    C->writers.push_back(w);
+    std::istringstream in{src};
+    interpret_stream(S, &in);
+    C->writers.pop();
+    if (C->enabled && !has_error(S)) {
+        write_fnc(w);
+    }
+    delete w;
+}
+
+}
@@ -0,0 +1,105 @@
+// cache.hpp -- on-disk cache of compiled bytecode
+#ifndef __FN_CACHE_HPP
+#define __FN_CACHE_HPP
+
+#include "array.hpp"
+#include "base.hpp"
+#include "compile.hpp"
+#include "istate.hpp"
+#include "scan.hpp"
+#include "table.hpp"
+
+namespace fn {
+
+// NOTE: (Bytecode cache). When a source file is loaded, the functions compiled
+// from its toplevel forms are saved next to it in a .fnc file (foo.fn ->
+// foo.fnc), or under ~/.cache/fn if its directory isn't writable, so that the
+// next time it's loaded they can be run right away without scanning, parsing,
+// macroexpanding, or compiling anything. The file is mapped into memory and
+// read in place. Along with the bytecode, it records what compiling each form
+// did to the global environment: namespace switches, exported names, and the
+// inline_tab and pure_tab entries of globals it defines. These are replayed
+// before each form is run, just as the compiler would have done them.
+//
+// Compiling a form depends on more than its source: macros, inlinable
+// functions, and builtins are all looked up in the global environment at
+// compile time. We don't try to track exactly what a file depends on. Instead
+// each istate keeps an environment key, a hash of the contents of every file
+// loaded so far, in order, which is mixed with a file's own hash when it's
+// loaded. A .fnc file is only used if it was made under the same key, i.e. by
+// an identical sequence of loads, so a program that's run over and over gets
+// cache hits for every file it loads. Files loaded while a file is running,
+// e.g. with require, are listed in its .fnc file with their hashes, since the
+// forms after a require were compiled using whatever it defined. If any of
+// them has changed, the file is compiled again. Code compiled from other
+// sources, e.g. stdin, disables the cache for the rest of the session. Like
+// macro memoization, this assumes that macros have no side effects other than
+// their expansions, since they aren't run when cached code is loaded.
+//
+// Global variables are referred to by their FQNs in .fnc files, and the global
+// IDs in the bytecode are patched when it's loaded. Symbols are saved by name.
+// .fnc files are only meant to be read on the machine that wrote them, so
+// numbers are written in native byte order. Files are written to a temporary
+// file and renamed so that concurrent processes never see a partial file, and
+// they carry a checksum of their contents in case one gets corrupted anyway.
+
+// bump this whenever the format or the bytecode changes
+constexpr u32 FNC_VERSION = 10;
+
+// a file loaded while another file was running
+struct cache_dep {
+    string path;
+    u64 hash;
+};
+
+// information saved about a source file while it's compiled
+struct cache_writer {
+    string path;
+    u64 src_hash;
+    // environment key when the file was loaded
+    u64 env_key;
+    dyn_array<cache_dep> deps;
+    // strings of the file's scanner_string_table copied so far
+    dyn_array<string> strings;
+    // FQNs of global variables, indexed by their IDs in the saved bytecode
+    dyn_array<string> globals;
+    table<u32,u32> global_index;
+    // serialized toplevel forms
+    u32 num_forms;
+    dyn_array<u8> forms;
+};
+
+// per-istate cache state
+struct bytecode_cache {
+    bool enabled;
+    // hash of the files loaded so far
+    u64 env_key;
+    // files currently being loaded, innermost last
+    dyn_array<cache_writer*> writers;
+};
+
+bytecode_cache* new_bytecode_cache();
+void free_bytecode_cache(bytecode_cache* C);
+// stop using the cache for this istate
+void disable_bytecode_cache(istate* S);
+
+// Load the source code src of the file at path, running compiled code from its
+// .fnc file if that's up to date, and otherwise interpreting the source and
+// writing a new .fnc file. Like interpret_stream(), this leaves the value of
+// the last expression on the stack.
+void interpret_cached(istate* S, const string& path, const string& src);
+
+// Called by interpret_stream() for each toplevel form. Records that the first
+// form switched to namespace ns_id.
+void cache_namespace(istate* S, symbol_id ns_id);
+// Called around the compilation of each other toplevel form. The compiler
+// logs changes to global variables in info_log in the meantime.
+// begin_cache_form() returns a token which must be passed to end_cache_form()
+// along with the compiled function, or nullptr if compilation failed.
+u32 begin_cache_form(istate* S, dyn_array<symbol_id>& info_log);
+void end_cache_form(istate* S, u32 token, const scanner_string_table& sst,
+        const bc_compiler_output* bco, dyn_array<symbol_id>& info_log);
+
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include "compile.hpp"
 
+#include "builtin.hpp"
+
 namespace fn {
 
 bc_output_const::bc_output_const(bc_constant_kind kind, bc_output_const::datum d)
@@ -45,21 +47,44 @@ static bool is_legal_local_name(const string& str) {
     return true;
 }
 
-bc_compiler::bc_compiler(bc_compiler* parent, istate* S,
-        scanner_string_table& sst, bc_compiler_output& output)
-    : parent{parent}
-    , S{S}
-    , sst{&sst}
-    , sp{0}
-    , output{&output} {
+static void init_output(bc_compiler_output& output,
+        scanner_string_table& sst) {
     output.sst = &sst;
     output.name_id = scanner_intern(sst, "<toplevel>");
     output.stack_required = 0;
     output.num_opt = 0;
     output.has_vari = false;
+    output.num_method_caches = 0;
+    output.num_field_caches = 0;
+    output.memo_id = 0;
+    output.code_id = 0;
+    output.lazy = nullptr;
     output.num_upvals = 0;
+    output.num_flat_upvals = 0;
+
+    output.ci_arr.push_back(code_info{0, source_loc{0,0,false,0}, false,
+                inline_origin{}});
+}
 
-    output.ci_arr.push_back(code_info{0, source_loc{0,0,false,0}});
+bc_compiler::bc_compiler(bc_compiler* parent, istate* S,
+        scanner_string_table& sst, bc_compiler_output& output)
+    : parent{parent}
+    , S{S}
+    , sst{&sst}
+    , sp{0}
+    , num_vars{0}
+    , output{&output}
+    , last_op{(u32)-1}
+    , jump_target{(u32)-1}
+    , bound_value{nullptr}
+    , has_self{false}
+    , captured{false}
+    , toplevel_form{nullptr}
+    , origin{}
+    , expansions{parent ? parent->expansions : nullptr}
+    , deferred{nullptr}
+    , deferred_form{nullptr} {
+    init_output(output, sst);
 }
 
 void bc_compiler::pop_vars(u8 sp) {
@@ -71,8 +96,18 @@ void bc_compiler::pop_vars(u8 sp) {
     }
 }
 
-void bc_compiler::push_var(sst_id name) {
-    vars.push_back(lexical_var{name, sp});
+static bool has_name(const dyn_array<sst_id>& names, sst_id name) {
+    for (u32 i = 0; i < names.size; ++i) {
+        if (names[i] == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void bc_compiler::push_var(sst_id name, bool initialized) {
+    vars.push_back(lexical_var{name, sp, num_vars++, initialized,
+                has_name(set_targets, name), nt_unknown, nullptr});
 }
 
 bool bc_compiler::find_local_var(u8& index, sst_id name) {
@@ -86,28 +121,180 @@ bool bc_compiler::find_local_var(u8& index, sst_id name) {
     return false;
 }
 
-bool bc_compiler::find_upvalue_var(u8& index, sst_id name) {
+lexical_var* bc_compiler::lookup_local_var(sst_id name) {
+    // same search order as find_local_var()
+    for (u32 i = 0; i < vars.size; ++i) {
+        if (vars[i].name == name) {
+            return &vars[i];
+        }
+    }
+    return nullptr;
+}
+
+lexical_var* bc_compiler::lookup_lexical_var(sst_id name) {
+    for (auto c = this; c; c = c->parent) {
+        auto var = c->lookup_local_var(name);
+        if (var) {
+            return var;
+        }
+    }
+    return nullptr;
+}
+
+lexical_var* bc_compiler::local_var_at(u8 index) {
+    for (u32 i = vars.size; i > 0; --i) {
+        if (vars[i-1].index == index) {
+            return &vars[i-1];
+        }
+    }
+    return nullptr;
+}
+
+// NOTE: (Mutated variables). Whether a local variable is ever the target of a
+// set! decides how closures capture it and whether its type can be inferred,
+// but the set! may come after the variable is used. So before a function is
+// compiled, its body is searched for set! forms by collect_set_targets(), and
+// variables with any of the names found are treated as mutated. This goes
+// through macros using the same expansion cache as the compiler, so each macro
+// call is still only expanded once. It doesn't know which variable each name
+// refers to, so a set! of a variable shadowing another one makes both of them
+// mutated, which only costs some speed.
+//
+// The search includes the functions nested in the body, since they may set!
+// the variables they capture. The exception is at toplevel before any let
+// form, where there are no variables to capture and fn forms are compiled
+// lazily (see NOTE: (Lazy compilation)), so they shouldn't be expanded yet.
+
+// A captured variable which already holds its value and is never the target of
+// a set! can't change after the closure is created, so its value is copied
+// into the function object as a flat upvalue. Everything else goes through an
+// upvalue cell.
+bool bc_compiler::find_upvalue_var(u8& index, bool& flat, sst_id name) {
     auto x = upvals.get(name);
     if (x.has_value()) {
         index = *x;
+        flat = false;
+        return true;
+    }
+    x = flat_upvals.get(name);
+    if (x.has_value()) {
+        index = *x;
+        flat = true;
         return true;
     }
 
     // look in the enclosing function
-    if (parent) {
-        u8 upval_index;
-        bool direct = parent->find_local_var(upval_index, name);
-        if (direct || parent->find_upvalue_var(upval_index, name)) {
-            index = output->num_upvals;
-            upvals.insert(name, index);
-            output->upvals.push_back(upval_index);
-            output->upvals_direct.push_back(direct);
-            ++output->num_upvals;
-            return true;
+    if (!parent) {
+        return false;
+    }
+    u8 upval_index;
+    bool direct;
+    auto var = parent->lookup_local_var(name);
+    if (var) {
+        direct = true;
+        upval_index = var->index;
+        flat = var->initialized && !var->mutated;
+        if (!flat) {
+            parent->captured = true;
         }
+    } else if (parent->find_upvalue_var(upval_index, flat, name)) {
+        direct = false;
+    } else {
+        return false;
     }
 
-    return false;
+    if (flat) {
+        index = output->num_flat_upvals;
+        flat_upvals.insert(name, index);
+        output->flat_upvals.push_back(upval_index);
+        output->flat_upvals_direct.push_back(direct);
+        ++output->num_flat_upvals;
+    } else {
+        index = output->num_upvals;
+        upvals.insert(name, index);
+        output->upvals.push_back(upval_index);
+        output->upvals_direct.push_back(direct);
+        ++output->num_upvals;
+    }
+    return true;
+}
+
+void bc_compiler::collect_set_targets(dyn_array<sst_id>& out,
+        const ast::node* expr, bool& fns) {
+    if (expr->kind != ast::ak_list || has_error(S)) {
+        return;
+    }
+    auto expanded = macroexpand(expr);
+    if (expanded) {
+        collect_set_targets(out, expanded, fns);
+        return;
+    } else if (expr->list_length == 0) {
+        return;
+    }
+    u32 start = 0;
+    auto op = expr->datum.list[0];
+    if (op->kind == ast::ak_symbol) {
+        auto sid = intern_id(S, scanner_name(*sst, op->datum.str_id));
+        start = 1;
+        if (sid == cached_sym(S, SC_QUOTE) || sid == cached_sym(S, SC_IMPORT)
+                || sid == cached_sym(S, SC_NAMESPACE)) {
+            return;
+        } else if (sid == cached_sym(S, SC_SET)) {
+            auto target = expr->list_length > 1 ? expr->datum.list[1] : nullptr;
+            if (target && target->kind == ast::ak_symbol
+                    && !has_name(out, target->datum.str_id)) {
+                out.push_back(target->datum.str_id);
+            }
+        } else if (sid == cached_sym(S, SC_LET)) {
+            fns = true;
+        } else if (sid == cached_sym(S, SC_FN)
+                || sid == cached_sym(S, SC_DEFMACRO)) {
+            // skip the name and the parameter list, except for the initforms
+            // of optional parameters, which belong to the enclosing function
+            u32 params_pos = sid == cached_sym(S, SC_FN) ? 1 : 2;
+            if (expr->list_length <= params_pos) {
+                return;
+            }
+            auto params = expr->datum.list[params_pos];
+            for (u32 i = 0; params->kind == ast::ak_list
+                         && i < params->list_length; ++i) {
+                auto x = params->datum.list[i];
+                if (x->kind == ast::ak_list && x->list_length == 2) {
+                    collect_set_targets(out, x->datum.list[1], fns);
+                }
+            }
+            if (sid == cached_sym(S, SC_FN) && !fns) {
+                return;
+            }
+            start = params_pos + 1;
+        }
+    }
+    for (u32 i = start; i < expr->list_length; ++i) {
+        collect_set_targets(out, expr->datum.list[i], fns);
+    }
+}
+
+void bc_compiler::inc_sp() {
+    ++sp;
+    if (sp > output->stack_required) {
+        output->stack_required = sp;
+    }
+}
+
+void bc_compiler::emit_op(u8 op) {
+    auto& code = output->code;
+    // fuse with the previous instruction if it ends right here. Nothing may
+    // jump in between the two instructions.
+    if (last_op < code.size && code.size != jump_target
+            && last_op + instr_width(code[last_op]) == code.size) {
+        auto fused = fuse_instrs(code[last_op], op);
+        if (fused != OP_NOP) {
+            code[last_op] = fused;
+            return;
+        }
+    }
+    last_op = code.size;
+    code.push_back(op);
 }
 
 void bc_compiler::emit8(u8 u) {
@@ -128,14 +315,25 @@ void bc_compiler:: emit32(u32 u) {
     *(u32*)&output->code[output->code.size - 4] = u;
 }
 
+void bc_compiler::emit64(u64 u) {
+    emit32((u32)u);
+    emit32((u32)(u >> 32));
+}
+
 void bc_compiler::update_source(const source_loc& loc) {
-    output->ci_arr.push_back(code_info{output->code.size, loc});
+    output->ci_arr.push_back(code_info{output->code.size, loc,
+            inlining.size > 0, origin});
 }
 
 void bc_compiler::patch16(u16 u, u32 where) {
     *(u16*)&output->code[where] = u;
 }
 
+void bc_compiler::patch_jump(u32 where) {
+    patch16(output->code.size - where - 2, where);
+    jump_target = output->code.size;
+}
+
 bool bc_compiler::process_params(const ast::node* params,
         dyn_array<sst_id>& pos_params, dyn_array<ast::node*>& init_vals,
         bool& has_vari, sst_id& vari) {
@@ -199,462 +397,2225 @@ bool bc_compiler::process_params(const ast::node* params,
     return true;
 }
 
-ast::node* bc_compiler::macroexpand(const ast::node* macro_form) {
-    if (macro_form->kind != ast::ak_list) {
+// The macro's arguments are pushed twice, once to be passed to it and once to
+// be kept on the stack while it runs. The second copy lets us find the conses
+// that made it into the expansion unchanged, even after the garbage collector
+// has moved them (see syntax_origins in istate.hpp).
+ast::node* bc_compiler::expand_once(const ast::node* form) {
+    if (form->kind != ast::ak_list) {
         return nullptr;
-    } else if (macro_form->list_length == 0) {
+    } else if (form->list_length == 0) {
         return nullptr;
-    } else if (macro_form->datum.list[0]->kind != ast::ak_symbol) {
+    } else if (form->datum.list[0]->kind != ast::ak_symbol) {
         return nullptr;
     }
 
-    auto name = scanner_name(*sst, macro_form->datum.list[0]->datum.str_id);
-    if (push_macro(S, intern_id(S, name))) {
-        for (u32 i = 1; i < macro_form->list_length; ++i) {
-            push_quoted(S, *sst, macro_form->datum.list[i]);
-        }
-        call(S, macro_form->list_length - 1);
-        if (has_error(S)) {
-            return nullptr;
-        }
-    } else {
+    auto name = scanner_name(*sst, form->datum.list[0]->datum.str_id);
+    auto save_sp = S->sp;
+    if (!push_macro(S, intern_id(S, name))) {
         return nullptr;
     }
-    ast::node* form;
-    // FIXME: check pop_syntax return value
-    pop_syntax(form, S, *sst);
-    while (true) {
-        if (form->kind != ast::ak_list) {
-            break;
-        } else if (form->list_length == 0) {
-            break;
-        } else if (form->datum.list[0]->kind != ast::ak_symbol) {
-            break;
+    auto num_args = form->list_length - 1;
+    auto macro_id = vfunction(S->stack[save_sp])->stub->memo_id;
+    u64 key = macro_id;
+    u64 check = macro_id;
+    if (macro_id != 0) {
+        for (u32 i = 1; i < form->list_length; ++i) {
+            hash_syntax(key, check, form->datum.list[i]);
         }
-        name = scanner_name(*sst, form->datum.list[0]->datum.str_id);
-        if (push_macro(S, intern_id(S, name))) {
-            for (u32 i = 1; i < form->list_length; ++i) {
-                push_quoted(S, *sst, form->datum.list[i]);
-            }
-            call(S, form->list_length - 1);
-            ast::free_graph(form);
-            if (has_error(S)) {
-                return nullptr;
-            }
-            pop_syntax(form, S, *sst);
-        } else {
-            break;
+        auto res = find_macro_memo(form, macro_id, key, check);
+        if (res) {
+            S->sp = save_sp;
+            return res;
         }
     }
+    for (u32 i = 1; i < form->list_length; ++i) {
+        push_quoted(S, *sst, form->datum.list[i]);
+    }
+    push(S, S->stack[save_sp]);
+    for (u32 i = 0; i < num_args; ++i) {
+        push(S, S->stack[save_sp + 1 + i]);
+    }
+    call(S, num_args);
+    if (has_error(S)) {
+        return nullptr;
+    }
+    syntax_origins origins;
+    origins.loc = form->loc;
+    origins.sym_ids = &expansions->sym_ids;
+    dyn_array<syntax_copy> copies;
+    if (macro_id != 0) {
+        origins.copies = &copies;
+    }
+    for (u32 i = 0; i < num_args; ++i) {
+        record_syntax_origins(origins, S->stack[save_sp + 1 + i],
+                form->datum.list[i + 1], *sst);
+    }
+    finish_syntax_origins(origins);
+    ast::node* res;
+    if (!pop_syntax(res, S, *sst, origins)) {
+        compile_error(form->loc, "Macro expansion is not valid syntax.");
+        return nullptr;
+    }
+    S->sp = save_sp;
+    if (macro_id != 0) {
+        add_macro_memo(form, res, macro_id, key, check, copies);
+    }
+    return res;
+}
 
-    return form;
+expansion_cache::~expansion_cache() {
+    for (u32 i = 0; i < owned.size; ++i) {
+        ast::free_graph(owned[i]);
+    }
 }
 
-bool bc_compiler::compile_def(const ast::node* ast) {
-    // validate the def form
-    if (ast->list_length != 3) {
-        compile_error(ast->loc, "def requires exactly 2 arguments.");
-        return false;
+const ast::node* bc_compiler::macroexpand(const ast::node* macro_form) {
+    if (macro_form->kind != ast::ak_list) {
+        return nullptr;
     }
-    auto name = ast->datum.list[1];
-    if (name->kind != ast::ak_symbol) {
-        compile_error(name->loc, "def name must be a symbol.");
-        return false;
+    auto key = (u64)macro_form;
+    auto e = expansions->forms.get2(key);
+    if (e) {
+        return e->val;
     }
-    auto name_str = scanner_name(*sst, name->datum.str_id);
-    if (name_str.find(":") != string::npos) {
-        compile_error(name->loc, "def name cannot include colons.");
-        return false;
+    auto form = expand_once(macro_form);
+    while (form) {
+        auto next = expand_once(form);
+        if (!next) {
+            break;
+        }
+        ast::free_graph(form);
+        form = next;
     }
-    auto val = ast->datum.list[2];
-    if (!compile(val, false)) {
-        return false;
+    if (has_error(S)) {
+        if (form) {
+            ast::free_graph(form);
+        }
+        return nullptr;
     }
-    u32 gid;
-    if (!lookup_global_id(gid, name->datum.str_id)) {
-        return false;
+    expansions->forms.insert(key, form);
+    if (form) {
+        expansions->owned.push_back(form);
     }
-    emit8(OP_SET_GLOBAL);
-    emit32(gid);
-    --sp;
-    // register the global variable in the namespace
-    auto ns = get_ns(S, S->ns_id);
-    add_export(ns, S, intern_id(S, name_str));
-    return true;
+    return form;
 }
 
-bool bc_compiler::lookup_global_id(u32& out, sst_id str_id) {
-    symbol_id fqn;
-    if (!resolve_symbol(fqn, S, intern_id(S, scanner_name(*sst, str_id)))) {
-        return false;
+// NOTE: (Macro memoization). Most macros are pure functions of their
+// arguments, so when the same macro call is compiled again, e.g. when a file is
+// loaded twice or two files use the same idiom, the expansion can be reused
+// without running the macro or converting its result back to syntax.
+//
+// Purity is inferred when a macro is defined. The macroexpanded body may only
+// use its own local variables, constants, special forms without side effects
+// (so not def, defmacro, import, set!, or the dot operator), and globals whose
+// values are pure. Those are the builtins accepted by builtin_deterministic()
+// and the globals defined at toplevel by a def whose value passes the same
+// test, which are kept in S->G->pure_tab. Closures made inside the macro are
+// checked too. Since the only functions a pure macro can get hold of are pure
+// ones, calling them is fine, even when they're its own local variables.
+//
+// Each pure macro gets an ID, stored in function_stub::memo_id, that is a hash
+// of its code. Global variables are hashed by their own IDs rather than their
+// names, so the ID changes if a global the macro uses is defined differently,
+// and it stays the same when a file is reloaded without changes. A def which
+// changes the ID of a global discards all memoized expansions, since macros
+// defined earlier still use the old ID. Like inlining, this assumes that
+// globals aren't changed with set!.
+//
+// Expansions are stored in S->G->macro_memos under a hash of the macro's ID and
+// the structure of the arguments. Rather than keeping a copy of the arguments
+// to compare against, each entry holds a second hash of them computed with an
+// independent function, which must match too. Lists in the expansion which
+// pop_syntax() copied from the arguments are stored as paths into the
+// arguments, so that hits copy them from the new call, keeping their source
+// locations. The other nodes are given the location of the call, as they are
+// for a fresh expansion.
+
+// record that the inline_tab or pure_tab entry for fqn changed, for the bytecode
+// cache (see NOTE: (Bytecode cache) in cache.cpp)
+static void log_global_info(global_env* G, symbol_id fqn) {
+    if (G->info_log) {
+        G->info_log->push_back(fqn);
     }
-    out = get_global_id(S, fqn);
-    return true;
 }
 
-bool bc_compiler::compile_const_symbol(sst_id str_id) {
-    auto cid = output->const_table.size;
-    output->const_table.push_back(bc_output_const{
-                bck_symbol,
-                { .str_id = str_id }
-            });
-    emit8(OP_CONST);
-    emit16(cid);
-    return true;
+static u64 mix_id(u64 h, u64 x) {
+    h = (h + x) * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 32);
 }
 
-bool bc_compiler::compile_sub_fun(const ast::node* params,
-        const ast::node** body, u32 body_len, const string& name) {
-    dyn_array<sst_id> pos_params;
-    dyn_array<ast::node*> init_vals;
-    bool has_vari;
-    sst_id vari;
-    if (!process_params(params, pos_params, init_vals,
-                    has_vari, vari)) {
-        return false;
-    }
-    // compile the child function
-    bc_compiler_output child_out;
-    bc_compiler child{this, S, *sst, child_out};
-    // FIXME: incorporate function name into compiler output
+// a second, independent hash function, used to check for collisions
+static u64 mix_check(u64 h, u64 x) {
+    h = (h ^ x) * 0xbf58476d1ce4e5b9;
+    return h ^ (h >> 31);
+}
 
-    child_out.name_id = scanner_intern(*sst, name);
-    // set up arguments as local variables
-    for (auto p : pos_params) {
-        child_out.params.push_back(p);
-        child.push_var(p);
-        ++child.sp;
+// ID used for references from a global's value to the global itself, so that
+// recursive functions can be pure
+constexpr u64 PURE_SELF_ID = 1;
+
+bool bc_compiler::pure_id(u64& id, const ast::node* expr,
+        dyn_array<symbol_id>& locals) {
+    if (expr->kind == ast::ak_list) {
+        auto expanded = macroexpand(expr);
+        if (expanded) {
+            expr = expanded;
+        } else if (has_error(S)) {
+            return false;
+        }
     }
-    if (has_vari) {
-        child_out.has_vari = true;
-        child_out.vari_param = vari;
-        child.push_var(vari);
-        ++child.sp;
+    id = mix_id(id, expr->kind);
+    switch (expr->kind) {
+    case ast::ak_int:
+        id = mix_id(id, (u32)expr->datum.i);
+        return true;
+    case ast::ak_float: {
+        u64 bits;
+        memcpy(&bits, &expr->datum.f, sizeof(bits));
+        id = mix_id(id, bits);
+        return true;
     }
-    if (!child.compile_function_body(body, body_len)) {
+    case ast::ak_string:
+        id = mix_id(id, sst_symbol(expr->datum.str_id));
+        return true;
+    case ast::ak_symbol:
+        break;
+    case ast::ak_list:
+        return pure_list_id(id, expr, locals);
+    default:
         return false;
     }
 
-    // code to create the function object
-    auto save_sp = sp;
-    for (auto x : init_vals) {
-        if (!compile(x, false)) {
-            return false;
+    auto sid = sst_symbol(expr->datum.str_id);
+    id = mix_id(id, sid);
+    for (auto x : locals) {
+        if (x == sid) {
+            return true;
         }
     }
-    auto child_id = output->sub_funs.size;
-    output->sub_funs.push_back(child_out);
-    emit8(OP_CLOSURE);
-    emit16(child_id);
-    sp = save_sp + 1;
-    return true;
-}
-
-bool bc_compiler::compile_defmacro(const ast::node* root) {
-    if (root->list_length < 3) {
-        compile_error(root->loc, "defmacro requires a name and parameter list.");
-        return false;
-    }
-    if (root->datum.list[1]->kind != ast::ak_symbol) {
-        compile_error(root->loc, "defmacro name must be a symbol.");
-        return false;
+    if (sid == cached_sym(S, SC_YES) || sid == cached_sym(S, SC_NO)
+            || sid == cached_sym(S, SC_NIL)) {
+        return true;
     }
-    auto name_id = root->datum.list[1]->datum.str_id;
-    // resolve the full symbol name
-    auto sid = intern_id(S, scanner_name(*sst, name_id));
+    // variables captured from enclosing functions could be anything
     symbol_id fqn;
-    if (!resolve_symbol(fqn, S, sid)) {
+    if (is_lexical_var(expr->datum.str_id) || !resolve_symbol(fqn, S, sid)) {
         return false;
     }
-    // TODO: check name legality
-    if (!compile_sub_fun(root->datum.list[2],
-                    (const ast::node**)&root->datum.list[3],
-                    root->list_length - 3, "macro:" + symname(S, fqn))) {
+    u64 global_id;
+    if (!global_pure_id(global_id, fqn)) {
         return false;
     }
-
-    auto cid = output->const_table.size;
-    output->const_table.push_back(bc_output_const{
-                bck_symbol,
-                { .str_id = scanner_intern(*sst, symname(S, fqn))}
-            });
-    emit8(OP_SET_MACRO);
-    emit16(cid);
-    // register the global variable in the namespace
-    auto ns = get_ns(S, S->ns_id);
-    add_export(ns, S, intern_id(S, scanner_name(*sst, name_id)));
-
-    // defmacro returns nil
-    emit8(OP_NIL);
-
+    id = mix_id(id, global_id);
     return true;
 }
 
-bool bc_compiler::compile_do(const ast::node* root, bool tail) {
-    return compile_body((const ast::node**)&root->datum.list[1],
-            root->list_length-1, tail);
-}
-
-bool bc_compiler::compile_if(const ast::node* root, bool tail) {
-    // validate the if form
-    if (root->list_length != 4) {
-        compile_error(root->loc, "if requires exactly 3 arguments.");
-        return false;
+bool bc_compiler::pure_list_id(u64& id, const ast::node* expr,
+        dyn_array<symbol_id>& locals) {
+    id = mix_id(id, expr->list_length);
+    if (expr->list_length == 0) {
+        return true;
     }
-    if (!compile(root->datum.list[1], false)) {
+    auto op = expr->datum.list[0];
+    if (is_quoted_symbol(op)) {
+        // method calls depend on metatables
         return false;
     }
-    emit8(OP_CJUMP);
-    auto patch_addr1 = output->code.size;
-    emit16(0);
-    --sp;
-
-    if (!compile(root->datum.list[2], tail)) {
-        return false;
+    u32 start = 0;
+    auto save_locals = locals.size;
+    if (op->kind == ast::ak_symbol) {
+        auto sid = sst_symbol(op->datum.str_id);
+        if (sid == cached_sym(S, SC_QUOTE)) {
+            id = mix_id(id, sid);
+            // only the first hash is needed here
+            u64 check = 0;
+            for (u32 i = 1; i < expr->list_length; ++i) {
+                hash_syntax(id, check, expr->datum.list[i]);
+            }
+            return true;
+        } else if (sid == cached_sym(S, SC_DEF)
+                || sid == cached_sym(S, SC_DEFMACRO)
+                || sid == cached_sym(S, SC_IMPORT)
+                || sid == cached_sym(S, SC_SET)
+                || sid == cached_sym(S, SC_NAMESPACE)
+                || scanner_name(*sst, op->datum.str_id) == ".") {
+            return false;
+        } else if (sid == cached_sym(S, SC_FN)) {
+            id = mix_id(id, sid);
+            return expr->list_length >= 2
+                && pure_fun_id(id, expr->datum.list[1],
+                        (const ast::node**)&expr->datum.list[2],
+                        expr->list_length - 2, locals);
+        } else if (sid == cached_sym(S, SC_LET)) {
+            if (expr->list_length % 2 != 1) {
+                return false;
+            }
+            id = mix_id(id, sid);
+            for (u32 i = 1; i < expr->list_length; i += 2) {
+                auto var = expr->datum.list[i];
+                if (var->kind != ast::ak_symbol) {
+                    return false;
+                }
+                // the variable is in scope in its own value, so that local
+                // functions can be recursive
+                auto var_id = sst_symbol(var->datum.str_id);
+                locals.push_back(var_id);
+                id = mix_id(id, var_id);
+                if (!pure_id(id, expr->datum.list[i+1], locals)) {
+                    return false;
+                }
+            }
+            // let variables stay in scope for the rest of the body
+            return true;
+        } else if (sid == cached_sym(S, SC_DO_INLINE)) {
+            // like let, this binds variables for the rest of the body
+            id = mix_id(id, sid);
+            for (u32 i = 1; i < expr->list_length; ++i) {
+                if (!pure_id(id, expr->datum.list[i], locals)) {
+                    return false;
+                }
+            }
+            return true;
+        } else if (sid == cached_sym(S, SC_DO)
+                || sid == cached_sym(S, SC_IF)
+                || sid == cached_sym(S, SC_APPLY)
+                || sid == cached_sym(S, SC_LIST)) {
+            id = mix_id(id, sid);
+            start = 1;
+        }
     }
-    emit8(OP_JUMP);
-    auto patch_addr2 = output->code.size;
-    emit16(0);
+    bool res = true;
+    for (u32 i = start; i < expr->list_length; ++i) {
+        if (!pure_id(id, expr->datum.list[i], locals)) {
+            res = false;
+            break;
+        }
+    }
+    // Variables bound inside the form go out of scope. This may end their
+    // scope too early, but that only makes the check stricter.
+    while (locals.size > save_locals) {
+        locals.pop();
+    }
+    return res;
+}
 
-    patch16(output->code.size - patch_addr1 - 2, patch_addr1);
-    --sp;
-    if (!compile(root->datum.list[3], tail)) {
+bool bc_compiler::pure_fun_id(u64& id, const ast::node* params,
+        const ast::node** body, u32 body_len, dyn_array<symbol_id>& locals) {
+    if (params->kind != ast::ak_list) {
         return false;
     }
+    auto save_locals = locals.size;
+    dyn_array<symbol_id> new_locals;
+    bool res = true;
+    id = mix_id(id, params->list_length);
+    for (u32 i = 0; i < params->list_length; ++i) {
+        auto x = params->datum.list[i];
+        if (x->kind == ast::ak_list && x->list_length == 2
+                && x->datum.list[0]->kind == ast::ak_symbol) {
+            // optional parameters are initialized outside the function
+            if (!pure_id(id, x->datum.list[1], locals)) {
+                return false;
+            }
+            x = x->datum.list[0];
+        } else if (x->kind != ast::ak_symbol) {
+            return false;
+        }
+        auto sid = sst_symbol(x->datum.str_id);
+        id = mix_id(id, sid);
+        new_locals.push_back(sid);
+    }
+    for (auto x : new_locals) {
+        locals.push_back(x);
+    }
+    id = mix_id(id, body_len);
+    for (u32 i = 0; i < body_len; ++i) {
+        if (!pure_id(id, body[i], locals)) {
+            res = false;
+            break;
+        }
+    }
+    while (locals.size > save_locals) {
+        locals.pop();
+    }
+    return res;
+}
+
+bool bc_compiler::global_pure_id(u64& id, symbol_id fqn) {
+    auto e = S->G->pure_tab.get2(fqn);
+    if (e) {
+        id = e->val;
+        return id != 0;
+    }
+    value v;
+    if (!get_global(v, S, fqn) || v == V_UNIN) {
+        // Using an undefined variable raises an error, which is fine. Giving
+        // it an ID means memoized expansions will be discarded once it's
+        // defined.
+        id = mix_id(fqn, V_UNIN.raw);
+    } else if (vis_function(v) && builtin_deterministic(vfunction(v))) {
+        // builtins are identified by their implementation
+        id = (u64)vfunction(v)->stub->foreign;
+    } else {
+        id = 0;
+    }
+    // remember the ID so that register_pure() can tell when it changes
+    S->G->pure_tab.insert(fqn, id);
+    log_global_info(S->G, fqn);
+    return id != 0;
+}
+
+void bc_compiler::register_pure(symbol_id fqn, const ast::node* val,
+        bool toplevel) {
+    // only IDs in pure_tab can have been used by memoized expansions
+    auto e = S->G->pure_tab.get2(fqn);
+    u64 old_id = e ? e->val : 0;
+    u64 id = 0;
+    if (toplevel) {
+        S->G->pure_tab.insert(fqn, PURE_SELF_ID);
+        dyn_array<symbol_id> locals;
+        if (!pure_id(id, val, locals) || id == 0) {
+            id = 0;
+        }
+    }
+    S->G->pure_tab.insert(fqn, id);
+    log_global_info(S->G, fqn);
+    if (old_id != 0 && old_id != id) {
+        clear_macro_memos(S->G);
+    }
+}
+
+void restore_global_info(istate* S, symbol_id fqn, u64 pure_id,
+        inline_fun* f) {
+    auto e = S->G->inline_tab.get2(fqn);
+    if (e && e->val) {
+        ast::free_graph(e->val->body);
+        delete e->val;
+        e->val = nullptr;
+    }
+    if (f) {
+        S->G->inline_tab.insert(fqn, f);
+    }
+    // same as register_pure()
+    auto p = S->G->pure_tab.get2(fqn);
+    u64 old_id = p ? p->val : 0;
+    S->G->pure_tab.insert(fqn, pure_id);
+    log_global_info(S->G, fqn);
+    if (old_id != 0 && old_id != pure_id) {
+        clear_macro_memos(S->G);
+    }
+}
+
+symbol_id bc_compiler::sst_symbol(sst_id id) {
+    auto& syms = sst->syms;
+    while (syms.size <= id) {
+        syms.push_back(0);
+    }
+    if (syms[id] == 0) {
+        syms[id] = intern_id(S, scanner_name(*sst, id)) + 1;
+    }
+    return syms[id] - 1;
+}
+
+void bc_compiler::hash_syntax(u64& h, u64& check, const ast::node* expr) {
+    u64 x;
+    switch (expr->kind) {
+    case ast::ak_int:
+        x = (u32)expr->datum.i;
+        break;
+    case ast::ak_float:
+        memcpy(&x, &expr->datum.f, sizeof(x));
+        break;
+    case ast::ak_string:
+    case ast::ak_symbol:
+        x = sst_symbol(expr->datum.str_id);
+        break;
+    case ast::ak_list:
+    default:
+        x = expr->list_length;
+        break;
+    }
+    h = mix_id(mix_id(h, expr->kind), x);
+    check = mix_check(mix_check(check, expr->kind), x);
+    if (expr->kind == ast::ak_list) {
+        for (u32 i = 0; i < expr->list_length; ++i) {
+            hash_syntax(h, check, expr->datum.list[i]);
+        }
+    }
+}
+
+// follow a path stored in a macro_memo to a node in the arguments of form,
+// returning nullptr if the arguments don't have that shape
+static const ast::node* follow_arg_path(const ast::node* form,
+        const u32* path) {
+    if (path[0] == 0 || path[1] + 1 >= form->list_length) {
+        return nullptr;
+    }
+    auto node = form->datum.list[path[1] + 1];
+    for (u32 i = 2; i <= path[0]; ++i) {
+        if (node->kind != ast::ak_list || path[i] >= node->list_length) {
+            return nullptr;
+        }
+        node = node->datum.list[path[i]];
+    }
+    return node->kind == ast::ak_list ? node : nullptr;
+}
+
+ast::node* bc_compiler::find_macro_memo(const ast::node* form, u64 macro_id,
+        u64 key, u64 check) {
+    auto e = S->G->macro_memos.get2(key);
+    if (!e) {
+        return nullptr;
+    }
+    auto m = e->val;
+    if (m->macro_id != macro_id || m->check != check) {
+        return nullptr;
+    }
+    for (u32 p = 0; p < m->arg_paths.size; p += m->arg_paths[p] + 1) {
+        if (!follow_arg_path(form, &m->arg_paths[p])) {
+            return nullptr;
+        }
+    }
+    u32 i = 0;
+    return instantiate_memo(m, i, form);
+}
+
+// find the paths from the root to the nodes in node_paths, which maps the nodes
+// to their offsets in paths. path holds the path to expr, and left counts the
+// nodes not found yet.
+static void find_paths(table<u64,u32>& node_paths, dyn_array<u32>& paths,
+        dyn_array<u32>& path, u32& left, const ast::node* expr) {
+    if (left == 0 || expr->kind != ast::ak_list) {
+        return;
+    }
+    auto e = node_paths.get2((u64)expr);
+    if (e && e->val == (u32)-1) {
+        --left;
+        e->val = paths.size;
+        paths.push_back(path.size);
+        for (u32 i = 0; i < path.size; ++i) {
+            paths.push_back(path[i]);
+        }
+    }
+    for (u32 i = 0; i < expr->list_length; ++i) {
+        path.push_back(i);
+        find_paths(node_paths, paths, path, left, expr->datum.list[i]);
+        path.pop();
+    }
+}
+
+void bc_compiler::add_macro_memo(const ast::node* form,
+        const ast::node* expansion, u64 macro_id, u64 key, u64 check,
+        const dyn_array<syntax_copy>& copies) {
+    auto G = S->G;
+    if (G->macro_memos.get_size() >= MACRO_MEMO_MAX) {
+        clear_macro_memos(G);
+    }
+    // paths to the lists that were copied from the arguments, and the offsets
+    // of those paths indexed by the copies
+    dyn_array<u32> paths;
+    table<u64,u32> copy_paths;
+    if (copies.size > 0) {
+        table<u64,u32> node_paths;
+        for (u32 i = 0; i < copies.size; ++i) {
+            node_paths.insert((u64)copies[i].node, (u32)-1);
+        }
+        dyn_array<u32> path;
+        u32 left = node_paths.get_size();
+        for (u32 i = 1; i < form->list_length; ++i) {
+            path.push_back(i - 1);
+            find_paths(node_paths, paths, path, left, form->datum.list[i]);
+            path.pop();
+        }
+        for (u32 i = 0; i < copies.size; ++i) {
+            auto p = node_paths.get2((u64)copies[i].node)->val;
+            if (p == (u32)-1) {
+                // shouldn't happen, since copies come from the arguments
+                return;
+            }
+            copy_paths.insert((u64)copies[i].copy, p);
+        }
+    }
+
+    auto m = new macro_memo;
+    m->macro_id = macro_id;
+    m->check = check;
+    flatten_memo(m, expansion, copy_paths, paths);
+    auto e = G->macro_memos.get2(key);
+    if (e) {
+        delete e->val;
+    }
+    G->macro_memos.insert(key, m);
+}
+
+void bc_compiler::flatten_memo(macro_memo* m, const ast::node* expr,
+        const table<u64,u32>& copy_paths, const dyn_array<u32>& paths) {
+    switch (expr->kind) {
+    case ast::ak_int:
+        m->expansion.push_back(((u64)(u32)expr->datum.i << 8) | ast::ak_int);
+        return;
+    case ast::ak_float: {
+        u64 bits;
+        memcpy(&bits, &expr->datum.f, sizeof(bits));
+        m->expansion.push_back(ast::ak_float);
+        m->expansion.push_back(bits);
+        return;
+    }
+    case ast::ak_string:
+    case ast::ak_symbol:
+        m->expansion.push_back(((u64)sst_symbol(expr->datum.str_id) << 8)
+                | expr->kind);
+        return;
+    default:
+        break;
+    }
+    auto e = copy_paths.get2((u64)expr);
+    if (e) {
+        m->expansion.push_back(((u64)m->arg_paths.size << 8) | MEMO_ARG_REF);
+        for (u32 j = 0; j <= paths[e->val]; ++j) {
+            m->arg_paths.push_back(paths[e->val + j]);
+        }
+        return;
+    }
+    m->expansion.push_back(((u64)expr->list_length << 8) | ast::ak_list);
+    for (u32 i = 0; i < expr->list_length; ++i) {
+        flatten_memo(m, expr->datum.list[i], copy_paths, paths);
+    }
+}
+
+ast::node* bc_compiler::instantiate_memo(const macro_memo* m, u32& i,
+        const ast::node* form) {
+    auto word = m->expansion[i++];
+    auto x = word >> 8;
+    switch ((u8)word) {
+    case ast::ak_int:
+        return ast::mk_int(form->loc, (i32)x);
+    case ast::ak_float: {
+        f64 f;
+        memcpy(&f, &m->expansion[i++], sizeof(f));
+        return ast::mk_float(form->loc, f);
+    }
+    case ast::ak_string:
+        return ast::mk_string(form->loc,
+                scanner_intern(*sst, symname(S, (symbol_id)x)));
+    case ast::ak_symbol: {
+        auto e = expansions->sym_ids.get2((symbol_id)x);
+        if (e) {
+            return ast::mk_symbol(form->loc, e->val);
+        }
+        auto id = scanner_intern(*sst, symname(S, (symbol_id)x));
+        expansions->sym_ids.insert((symbol_id)x, id);
+        return ast::mk_symbol(form->loc, id);
+    }
+    case MEMO_ARG_REF:
+        return ast::copy_graph(follow_arg_path(form, &m->arg_paths[x]));
+    default:
+        break;
+    }
+    auto items = new ast::node*[x];
+    for (u32 j = 0; j < x; ++j) {
+        items[j] = instantiate_memo(m, i, form);
+    }
+    return ast::mk_list(form->loc, x, items);
+}
+
+bool bc_compiler::compile_def(const ast::node* ast) {
+    // validate the def form
+    if (ast->list_length != 3) {
+        compile_error(ast->loc, "def requires exactly 2 arguments.");
+        return false;
+    }
+    auto name = ast->datum.list[1];
+    if (name->kind != ast::ak_symbol) {
+        compile_error(name->loc, "def name must be a symbol.");
+        return false;
+    }
+    auto name_str = scanner_name(*sst, name->datum.str_id);
+    if (name_str.find(":") != string::npos) {
+        compile_error(name->loc, "def name cannot include colons.");
+        return false;
+    }
+    auto val = ast->datum.list[2];
+    bound_value = val;
+    bound_var = self_binding{name->datum.str_id, false, 0};
+    deferred = nullptr;
+    auto ok = compile(val, false);
+    bound_value = nullptr;
+    if (!ok) {
+        return false;
+    }
+    symbol_id fqn;
+    if (!resolve_symbol(fqn, S, intern_id(S, name_str))) {
+        return false;
+    }
+    register_inline(fqn, name->datum.str_id, val, ast == toplevel_form);
+    register_pure(fqn, val, ast == toplevel_form);
+    if (deferred) {
+        // pick up the expansions those made (see NOTE: (Lazy compilation))
+        copy_lazy_form(deferred, deferred_form);
+    }
+    u32 gid;
+    if (!lookup_global_id(gid, name->datum.str_id)) {
+        return false;
+    }
+    emit_op(OP_SET_GLOBAL);
+    emit32(gid);
+    --sp;
+    // register the global variable in the namespace
+    auto ns = get_ns(S, S->ns_id);
+    add_export(ns, S, intern_id(S, name_str));
+    return true;
+}
+
+bool bc_compiler::lookup_global_id(u32& out, sst_id str_id) {
+    symbol_id fqn;
+    if (!resolve_symbol(fqn, S, intern_id(S, scanner_name(*sst, str_id)))) {
+        return false;
+    }
+    out = get_global_id(S, fqn);
+    return true;
+}
+
+u16 bc_compiler::add_const_symbol(sst_id str_id) {
+    auto cid = output->const_table.size;
+    output->const_table.push_back(bc_output_const{
+                bck_symbol,
+                { .str_id = str_id }
+            });
+    return cid;
+}
+
+bool bc_compiler::add_const_key(u16& cid, const ast::node* key) {
+    if (is_quoted_symbol(key)) {
+        cid = add_const_symbol(key->datum.list[1]->datum.str_id);
+        return true;
+    } else if (key->kind == ast::ak_string) {
+        cid = output->const_table.size;
+        output->const_table.push_back(bc_output_const{
+                    bck_string,
+                    { .str_id = key->datum.str_id }
+                });
+        return true;
+    }
+    return false;
+}
+
+bool bc_compiler::compile_const_symbol(sst_id str_id) {
+    auto cid = add_const_symbol(str_id);
+    emit_op(OP_CONST);
+    emit16(cid);
+    inc_sp();
+    return true;
+}
+
+bool bc_compiler::compile_sub_fun(const ast::node* params,
+        const ast::node** body, u32 body_len, const string& name,
+        const self_binding* self) {
+    dyn_array<sst_id> pos_params;
+    dyn_array<ast::node*> init_vals;
+    bool has_vari;
+    sst_id vari;
+    if (!process_params(params, pos_params, init_vals,
+                    has_vari, vari)) {
+        return false;
+    }
+    // find the variables it mutates (see NOTE: (Mutated variables))
+    dyn_array<sst_id> set_targets;
+    bool fns = true;
+    for (u32 i = 0; i < body_len; ++i) {
+        collect_set_targets(set_targets, body[i], fns);
+    }
+    if (has_error(S)) {
+        return false;
+    }
+    // compile the child function
+    bc_compiler_output child_out;
+    dyn_array<u8> spec_params;
+    // name may refer to a string in sst, which compiling can add to
+    auto name_id = scanner_intern(*sst, name);
+    while (true) {
+        bc_compiler child{this, S, *sst, child_out};
+        child.set_targets = set_targets;
+        child.spec_params = spec_params;
+        // FIXME: incorporate function name into compiler output
+
+        child_out.name_id = name_id;
+        // set up arguments as local variables
+        for (auto p : pos_params) {
+            child_out.params.push_back(p);
+            child.push_var(p);
+            child.inc_sp();
+        }
+        if (has_vari) {
+            child_out.has_vari = true;
+            child_out.vari_param = vari;
+            child.push_var(vari);
+            child.inc_sp();
+        }
+        // self calls can only become loops if the parameters are all
+        // positional
+        if (self && init_vals.size == 0 && !has_vari) {
+            child.has_self = true;
+            child.self = *self;
+        }
+        if (!child.compile_function_body(body, body_len)) {
+            return false;
+        }
+        // it may also be compiled again to specialize it (see NOTE: (Type
+        // inference))
+        if (spec_params.size > 0
+                || !child.choose_spec_params(spec_params, init_vals)) {
+            break;
+        }
+        child_out = bc_compiler_output{};
+    }
+
+    // code to create the function object
+    auto save_sp = sp;
+    for (auto x : init_vals) {
+        if (!compile(x, false)) {
+            return false;
+        }
+    }
+    auto child_id = output->sub_funs.size;
+    output->sub_funs.push_back(child_out);
+    emit_op(OP_CLOSURE);
+    emit16(child_id);
+    sp = save_sp + 1;
+    return true;
+}
+
+bool bc_compiler::compile_defmacro(const ast::node* root) {
+    if (root->list_length < 3) {
+        compile_error(root->loc, "defmacro requires a name and parameter list.");
+        return false;
+    }
+    if (root->datum.list[1]->kind != ast::ak_symbol) {
+        compile_error(root->loc, "defmacro name must be a symbol.");
+        return false;
+    }
+    auto name_id = root->datum.list[1]->datum.str_id;
+    // resolve the full symbol name
+    auto sid = intern_id(S, scanner_name(*sst, name_id));
+    symbol_id fqn;
+    if (!resolve_symbol(fqn, S, sid)) {
+        return false;
+    }
+    // TODO: check name legality
+    if (!compile_sub_fun(root->datum.list[2],
+                    (const ast::node**)&root->datum.list[3],
+                    root->list_length - 3, "macro:" + symname(S, fqn))) {
+        return false;
+    }
+    dyn_array<symbol_id> locals;
+    u64 memo_id = 0;
+    if (pure_fun_id(memo_id, root->datum.list[2],
+                    (const ast::node**)&root->datum.list[3],
+                    root->list_length - 3, locals)) {
+        output->sub_funs[output->sub_funs.size - 1].memo_id =
+            memo_id == 0 ? 1 : memo_id;
+    }
+
+    auto cid = output->const_table.size;
+    output->const_table.push_back(bc_output_const{
+                bck_symbol,
+                { .str_id = scanner_intern(*sst, symname(S, fqn))}
+            });
+    emit_op(OP_SET_MACRO);
+    emit16(cid);
+    // register the global variable in the namespace
+    auto ns = get_ns(S, S->ns_id);
+    add_export(ns, S, intern_id(S, scanner_name(*sst, name_id)));
+
+    // defmacro returns nil
+    emit_op(OP_NIL);
+
+    return true;
+}
+
+bool bc_compiler::compile_do(const ast::node* root, bool tail) {
+    return compile_body((const ast::node**)&root->datum.list[1],
+            root->list_length-1, tail);
+}
+
+bool bc_compiler::compile_if(const ast::node* root, bool tail) {
+    // validate the if form
+    if (root->list_length != 4) {
+        compile_error(root->loc, "if requires exactly 3 arguments.");
+        return false;
+    }
+    // only compile the branch that's taken if the condition is constant
+    value test;
+    if (eval_constant(test, root->datum.list[1])) {
+        return compile(root->datum.list[vtruth(test) ? 2 : 3], tail);
+    }
+    if (!compile(root->datum.list[1], false)) {
+        return false;
+    }
+    emit_op(OP_CJUMP);
+    auto patch_addr1 = output->code.size;
+    emit16(0);
+    --sp;
+
+    if (!compile(root->datum.list[2], tail)) {
+        return false;
+    }
+    emit_op(OP_JUMP);
+    auto patch_addr2 = output->code.size;
+    emit16(0);
+
+    patch_jump(patch_addr1);
+    --sp;
+    if (!compile(root->datum.list[3], tail)) {
+        return false;
+    }
+
+    patch_jump(patch_addr2);
+    return true;
+}
+
+bool bc_compiler::compile_import(const ast::node* root) {
+    auto arity = root->list_length;
+    if (arity == 2) {
+        if (root->datum.list[1]->kind != ast::ak_symbol) {
+            compile_error(root->loc, "import arguments must be symbols.");
+        }
+        compile_const_symbol(root->datum.list[1]->datum.str_id);
+        string prefix;
+        string stem;
+        ns_id_destruct(scanner_name(*sst, root->datum.list[1]->datum.str_id),
+                &prefix, &stem);
+        compile_const_symbol(scanner_intern(*sst, stem));
+    } else if (arity == 3) {
+        if (root->datum.list[1]->kind != ast::ak_symbol) {
+            compile_error(root->loc, "import arguments must be symbols.");
+        } else if (root->datum.list[2]->kind != ast::ak_symbol) {
+            compile_error(root->loc, "import arguments must be symbols.");
+        }
+        compile_const_symbol(root->datum.list[1]->datum.str_id);
+        compile_const_symbol(root->datum.list[2]->datum.str_id);
+    } else {
+        compile_error(root->loc, "import takes 1 or 2 arguments.");
+        return false;
+    }
+    emit_op(OP_IMPORT);
+    emit_op(OP_NIL);
+    --sp;
+    return true;
+}
+
+bool bc_compiler::compile_fn(const ast::node* root) {
+    // validate the arity of the fn form
+    if (root->list_length < 2) {
+        compile_error(root->loc, "fn requires a parameter list.");
+        return false;
+    }
+
+    // functions bound with def (or defn) or let are named after the variable
+    if (root == bound_value) {
+        auto name = scanner_name(*sst, bound_var.name);
+        if (defer_sub_fun(root, name, &bound_var)) {
+            return true;
+        }
+        return compile_sub_fun(root->datum.list[1],
+                (const ast::node**)&root->datum.list[2], root->list_length - 2,
+                name, &bound_var);
+    }
+    if (defer_sub_fun(root, "", nullptr)) {
+        return true;
+    }
+    compile_sub_fun(root->datum.list[1],
+            (const ast::node**)&root->datum.list[2], root->list_length - 2, "");
+
+    return true;
+}
+
+// NOTE: (Lazy compilation). Library files define lots of functions which a
+// given program never calls, so compiling them all when the file is loaded is
+// mostly wasted work. Instead, a fn form which can't capture any local
+// variables, i.e. one outside of any function or let form, is copied into a
+// lazy_fun along with the strings it uses, and compiled to a placeholder stub
+// holding it. resolve_callee() in vm.cpp compiles the function the first time
+// a closure made from the placeholder is called, and points the closure at the
+// compiled stub, which is kept in the placeholder's sub_funs[0] for other
+// closures made from it. alloc_fun() then replaces the placeholder in the
+// enclosing stub, so later closures get the compiled stub directly.
+//
+// Functions with optional parameters are always compiled right away, since
+// their initforms are compiled into the enclosing function. The function body
+// is compiled in the namespace it was defined in, but otherwise with the
+// global environment as it is when the function is first called. This makes a
+// difference only if macros or inlinable functions it uses are defined or
+// changed in between, which is where the order of definitions in a file
+// already matters. The exception is macro calls that were already expanded
+// when the function was defined, e.g. to check whether a def's value is pure.
+// Their expansions are copied in place of the calls, so that the macros don't
+// run a second time.
+//
+// Compile errors in the body are reported when the function is first called
+// rather than when it's defined, though the parameter list is checked right
+// away. A call to the function while its body is being compiled, e.g. from a
+// macro the body uses, is a compile error too, since there's nothing to call
+// yet.
+
+// copy syntax into another string table. If expansions is given, macro calls
+// found in it are replaced by their expansions.
+static ast::node* copy_syntax(const ast::node* node,
+        const scanner_string_table& from, scanner_string_table& to,
+        const expansion_cache* expansions = nullptr) {
+    if (expansions && node->kind == ast::ak_list) {
+        auto e = expansions->forms.get2((u64)node);
+        if (e && e->val) {
+            node = e->val;
+        }
+    }
+    switch (node->kind) {
+    case ast::ak_int:
+        return ast::mk_int(node->loc, node->datum.i);
+    case ast::ak_float:
+        return ast::mk_float(node->loc, node->datum.f);
+    case ast::ak_string:
+        return ast::mk_string(node->loc,
+                scanner_intern(to, scanner_name(from, node->datum.str_id)));
+    case ast::ak_symbol:
+        return ast::mk_symbol(node->loc,
+                scanner_intern(to, scanner_name(from, node->datum.str_id)));
+    default:
+        break;
+    }
+    dyn_array<ast::node*> items;
+    for (u32 i = 0; i < node->list_length; ++i) {
+        items.push_back(copy_syntax(node->datum.list[i], from, to,
+                        expansions));
+    }
+    return ast::mk_list(node->loc, items);
+}
+
+bool bc_compiler::defer_sub_fun(const ast::node* root, const string& name,
+        const self_binding* self) {
+    if (parent || vars.size > 0 || (self && self->local)) {
+        return false;
+    }
+    dyn_array<sst_id> pos_params;
+    dyn_array<ast::node*> init_vals;
+    bool has_vari;
+    sst_id vari;
+    if (!process_params(root->datum.list[1], pos_params, init_vals, has_vari,
+                    vari)) {
+        // compile_sub_fun() reports the same error again
+        clear_error_info(S->err);
+        return false;
+    } else if (init_vals.size > 0) {
+        return false;
+    }
+
+    auto f = new lazy_fun;
+    S->G->lazy_funs.push_back(f);
+    f->name = scanner_intern(f->sst, name);
+    f->self = self != nullptr;
+    f->form = nullptr;
+    copy_lazy_form(f, root);
+    deferred = f;
+    deferred_form = root;
+
+    bc_compiler_output child_out;
+    init_output(child_out, *sst);
+    child_out.name_id = scanner_intern(*sst, name);
+    child_out.lazy = f;
+    auto child_id = output->sub_funs.size;
+    output->sub_funs.push_back(child_out);
+    emit_op(OP_CLOSURE);
+    emit16(child_id);
+    inc_sp();
+    return true;
+}
+
+void bc_compiler::copy_lazy_form(lazy_fun* f, const ast::node* root) {
+    if (f->form) {
+        ast::free_graph(f->form);
+    }
+    dyn_array<ast::node*> items;
+    for (u32 i = 1; i < root->list_length; ++i) {
+        items.push_back(copy_syntax(root->datum.list[i], *sst, f->sst,
+                        expansions));
+    }
+    f->form = ast::mk_list(root->loc, items);
+}
+
+bool compile_lazy_fun(bc_compiler_output& out, istate* S, lazy_fun* f) {
+    // the function is compiled as the only sub function of an empty toplevel
+    // form, just as it would have been in the first place
+    expansion_cache expansions;
+    bc_compiler_output enclosing;
+    bc_compiler c{nullptr, S, f->sst, enclosing};
+    c.expansions = &expansions;
+    auto form = f->form;
+    self_binding self{f->name, false, 0};
+    if (!c.compile_sub_fun(form->datum.list[0],
+                    (const ast::node**)&form->datum.list[1],
+                    form->list_length - 1, scanner_name(f->sst, f->name),
+                    f->self ? &self : nullptr)) {
+        return false;
+    }
+    out = std::move(enclosing.sub_funs[0]);
+    return true;
+}
+
+bool bc_compiler::compile_let(const ast::node* root) {
+    return compile_body(&root, 1, false);
+}
+
+bool bc_compiler::compile_quote(const ast::node* root) {
+    if (root->list_length != 2) {
+        compile_error(root->loc, "quote requires exactly one argument.");
+        return false;
+    }
+
+    auto cid = output->const_table.size;
+    output->const_table.push_back(
+            bc_output_const{
+                bck_quoted,
+                {.quoted = ast::copy_graph(root->datum.list[1])}
+            });
+    emit_op(OP_CONST);
+    emit16(cid);
+    inc_sp();
+    return true;
+}
+
+bool bc_compiler::compile_set(const ast::node* root) {
+    if (root->list_length != 3) {
+        compile_error(root->loc, "set! requires exactly two arguments.");
+        return false;
+    }
+    auto target = root->datum.list[1];
+    auto val = root->datum.list[2];
+    if (target->kind == ast::ak_symbol) {
+        u8 index;
+        bool flat;
+        if (find_local_var(index, target->datum.str_id)) {
+            if (!compile(val, false)) {
+                return false;
+            }
+            emit_op(OP_SET_LOCAL);
+            emit8(index);
+        } else if (find_upvalue_var(index, flat, target->datum.str_id)) {
+            if (!compile(val, false)) {
+                return false;
+            }
+            emit_op(OP_SET_UPVALUE);
+            emit8(index);
+        } else {
+            compile_error(root->loc, "Illegal symbol name in set!");
+            return false;
+        }
+    } else if (is_dot_form(target)) {
+        // compile the object
+        if (!compile(target->datum.list[1], false)) {
+            return false;
+        }
+        u32 i;
+        for (i = 2; i < target->list_length - 1; ++i) {
+            if (!compile(target->datum.list[i], false)) {
+                return false;
+            }
+            emit_op(OP_OBJ_GET);
+            --sp;
+        }
+        auto key = target->datum.list[i];
+        u16 cid;
+        if (add_const_key(cid, key)) {
+            if (!compile(val, false)) {
+                return false;
+            }
+            emit_op(OP_SET_FIELD);
+            emit16(cid);
+            emit16(output->num_field_caches++);
+            --sp;
+        } else {
+            if (!compile(key, false) || !compile(val, false)) {
+                return false;
+            }
+            emit_op(OP_OBJ_SET);
+            sp -= 2;
+        }
+        // the value left by the set instruction is replaced with nil below
+        emit_op(OP_POP);
+    }
+    // TODO: check for . forms
+    emit_op(OP_NIL);
+    return true;
+}
+
+bool bc_compiler::compile_apply(const ast::node* root, bool tail) {
+    if (root->list_length < 3) {
+        compile_error(root->loc, "apply requires at least two arguments.");
+        return false;
+    }
+    auto save_sp = sp;
+    for (u32 i = 1; i < root->list_length; ++i) {
+        if (!compile(root->datum.list[i], false)) {
+            return false;
+        }
+    }
+    emit_op(tail ? OP_TAPPLY : OP_APPLY);
+    emit8(root->list_length - 3);
+    sp = save_sp + 1;
+    return true;
+}
+
+bool bc_compiler::compile_dot(const ast::node* root) {
+    if (root->list_length < 3) {
+        compile_error(root->loc, ". requires at least 3 arguments.");
+        return false;
+    }
+    if (!compile(root->datum.list[1], false)) {
+        return false;
+    }
+    auto key = root->datum.list[2];
+    u16 cid;
+    if (add_const_key(cid, key)) {
+        emit_op(OP_GET_FIELD);
+        emit16(cid);
+        emit16(output->num_field_caches++);
+        return true;
+    }
+    if (!compile(key, false)) {
+        return false;
+    }
+    emit_op(OP_OBJ_GET);
+    --sp;
+    return true;
+}
 
-    patch16(output->code.size - patch_addr2 - 2, patch_addr2);
+bool bc_compiler::compile_List(const ast::node* root) {
+    // FIXME: check list_length is < 255
+    auto start_sp = sp;
+    for (u32 i = 1; i < root->list_length; ++i) {
+        if (!compile(root->datum.list[i], false)) {
+            return false;
+        }
+    }
+    emit_op(OP_LIST);
+    emit8(root->list_length - 1);
+    sp = start_sp + 1;
     return true;
 }
 
-bool bc_compiler::compile_import(const ast::node* root) {
-    auto arity = root->list_length;
-    if (arity == 2) {
-        if (root->datum.list[1]->kind != ast::ak_symbol) {
-            compile_error(root->loc, "import arguments must be symbols.");
+bool bc_compiler::compile_symbol_list(const ast::node* root, bool tail) {
+    // if this is called, we're guaranteed that the list begins with a symbol
+
+    // elements of objects that were never built (see NOTE: (Scalar
+    // replacement))
+    sst_id elem;
+    bool present;
+    if (find_elem_access(elem, present, root)) {
+        if (!present) {
+            emit_op(OP_NIL);
+            inc_sp();
+            return true;
         }
-        compile_const_symbol(root->datum.list[1]->datum.str_id);
-        string prefix;
-        string stem;
-        ns_id_destruct(scanner_name(*sst, root->datum.list[1]->datum.str_id),
-                &prefix, &stem);
-        compile_const_symbol(scanner_intern(*sst, stem));
-    } else if (arity == 3) {
-        if (root->datum.list[1]->kind != ast::ak_symbol) {
-            compile_error(root->loc, "import arguments must be symbols.");
-        } else if (root->datum.list[2]->kind != ast::ak_symbol) {
-            compile_error(root->loc, "import arguments must be symbols.");
+        return compile_lexical_ref(elem);
+    }
+
+    auto name = scanner_name(*sst, root->datum.list[0]->datum.str_id);
+    auto sym_id = intern_id(S, name);
+    if (sym_id == cached_sym(S, SC_DEF)) {
+        return compile_def(root);
+    } else if (sym_id == cached_sym(S, SC_DEFMACRO)) {
+        return compile_defmacro(root);
+    } else if (sym_id == cached_sym(S, SC_DO)) {
+        return compile_do(root, tail);
+    } else if (sym_id == cached_sym(S, SC_IF)) {
+        return compile_if(root, tail);
+    } else if (sym_id == cached_sym(S, SC_IMPORT)) {
+        return compile_import(root);
+    } else if (sym_id == cached_sym(S, SC_FN)) {
+        return compile_fn(root);
+    } else if (sym_id == cached_sym(S, SC_LET)) {
+        return compile_let(root);
+    } else if (sym_id == cached_sym(S, SC_QUOTE)) {
+        return compile_quote(root);
+    } else if (sym_id == cached_sym(S, SC_SET)) {
+        return compile_set(root);
+    } else if (sym_id == cached_sym(S, SC_APPLY)) {
+        return compile_apply(root, tail);
+    } else if (name == ".") {
+        return compile_dot(root);
+    } else if (name == "List") {
+        return compile_List(root);
+    }
+    u8 op;
+    bool guarded;
+    if (find_binary_op(op, guarded, root)) {
+        return compile_binary_op(root, op, guarded);
+    } else {
+        return compile_call(root, tail);
+    }
+    return true;
+}
+
+bool bc_compiler::compile_call(const ast::node* root, bool tail) {
+    if (root->list_length >= 2 && is_quoted_symbol(root->datum.list[0])) {
+        return compile_method_call(root, tail);
+    }
+    if (tail && is_self_call(root)) {
+        return compile_self_call(root);
+    }
+    inline_fun* f;
+    symbol_id fqn;
+    if (find_inline_fun(f, fqn, root)) {
+        return compile_inline_call(root, f, fqn, tail);
+    }
+    auto save_sp = sp;
+    u32 gid;
+    bool foreign;
+    if (find_known_fun(gid, foreign, root)) {
+        for (u32 i = 1; i < root->list_length; ++i) {
+            if (!compile(root->datum.list[i], false)) {
+                return false;
+            }
         }
-        compile_const_symbol(root->datum.list[1]->datum.str_id);
-        compile_const_symbol(root->datum.list[2]->datum.str_id);
+        // tail calls keep tcall-known even for builtins, so that if the global
+        // is redefined, the call to its new value is still a tail call
+        if (tail) {
+            emit_op(OP_TCALL_KNOWN);
+        } else {
+            emit_op(foreign ? OP_CALL_FOREIGN : OP_CALL_KNOWN);
+        }
+        emit32(gid);
+        emit8(root->list_length - 1);
+        // room for the function, which is inserted below the arguments
+        inc_sp();
+        sp = save_sp + 1;
+        return true;
+    }
+    for (u32 i = 0; i < root->list_length; ++i) {
+        if (!compile(root->datum.list[i], false)) {
+            return false;
+        }
+    }
+    emit_op(tail ? OP_TCALL : OP_CALL);
+    emit8(root->list_length - 1);
+    sp = save_sp + 1;
+    return true;
+}
+
+// NOTE: (Known calls). A call whose operator is a global variable holding a
+// function is compiled to call-known (or call-foreign for builtins), which
+// reads the global itself after the arguments are pushed and inserts it below
+// them, rather than pushing it first with a global instruction. The handler
+// can then go straight to entering the function (or calling the builtin's
+// foreign function) without checking what kind of value the callee is or
+// whether it needs method lookup. Calls from a function to the global it's
+// being defined as, e.g. the recursive calls in fib, are included, since the
+// variable will hold the function by the time they run. This doesn't need a
+// guard (see NOTE: (Guarded globals)), since the handlers check the global's
+// value anyway and fall back to a regular call if it's not a function.
+// Note that the global is read after the arguments are evaluated rather than
+// before, so if evaluating an argument redefines the global, its new value is
+// the one called.
+
+bool bc_compiler::find_known_fun(u32& gid, bool& foreign,
+        const ast::node* root) {
+    auto op = root->datum.list[0];
+    if (op->kind != ast::ak_symbol) {
+        return false;
+    }
+    if (has_self && !self.local && op->datum.str_id == self.name
+            && !is_lexical_var(self.name)) {
+        foreign = false;
+        return lookup_global_id(gid, op->datum.str_id);
+    }
+    auto fun = global_fun(op->datum.str_id);
+    if (!fun) {
+        return false;
+    }
+    foreign = fun->stub->foreign != nullptr;
+    return lookup_global_id(gid, op->datum.str_id);
+}
+
+// NOTE: (Inlining). When a function defined at toplevel with def (or defn) has
+// only positional parameters and a small body made of calls, if, do, quoted
+// symbols, variables, and constants, the macroexpanded body is saved in
+// S->G->inline_tab. Calls to it with the right number of arguments then
+// compile the arguments as local variables and the body in place of the call.
+// Global variables in the saved body are stored by their FQNs, so they refer to
+// the same variables wherever the body ends up, and parameters are renamed when
+// it's inlined. The global may be redefined later, so each inlined copy is
+// guarded (see NOTE: (Guarded globals)). The function's stub gets a code_id
+// which is a hash of the saved parameters and body, so a guard only fails if
+// the global now holds something that would behave differently. Then the
+// function is called with call-known instead. A new def of the variable also
+// stops further inlining unless it's inlinable itself. The code_info entries of
+// inlined code record the function's name and file and the call site, so stack
+// traces show a frame for the inlined function above the caller's. When inlined
+// calls are nested, only the innermost function and the outermost call site
+// are kept.
+
+// hash a saved inline body into h, to get the function's code_id
+static u64 hash_inline_body(istate* S, u64 h, const ast::node* expr) {
+    h = mix_id(h, expr->kind);
+    switch (expr->kind) {
+    case ast::ak_int:
+        return mix_id(h, (u32)expr->datum.i);
+    case ast::ak_float: {
+        u64 x;
+        memcpy(&x, &expr->datum.f, sizeof(x));
+        return mix_id(h, x);
+    }
+    case ast::ak_string:
+    case ast::ak_symbol:
+        // inline bodies hold symbol IDs, whose values differ between runs
+        return mix_id(h, hash(symname(S, expr->datum.str_id)));
+    case ast::ak_list:
+        h = mix_id(h, expr->list_length);
+        for (u32 i = 0; i < expr->list_length; ++i) {
+            h = hash_inline_body(S, h, expr->datum.list[i]);
+        }
+        return h;
+    default:
+        return h;
+    }
+}
+
+void bc_compiler::register_inline(symbol_id fqn, sst_id name,
+        const ast::node* val, bool toplevel) {
+    log_global_info(S->G, fqn);
+    auto e = S->G->inline_tab.get2(fqn);
+    if (e && e->val) {
+        ast::free_graph(e->val->body);
+        delete e->val;
+        e->val = nullptr;
+    }
+    if (!toplevel || val->kind != ast::ak_list || val->list_length < 3
+            || val->datum.list[0]->kind != ast::ak_symbol
+            || intern_id(S, scanner_name(*sst, val->datum.list[0]->datum.str_id))
+            != cached_sym(S, SC_FN)
+            || val->datum.list[1]->kind != ast::ak_list) {
+        return;
+    }
+    auto param_list = val->datum.list[1];
+    dyn_array<sst_id> params;
+    for (u32 i = 0; i < param_list->list_length; ++i) {
+        auto x = param_list->datum.list[i];
+        if (x->kind != ast::ak_symbol
+                || scanner_name(*sst, x->datum.str_id) == "&") {
+            return;
+        }
+        params.push_back(x->datum.str_id);
+    }
+
+    u32 cost = 0;
+    ast::node* body;
+    if (val->list_length == 3) {
+        body = make_inline_body(val->datum.list[2], params, fqn, cost);
     } else {
-        compile_error(root->loc, "import takes 1 or 2 arguments.");
+        // multiple body expressions go in a do form
+        dyn_array<ast::node*> exprs;
+        exprs.push_back(ast::mk_symbol(val->loc, cached_sym(S, SC_DO)));
+        for (u32 i = 2; i < val->list_length; ++i) {
+            auto x = make_inline_body(val->datum.list[i], params, fqn, cost);
+            if (!x) {
+                for (auto y : exprs) {
+                    ast::free_graph(y);
+                }
+                return;
+            }
+            exprs.push_back(x);
+        }
+        body = ast::mk_list(val->loc, exprs);
+    }
+    if (!body) {
+        return;
+    }
+
+    auto f = new inline_fun;
+    for (auto p : params) {
+        f->params.push_back(intern_id(S, scanner_name(*sst, p)));
+    }
+    f->name = intern_id(S, scanner_name(*sst, name));
+    f->filename = intern_id(S, convert_fn_str(S->filename));
+    f->body = body;
+    u64 code_id = 0;
+    for (auto p : f->params) {
+        code_id = mix_id(code_id, hash(symname(S, p)));
+    }
+    f->code_id = hash_inline_body(S, code_id, body);
+    if (f->code_id == 0) {
+        f->code_id = 1;
+    }
+    S->G->inline_tab.insert(fqn, f);
+    // the fn form was the last function compiled
+    output->sub_funs[output->sub_funs.size - 1].code_id = f->code_id;
+}
+
+
+ast::node* bc_compiler::make_inline_body(const ast::node* expr,
+        const dyn_array<sst_id>& params, symbol_id fqn, u32& cost) {
+    if (expr->kind == ast::ak_list) {
+        auto expanded = macroexpand(expr);
+        if (expanded) {
+            return make_inline_body(expanded, params, fqn, cost);
+        } else if (has_error(S)) {
+            return nullptr;
+        }
+    }
+    if (++cost > INLINE_MAX_COST) {
+        return nullptr;
+    }
+
+    switch (expr->kind) {
+    case ast::ak_int:
+        return ast::mk_int(expr->loc, expr->datum.i);
+    case ast::ak_float:
+        return ast::mk_float(expr->loc, expr->datum.f);
+    case ast::ak_string:
+        return ast::mk_string(expr->loc,
+                intern_id(S, scanner_name(*sst, expr->datum.str_id)));
+    case ast::ak_symbol: {
+        auto sid = intern_id(S, scanner_name(*sst, expr->datum.str_id));
+        for (u32 i = 0; i < params.size; ++i) {
+            if (params[i] == expr->datum.str_id) {
+                return ast::mk_symbol(expr->loc, sid);
+            }
+        }
+        if (sid == cached_sym(S, SC_YES) || sid == cached_sym(S, SC_NO)
+                || sid == cached_sym(S, SC_NIL)) {
+            return ast::mk_symbol(expr->loc, sid);
+        }
+        // the function can't be inlined into itself
+        symbol_id var_fqn;
+        if (!resolve_symbol(var_fqn, S, sid) || var_fqn == fqn) {
+            return nullptr;
+        }
+        return ast::mk_symbol(expr->loc, var_fqn);
+    }
+    case ast::ak_list:
+        break;
+    default:
+        return nullptr;
+    }
+
+    if (expr->list_length == 0
+            || expr->datum.list[0]->kind != ast::ak_symbol) {
+        return nullptr;
+    }
+    auto name = scanner_name(*sst, expr->datum.list[0]->datum.str_id);
+    auto sid = intern_id(S, name);
+    dyn_array<ast::node*> items;
+    u32 start = 0;
+    if (sid == cached_sym(S, SC_QUOTE)) {
+        auto x = expr->list_length == 2 ? expr->datum.list[1] : nullptr;
+        if (!x || x->kind != ast::ak_symbol) {
+            return nullptr;
+        }
+        items.push_back(ast::mk_symbol(expr->loc, sid));
+        items.push_back(ast::mk_symbol(x->loc,
+                        intern_id(S, scanner_name(*sst, x->datum.str_id))));
+        return ast::mk_list(expr->loc, items);
+    } else if ((sid == cached_sym(S, SC_IF) && expr->list_length == 4)
+            || sid == cached_sym(S, SC_DO)) {
+        items.push_back(ast::mk_symbol(expr->loc, sid));
+        start = 1;
+    } else if (sid == cached_sym(S, SC_IF) || sid == cached_sym(S, SC_DEF)
+            || sid == cached_sym(S, SC_DEFMACRO)
+            || sid == cached_sym(S, SC_FN) || sid == cached_sym(S, SC_LET)
+            || sid == cached_sym(S, SC_SET) || sid == cached_sym(S, SC_APPLY)
+            || sid == cached_sym(S, SC_IMPORT)
+            || sid == cached_sym(S, SC_DO_INLINE)
+            || name == "." || name == "List") {
+        return nullptr;
+    }
+    for (u32 i = start; i < expr->list_length; ++i) {
+        auto x = make_inline_body(expr->datum.list[i], params, fqn, cost);
+        if (!x) {
+            for (auto y : items) {
+                ast::free_graph(y);
+            }
+            return nullptr;
+        }
+        items.push_back(x);
+    }
+    return ast::mk_list(expr->loc, items);
+}
+
+ast::node* bc_compiler::instantiate_inline(const ast::node* body,
+        const inline_fun* f, symbol_id fqn) {
+    switch (body->kind) {
+    case ast::ak_int:
+        return ast::mk_int(body->loc, body->datum.i);
+    case ast::ak_float:
+        return ast::mk_float(body->loc, body->datum.f);
+    case ast::ak_string:
+        return ast::mk_string(body->loc,
+                scanner_intern(*sst, symname(S, body->datum.str_id)));
+    case ast::ak_symbol: {
+        auto name = symname(S, body->datum.str_id);
+        for (u32 i = 0; i < f->params.size; ++i) {
+            if (f->params[i] == body->datum.str_id) {
+                name = symname(S, fqn) + " " + name;
+                break;
+            }
+        }
+        return ast::mk_symbol(body->loc, scanner_intern(*sst, name));
+    }
+    default:
+        break;
+    }
+    dyn_array<ast::node*> items;
+    if (body->datum.list[0]->datum.str_id == cached_sym(S, SC_QUOTE)) {
+        // quoted symbols are never renamed
+        for (u32 i = 0; i < 2; ++i) {
+            items.push_back(ast::mk_symbol(body->datum.list[i]->loc,
+                            scanner_intern(*sst,
+                                    symname(S, body->datum.list[i]->datum.str_id))));
+        }
+    } else {
+        for (u32 i = 0; i < body->list_length; ++i) {
+            items.push_back(instantiate_inline(body->datum.list[i], f, fqn));
+        }
+    }
+    return ast::mk_list(body->loc, items);
+}
+
+bool bc_compiler::find_inline_fun(inline_fun*& out, symbol_id& fqn,
+        const ast::node* root) {
+    auto op = root->datum.list[0];
+    value v;
+    if (op->kind != ast::ak_symbol
+            || is_lexical_var(op->datum.str_id)
+            || !resolve_symbol(fqn, S,
+                    intern_id(S, scanner_name(*sst, op->datum.str_id)))
+            || !get_global(v, S, fqn)
+            || !vis_function(v)) {
+        return false;
+    }
+    auto e = S->G->inline_tab.get2(fqn);
+    if (!e || !e->val || e->val->params.size != root->list_length - 1) {
+        return false;
+    }
+    for (auto x : inlining) {
+        if (x == fqn) {
+            return false;
+        }
+    }
+    out = e->val;
+    return true;
+}
+
+bool bc_compiler::compile_inline_call(const ast::node* root, inline_fun* f,
+        symbol_id fqn, bool tail) {
+    auto save_sp = sp;
+    // the arguments become local variables
+    auto num_params = f->params.size;
+    for (u32 i = 0; i < num_params; ++i) {
+        auto type = infer_type(root->datum.list[i+1]);
+        if (!compile(root->datum.list[i+1], false)) {
+            return false;
+        }
+        --sp;
+        push_var(scanner_intern(*sst,
+                        symname(S, fqn) + " " + symname(S, f->params[i])));
+        auto& var = vars[vars.size - 1];
+        var.type = type;
+        inc_sp();
+    }
+    auto body = instantiate_inline(f->body, f, fqn);
+    auto save_origin = origin;
+    if (inlining.size == 0) {
+        origin.call_loc = root->loc;
+    }
+    origin.name = f->name;
+    origin.filename = f->filename;
+    inlining.push_back(fqn);
+    // check the global still holds the function (see NOTE: (Guarded globals))
+    auto gid = get_global_id(S, fqn);
+    emit_op(OP_GUARD_GLOBAL);
+    emit32(gid);
+    emit64(f->code_id);
+    auto guard_addr = output->code.size;
+    emit16(0);
+    auto ok = compile(body, tail);
+    inlining.pop();
+    origin = save_origin;
+    // code after the body belongs to the call
+    update_source(root->loc);
+    // expansions of forms in the body may be cached by address
+    expansions->owned.push_back(body);
+    vars.resize(vars.size - num_params);
+    if (!ok) {
+        return false;
+    }
+    if (!tail && num_params > 0) {
+        emit_op(OP_CLOSE);
+        emit8(sp - save_sp);
+    }
+    emit_op(OP_JUMP);
+    auto end_addr = output->code.size;
+    emit16(0);
+    // otherwise call it
+    patch_jump(guard_addr);
+    sp = save_sp + num_params;
+    emit_op(tail ? OP_TCALL_KNOWN : OP_CALL_KNOWN);
+    emit32(gid);
+    emit8(num_params);
+    inc_sp();
+    patch_jump(end_addr);
+    sp = save_sp + 1;
+    return true;
+}
+
+bool bc_compiler::is_lexical_var(sst_id name) {
+    u8 index;
+    if (find_local_var(index, name) || upvals.get(name).has_value()
+            || flat_upvals.get(name).has_value()) {
+        return true;
+    }
+    return parent && parent->is_lexical_var(name);
+}
+
+bool bc_compiler::is_self_call(const ast::node* root) {
+    auto op = root->datum.list[0];
+    if (!has_self || op->kind != ast::ak_symbol || op->datum.str_id != self.name
+            || root->list_length - 1 != output->params.size) {
+        return false;
+    }
+    u8 index;
+    if (find_local_var(index, self.name)) {
+        return false;
+    }
+    if (self.local) {
+        // the name must resolve to the let variable in the enclosing function,
+        // and it must still hold this function
+        auto var = parent->lookup_local_var(self.name);
+        return var && var->index == self.index && !var->mutated;
+    } else {
+        return !is_lexical_var(self.name);
+    }
+}
+
+// A self tail call stores the new arguments into the parameters and jumps back
+// to the start of the function. If a closure might have captured a local
+// variable, the upvalues are closed first, so that each iteration gets fresh
+// variables just like a real call would.
+//
+// A let variable bound to the function can't change, since is_self_call()
+// rejects it if it's ever set!. A global can be redefined, or the function can
+// be running under another name, so the loop is guarded by a check that the
+// global holds the running function. Otherwise the call is made normally.
+bool bc_compiler::compile_self_call(const ast::node* root) {
+    auto save_sp = sp;
+    for (u32 i = 1; i < root->list_length; ++i) {
+        if (!compile(root->datum.list[i], false)) {
+            return false;
+        }
+    }
+    u32 gid = 0;
+    u32 patch_addr = 0;
+    if (!self.local) {
+        if (!lookup_global_id(gid, self.name)) {
+            return false;
+        }
+        emit_op(OP_GUARD_SELF);
+        emit32(gid);
+        patch_addr = output->code.size;
+        emit16(0);
+    }
+    if (captured) {
+        emit_op(OP_CLOSE_FROM);
+        emit8(0);
+    }
+    for (u32 i = root->list_length - 1; i > 0; --i) {
+        emit_op(OP_SET_LOCAL);
+        emit8(i - 1);
+        --sp;
+    }
+    // drop any let variables
+    for (u32 i = output->params.size; i < save_sp; ++i) {
+        emit_op(OP_POP);
+    }
+    i32 offset = -(i32)(output->code.size + 3);
+    if (offset < INT16_MIN) {
+        compile_error(root->loc, "Function too long to compile a self call.");
+        return false;
+    }
+    emit_op(OP_JUMP);
+    emit16((u16)(i16)offset);
+    if (!self.local) {
+        patch_jump(patch_addr);
+        emit_op(OP_TCALL_KNOWN);
+        emit32(gid);
+        emit8(root->list_length - 1);
+    }
+    sp = save_sp + 1;
+    return true;
+}
+
+// NOTE: (Guarded globals). Several optimizations compile a call according to
+// the function its operator's global holds at compile time, e.g. (+ a b) to an
+// add instruction. The globals defined in fn/builtin are only ever defined by
+// the prelude, so the builtins' own names are trusted to keep their values.
+// Any other global can be redefined with def, so code compiled for its value is
+// preceded by a guard-global instruction. This checks that the global still
+// holds a function with the same function_stub::code_id, and if not, jumps to
+// a regular call-known of the global. A builtin's code_id is a hash of its
+// name, so e.g. (def plus +) guards the add instruction for (plus a b) on plus
+// still holding +.
+//
+// The guard goes after the arguments, since that's when a call reads the
+// global. For +, -, and * with more than two arguments, the operations are
+// interleaved with the arguments, so the guard follows the first two and the
+// fallback compiles the rest again. That's only done if they're constants or
+// variables.
+
+// whether a global is one of the builtins' own, see NOTE: (Guarded globals)
+static bool is_builtin_global(istate* S, symbol_id fqn) {
+    return symname(S, fqn).starts_with("#:fn/builtin:");
+}
+
+// arguments which are cheap to compile twice
+static bool is_atom(const ast::node* expr) {
+    return expr->kind != ast::ak_list;
+}
+
+bool bc_compiler::find_binary_op(u8& op, bool& guarded,
+        const ast::node* root) {
+    // +, -, and * chain left to right, the comparisons only take two arguments
+    auto num_args = root->list_length - 1;
+    if (num_args < 2) {
+        return false;
+    }
+    auto str_id = root->datum.list[0]->datum.str_id;
+    if (is_lexical_var(str_id)) {
         return false;
     }
-    emit8(OP_IMPORT);
-    emit8(OP_NIL);
-    --sp;
+    symbol_id fqn;
+    value v;
+    if (!resolve_symbol(fqn, S, intern_id(S, scanner_name(*sst, str_id)))
+            || !get_global(v, S, fqn)
+            || !vis_function(v)
+            || !builtin_binary_op(op, vfunction(v))) {
+        return false;
+    }
+    if (num_args > 2 && op != OP_ADD && op != OP_SUB && op != OP_MUL) {
+        return false;
+    }
+    guarded = !is_builtin_global(S, fqn);
+    if (guarded) {
+        for (u32 i = 3; i <= num_args; ++i) {
+            if (!is_atom(root->datum.list[i])) {
+                return false;
+            }
+        }
+    }
     return true;
 }
 
-bool bc_compiler::compile_fn(const ast::node* root) {
-    // validate the arity of the fn form
-    if (root->list_length < 2) {
-        compile_error(root->loc, "fn requires a parameter list.");
-        return false;
-    }
+// NOTE: (Type inference). Local variables have a static type, int, float, or
+// unknown, which is inferred from their values by infer_type(). Literals have
+// their own types, +, -, and * on ints give ints, and on numbers with a float
+// among them give floats, and an if form has a type if both its branches do.
+// Let variables and the arguments of inlined calls get the types of their
+// values. Calls through globals other than the builtins' own names have no
+// type, since the global may be redefined (see NOTE: (Guarded globals)). When
+// both operands of an arithmetic operation or a comparison have known types,
+// the compiler emits a typed instruction which doesn't check them. It's still
+// preceded by the guard if there is one. A variable that's the target of a
+// set! has no type (see NOTE: (Mutated variables)).
+//
+// Parameters could be anything, but they're often ints, e.g. counters passed
+// around a self tail call loop. If a small function with no closures in it
+// uses some of its parameters directly in arithmetic or comparisons, after
+// it's compiled it's compiled again, specialized for those parameters being
+// ints. (Optional parameters are only considered if their default is an int
+// literal.) The specialized function starts with a guard for each of the
+// parameters, followed by the body compiled with them typed as ints. When a
+// guard fails, it jumps past that to a second copy of the body compiled
+// without any assumptions. Since self tail calls jump back to the start of the
+// function, each iteration of a loop is checked again.
+
+// type of the result of +, -, or * on values of types a and b
+static num_type arith_type(num_type a, num_type b) {
+    if (a == nt_unknown || b == nt_unknown) {
+        return nt_unknown;
+    }
+    return a == nt_int && b == nt_int ? nt_int : nt_float;
+}
 
-    // TODO: generate a meaningful name
-    compile_sub_fun(root->datum.list[1],
-            (const ast::node**)&root->datum.list[2], root->list_length - 2, "");
+// instruction to use for op when its operands have the types a and b
+static u8 typed_binary_op(u8 op, num_type a, num_type b) {
+    if (a == nt_int && b == nt_int) {
+        switch (op) {
+        case OP_ADD:
+            return OP_ADD_INT;
+        case OP_SUB:
+            return OP_SUB_INT;
+        case OP_MUL:
+            return OP_MUL_INT;
+        case OP_LT:
+            return OP_LT_INT;
+        case OP_LE:
+            return OP_LE_INT;
+        case OP_GT:
+            return OP_GT_INT;
+        case OP_GE:
+            return OP_GE_INT;
+        }
+    } else if (arith_type(a, b) == nt_float) {
+        switch (op) {
+        case OP_ADD:
+            return OP_ADD_FLOAT;
+        case OP_SUB:
+            return OP_SUB_FLOAT;
+        case OP_MUL:
+            return OP_MUL_FLOAT;
+        }
+    }
+    return op;
+}
 
-    return true;
+num_type bc_compiler::infer_type(const ast::node* expr) {
+    auto expanded = macroexpand(expr);
+    if (expanded) {
+        expr = expanded;
+    }
+    switch (expr->kind) {
+    case ast::ak_int:
+        return nt_int;
+    case ast::ak_float:
+        return nt_float;
+    case ast::ak_symbol: {
+        auto var = lookup_local_var(expr->datum.str_id);
+        if (!var || !var->initialized || var->mutated) {
+            return nt_unknown;
+        }
+        return var->type;
+    }
+    case ast::ak_list:
+        break;
+    default:
+        return nt_unknown;
+    }
+    if (expr->list_length == 0 || expr->datum.list[0]->kind != ast::ak_symbol) {
+        return nt_unknown;
+    }
+    u8 op;
+    bool guarded;
+    if (find_binary_op(op, guarded, expr)) {
+        // a guarded call may end up calling something else
+        if (guarded || (op != OP_ADD && op != OP_SUB && op != OP_MUL)) {
+            return nt_unknown;
+        }
+        auto res = infer_type(expr->datum.list[1]);
+        for (u32 i = 2; i < expr->list_length; ++i) {
+            res = arith_type(res, infer_type(expr->datum.list[i]));
+        }
+        return res;
+    }
+    sst_id elem;
+    bool present;
+    if (find_elem_access(elem, present, expr)) {
+        auto var = present ? lookup_local_var(elem) : nullptr;
+        return var ? var->type : nt_unknown;
+    }
+    auto sid = intern_id(S, scanner_name(*sst, expr->datum.list[0]->datum.str_id));
+    if (sid == cached_sym(S, SC_IF) && expr->list_length == 4) {
+        auto res = infer_type(expr->datum.list[2]);
+        return res == infer_type(expr->datum.list[3]) ? res : nt_unknown;
+    }
+    return nt_unknown;
 }
 
-bool bc_compiler::compile_let(const ast::node* root) {
-    return compile_body(&root, 1, false);
+static bool has_index(const dyn_array<u8>& indices, u8 index) {
+    for (u32 i = 0; i < indices.size; ++i) {
+        if (indices[i] == index) {
+            return true;
+        }
+    }
+    return false;
 }
 
-bool bc_compiler::compile_quote(const ast::node* root) {
-    if (root->list_length != 2) {
-        compile_error(root->loc, "quote requires exactly one argument.");
+bool bc_compiler::choose_spec_params(dyn_array<u8>& out,
+        const dyn_array<ast::node*>& init_vals) {
+    if (output->sub_funs.size > 0 || output->code.size > SPECIALIZE_MAX_CODE) {
         return false;
     }
-
-    auto cid = output->const_table.size;
-    output->const_table.push_back(
-            bc_output_const{
-                bck_quoted,
-                {.quoted = ast::copy_graph(root->datum.list[1])}
-            });
-    emit8(OP_CONST);
-    emit16(cid);
-    ++sp;
-    return true;
+    auto num_pos = output->params.size - init_vals.size;
+    for (auto i : num_params_used) {
+        if (vars[i].mutated
+                || (i >= num_pos
+                        && init_vals[i - num_pos]->kind != ast::ak_int)) {
+            continue;
+        }
+        out.push_back(i);
+    }
+    return out.size > 0;
 }
 
-bool bc_compiler::compile_set(const ast::node* root) {
-    if (root->list_length != 3) {
-        compile_error(root->loc, "set! requires exactly two arguments.");
+bool bc_compiler::compile_binary_op(const ast::node* root, u8 op,
+        bool guarded) {
+    auto save_sp = sp;
+    // note parameters used as operands for choose_spec_params()
+    for (u32 i = 1; i < root->list_length; ++i) {
+        auto x = root->datum.list[i];
+        if (x->kind != ast::ak_symbol) {
+            continue;
+        }
+        auto var = lookup_local_var(x->datum.str_id);
+        if (var && var->index < output->params.size
+                && !has_index(num_params_used, var->index)) {
+            num_params_used.push_back(var->index);
+        }
+    }
+    u32 gid = 0;
+    u32 guard_addr = 0;
+    auto type = infer_type(root->datum.list[1]);
+    if (!compile(root->datum.list[1], false)) {
         return false;
     }
-    auto target = root->datum.list[1];
-    auto val = root->datum.list[2];
-    if (target->kind == ast::ak_symbol) {
-        u8 index;
-        if (find_local_var(index, target->datum.str_id)) {
-            if (!compile(val, false)) {
-                return false;
-            }
-            emit8(OP_SET_LOCAL);
-            emit8(index);
-        } else if (find_upvalue_var(index, target->datum.str_id)) {
-            if (!compile(val, false)) {
-                return false;
-            }
-            emit8(OP_SET_UPVALUE);
-            emit8(index);
-        } else {
-            compile_error(root->loc, "Illegal symbol name in set!");
-            return false;
-        }
-    } else if (is_dot_form(target)) {
-        // compile the key
-        if (!compile(target->datum.list[1], false)) {
+    for (u32 i = 2; i < root->list_length; ++i) {
+        auto arg_type = infer_type(root->datum.list[i]);
+        if (!compile(root->datum.list[i], false)) {
             return false;
         }
-        u32 i;
-        for (i = 2; i < target->list_length - 1; ++i) {
-            if (!compile(target->datum.list[i], false)) {
+        if (guarded && i == 2) {
+            // see NOTE: (Guarded globals)
+            auto name = root->datum.list[0]->datum.str_id;
+            if (!lookup_global_id(gid, name)) {
                 return false;
             }
-            emit8(OP_OBJ_GET);
-            --sp;
-        }
-        if (!compile(target->datum.list[i], false)
-                || !compile(val, false)) {
-            return false;
+            emit_op(OP_GUARD_GLOBAL);
+            emit32(gid);
+            emit64(global_fun(name)->stub->code_id);
+            guard_addr = output->code.size;
+            emit16(0);
         }
-        emit8(OP_OBJ_SET);
-        emit8(OP_NIL);
+        emit_op(typed_binary_op(op, type, arg_type));
+        type = arith_type(type, arg_type);
         --sp;
     }
-    // TODO: check for . forms
-    emit8(OP_NIL);
+    if (guarded) {
+        emit_op(OP_JUMP);
+        auto end_addr = output->code.size;
+        emit16(0);
+        patch_jump(guard_addr);
+        sp = save_sp + 2;
+        for (u32 i = 3; i < root->list_length; ++i) {
+            if (!compile(root->datum.list[i], false)) {
+                return false;
+            }
+        }
+        emit_op(OP_CALL_KNOWN);
+        emit32(gid);
+        emit8(root->list_length - 1);
+        inc_sp();
+        patch_jump(end_addr);
+    }
+    sp = save_sp + 1;
     return true;
 }
 
-bool bc_compiler::compile_apply(const ast::node* root, bool tail) {
-    if (root->list_length < 3) {
-        compile_error(root->loc, "apply requires at least two arguments.");
+// NOTE: (Constant folding). Forms which eval_constant() can evaluate are
+// compiled to a single constant, if forms with a constant condition only
+// compile the branch that's taken, and constant expressions in the middle of a
+// body are left out entirely. This happens after macroexpansion, so it also
+// cleans up after macros like and and cond. Only calls through the builtins'
+// own names in fn/builtin are folded, since those keep their values (see NOTE:
+// (Guarded globals)). Other globals holding builtins could be redefined before
+// the code runs. Builtin calls are evaluated by calling the builtin itself, so
+// the result is exactly what it'd be at runtime. Calls that fail are left for
+// runtime, so they can report the error.
+bool bc_compiler::eval_constant(value& out, const ast::node* expr) {
+    if (has_error(S)) {
         return false;
     }
-    auto save_sp = sp;
-    for (u32 i = 1; i < root->list_length; ++i) {
-        if (!compile(root->datum.list[i], false)) {
-            return false;
+    auto expanded = macroexpand(expr);
+    if (expanded) {
+        expr = expanded;
+    }
+    bool res = false;
+    switch (expr->kind) {
+    case ast::ak_int:
+        out = vbox_int(expr->datum.i);
+        res = true;
+        break;
+    case ast::ak_float:
+        out = vbox_float(expr->datum.f);
+        res = true;
+        break;
+    case ast::ak_symbol: {
+        auto sid = intern_id(S, scanner_name(*sst, expr->datum.str_id));
+        if (sid == cached_sym(S, SC_YES)) {
+            out = V_YES;
+            res = true;
+        } else if (sid == cached_sym(S, SC_NO)) {
+            out = V_NO;
+            res = true;
+        } else if (sid == cached_sym(S, SC_NIL)) {
+            out = V_NIL;
+            res = true;
+        } else if (!is_lexical_var(expr->datum.str_id)) {
+            // constants defined in fn/builtin, e.g. otherwise
+            symbol_id fqn;
+            value v;
+            res = resolve_symbol(fqn, S, sid)
+                && is_builtin_global(S, fqn)
+                && get_global(v, S, fqn)
+                && (v == V_YES || v == V_NO || v == V_NIL);
+            if (res) {
+                out = v;
+            }
         }
     }
-    emit8(tail ? OP_TAPPLY : OP_APPLY);
-    emit8(root->list_length - 3);
-    sp = save_sp + 1;
-    return true;
+        break;
+    case ast::ak_list:
+        res = eval_constant_list(out, expr);
+        break;
+    default:
+        break;
+    }
+    return res;
 }
 
-bool bc_compiler::compile_dot(const ast::node* root) {
-    if (root->list_length < 3) {
-        compile_error(root->loc, ". requires at least 3 arguments.");
+bool bc_compiler::eval_constant_list(value& out, const ast::node* expr) {
+    if (expr->list_length == 0 || expr->datum.list[0]->kind != ast::ak_symbol) {
         return false;
     }
-    if (!compile(root->datum.list[1], false)
-            || !compile(root->datum.list[2], false)) {
-        return false;
+    auto op = expr->datum.list[0]->datum.str_id;
+    auto sid = intern_id(S, scanner_name(*sst, op));
+    if (sid == cached_sym(S, SC_IF)) {
+        value test;
+        return expr->list_length == 4
+            && eval_constant(test, expr->datum.list[1])
+            && eval_constant(out, expr->datum.list[vtruth(test) ? 2 : 3]);
+    } else if (sid == cached_sym(S, SC_DO)) {
+        out = V_NIL;
+        for (u32 i = 1; i < expr->list_length; ++i) {
+            if (!eval_constant(out, expr->datum.list[i])) {
+                return false;
+            }
+        }
+        return true;
     }
-    emit8(OP_OBJ_GET);
-    --sp;
-    return true;
-}
 
-bool bc_compiler::compile_List(const ast::node* root) {
-    // FIXME: check list_length is < 255
-    auto start_sp = sp;
-    for (u32 i = 1; i < root->list_length; ++i) {
-        if (!compile(root->datum.list[i], false)) {
+    // builtin call
+    symbol_id fqn;
+    value fun;
+    if (is_lexical_var(op)
+            || !resolve_symbol(fqn, S, sid)
+            || !is_builtin_global(S, fqn)
+            || !get_global(fun, S, fqn)
+            || !vis_function(fun)
+            || !builtin_pure(vfunction(fun))) {
+        return false;
+    }
+    u32 num_args = expr->list_length - 1;
+    auto stub = vfunction(fun)->stub;
+    if (num_args < stub->num_params
+            || (!stub->vari && num_args > stub->num_params)) {
+        return false;
+    }
+    dyn_array<value> args;
+    for (u32 i = 0; i < num_args; ++i) {
+        value v;
+        if (!eval_constant(v, expr->datum.list[i+1])) {
             return false;
         }
+        args.push_back(v);
+    }
+    auto save_sp = S->sp;
+    auto save_bp = S->bp;
+    auto save_trace = S->stack_trace.size;
+    if (S->sp + num_args + 1 > S->stack_size
+            && !grow_stack(S, S->sp + num_args + 1)) {
+        clear_error_info(S->err);
+        return false;
     }
-    emit8(OP_LIST);
-    emit8(root->list_length - 1);
-    sp = start_sp + 1;
-    return true;
+    push(S, fun);
+    for (auto v : args) {
+        push(S, v);
+    }
+    call(S, num_args);
+    if (has_error(S)) {
+        clear_error_info(S->err);
+        S->stack_trace.resize(save_trace);
+        S->sp = save_sp;
+        S->bp = save_bp;
+        return false;
+    }
+    out = peek(S);
+    S->sp = save_sp;
+    return vis_number(out) || out == V_YES || out == V_NO || out == V_NIL;
 }
 
-bool bc_compiler::compile_symbol_list(const ast::node* root, bool tail) {
-    // if this is called, we're guaranteed that the list begins with a symbol
-
-    auto name = scanner_name(*sst, root->datum.list[0]->datum.str_id);
-    auto sym_id = intern_id(S, name);
-    if (sym_id == cached_sym(S, SC_DEF)) {
-        return compile_def(root);
-    } else if (sym_id == cached_sym(S, SC_DEFMACRO)) {
-        return compile_defmacro(root);
-    } else if (sym_id == cached_sym(S, SC_DO)) {
-        return compile_do(root, tail);
-    } else if (sym_id == cached_sym(S, SC_IF)) {
-        return compile_if(root, tail);
-    } else if (sym_id == cached_sym(S, SC_IMPORT)) {
-        return compile_import(root);
-    } else if (sym_id == cached_sym(S, SC_FN)) {
-        return compile_fn(root);
-    } else if (sym_id == cached_sym(S, SC_LET)) {
-        return compile_let(root);
-    } else if (sym_id == cached_sym(S, SC_QUOTE)) {
-        return compile_quote(root);
-    } else if (sym_id == cached_sym(S, SC_SET)) {
-        return compile_set(root);
-    } else if (sym_id == cached_sym(S, SC_APPLY)) {
-        return compile_apply(root, tail);
-    } else if (name == ".") {
-        return compile_dot(root);
-    } else if (name == "List") {
-        return compile_List(root);
+void bc_compiler::compile_constant(value v) {
+    if (v == V_YES) {
+        emit_op(OP_YES);
+    } else if (v == V_NO) {
+        emit_op(OP_NO);
+    } else if (v == V_NIL) {
+        emit_op(OP_NIL);
     } else {
-        return compile_call(root, tail);
+        auto cid = output->const_table.size;
+        if (vis_int(v)) {
+            output->const_table.push_back(bc_output_const{
+                        bck_int,
+                        {.i = vint(v)}
+                    });
+        } else {
+            output->const_table.push_back(bc_output_const{
+                        bck_float,
+                        {.f = vfloat(v)}
+                    });
+        }
+        emit_op(OP_CONST);
+        emit16(cid);
     }
-    return true;
+    inc_sp();
 }
 
-bool bc_compiler::compile_call(const ast::node* root, bool tail) {
+bool bc_compiler::compile_method_call(const ast::node* root, bool tail) {
     auto save_sp = sp;
-    for (u32 i = 0; i < root->list_length; ++i) {
+    if (!compile_const_symbol(root->datum.list[0]->datum.list[1]->datum.str_id)) {
+        return false;
+    }
+    for (u32 i = 1; i < root->list_length; ++i) {
         if (!compile(root->datum.list[i], false)) {
             return false;
         }
     }
-    emit8(tail ? OP_TCALL : OP_CALL);
+    emit_op(tail ? OP_TCALLM : OP_CALLM);
     emit8(root->list_length - 1);
+    emit16(output->num_method_caches++);
     sp = save_sp + 1;
     return true;
 }
 
 bool bc_compiler::compile_body(const ast::node** exprs, u32 len, bool tail) {
     if (len == 0) {
-        emit8(OP_NIL);
+        emit_op(OP_NIL);
         return true;
     }
     u32 save_sp = sp;
     u32 i;
     for (i = 0; i < len - 1; ++i) {
-        if (!compile_within_body(exprs[i], false)) {
+        // constant expressions have no effect here
+        value v;
+        if (eval_constant(v, exprs[i])) {
+            continue;
+        }
+        if (!compile_within_body(exprs[i], false, &exprs[i+1], len - i - 1)) {
             return false;
         }
-        emit8(OP_POP);
+        emit_op(OP_POP);
         --sp;
     }
-    if (!compile_within_body(exprs[i], tail)) {
+    if (!compile_within_body(exprs[i], tail, &exprs[i+1], 0)) {
         return false;
     }
     if (!tail) {
-        emit8(OP_CLOSE);
+        emit_op(OP_CLOSE);
         emit8(sp - save_sp);
     }
     sp = save_sp + 1;
@@ -683,6 +2644,14 @@ bool bc_compiler::is_dot_form(const ast::node* expr) {
         == ".";
 }
 
+bool bc_compiler::is_quoted_symbol(const ast::node* expr) {
+    return expr->kind == ast::ak_list && expr->list_length == 2
+        && expr->datum.list[0]->kind == ast::ak_symbol
+        && intern_id(S, scanner_name(*sst, expr->datum.list[0]->datum.str_id))
+        == cached_sym(S, SC_QUOTE)
+        && expr->datum.list[1]->kind == ast::ak_symbol;
+}
+
 bool bc_compiler::validate_let_form(const ast::node* expr) {
     if ((expr->list_length & 1) != 1) {
         compile_error(expr->loc, "let requires an even number of arguments.");
@@ -705,58 +2674,298 @@ bool bc_compiler::validate_let_form(const ast::node* expr) {
     return true;
 }
 
-bool bc_compiler::compile_within_body(const ast::node* expr, bool tail) {
-    bool did_expand = false;
+bool bc_compiler::compile_within_body(const ast::node* expr, bool tail,
+        const ast::node** rest, u32 rest_len) {
     auto expanded = macroexpand(expr);
     if (expanded) {
-        did_expand = true;
         expr = expanded;
     }
     if (is_let_form(expr)) {
         if (!validate_let_form(expr)) {
-            if (did_expand) {
-                ast::free_graph(expanded);
-            }
             return false;
         }
         auto base_sp = sp;
         for (u32 i = 1; i < expr->list_length; i+=2) {
             auto str_id = expr->datum.list[i]->datum.str_id;
-            push_var(str_id);
-            emit8(OP_NIL);
-            ++sp;
+            push_var(str_id, false);
+            emit_op(OP_NIL);
+            inc_sp();
         }
         for (u32 i = 2; i < expr->list_length; i+=2) {
+            if (rest && scalar_replace(expr, i, base_sp + (i / 2) - 1, rest,
+                            rest_len)) {
+                continue;
+            }
+            bound_value = expr->datum.list[i];
+            bound_var = self_binding{expr->datum.list[i-1]->datum.str_id, true,
+                (u8)(base_sp + (i / 2) - 1)};
             compile(expr->datum.list[i], false);
-            emit8(OP_SET_LOCAL);
+            bound_value = nullptr;
+            emit_op(OP_SET_LOCAL);
             emit8(base_sp + (i / 2) - 1);
             --sp;
+            auto var = local_var_at(base_sp + (i / 2) - 1);
+            if (!var->mutated) {
+                var->type = infer_type(expr->datum.list[i]);
+            }
+            var->initialized = true;
         }
-        emit8(OP_NIL);
-        ++sp;
+        emit_op(OP_NIL);
+        inc_sp();
     } else if (is_do_inline_form(expr)) {
         if (expr->list_length == 1) {
-            emit8(OP_NIL);
-            ++sp;
+            emit_op(OP_NIL);
+            inc_sp();
         } else {
             u32 i;
             for (i = 1; i < expr->list_length-1; ++i) {
                 compile_within_body(expr->datum.list[i], false);
-                emit8(OP_POP);
+                emit_op(OP_POP);
                 --sp;
             }
             compile_within_body(expr->datum.list[i], tail);
         }
-    } else {
-        if (!compile(expr, tail)) {
-            if (did_expand) {
-                ast::free_graph(expanded);
+    } else {
+        if (!compile(expr, tail)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: (Scalar replacement). A List or Table form bound to a let variable
+// which is only ever used to take elements back out of it, i.e. in forms like
+// (head (tail x)) or (. x 'key), doesn't need to build anything. Instead,
+// each of its elements is kept in a hidden local variable of its own, and the
+// element accesses are compiled as references to those. The let variable
+// itself is left holding nil. Accesses must stay within the object: tails
+// past the end of the list aren't replaced, while fields missing from the
+// table are just nil. Table forms are only replaced if their keys are
+// distinct quoted symbols.
+//
+// To check this, every appearance of the variable's name in its scope (the
+// rest of the let form and the rest of the body) is examined after
+// macroexpansion, and if any isn't an element access, nothing is replaced.
+// This doesn't take shadowing into account, so rebinding the name anywhere in
+// its scope also prevents it. Closures work as usual, since the hidden
+// variables can be captured like any others. Since the call is never made,
+// there's nothing to guard, so like constant folding, this only recognizes
+// head, tail, and Table through their names in fn/builtin.
+
+fn_function* bc_compiler::global_fun(sst_id name) {
+    symbol_id fqn;
+    value v;
+    if (is_lexical_var(name)
+            || !resolve_symbol(fqn, S, intern_id(S, scanner_name(*sst, name)))
+            || !get_global(v, S, fqn)
+            || !vis_function(v)) {
+        return nullptr;
+    }
+    return vfunction(v);
+}
+
+fn_function* bc_compiler::builtin_fun(sst_id name) {
+    symbol_id fqn;
+    if (is_lexical_var(name)
+            || !resolve_symbol(fqn, S, intern_id(S, scanner_name(*sst, name)))
+            || !is_builtin_global(S, fqn)) {
+        return nullptr;
+    }
+    return global_fun(name);
+}
+
+bool bc_compiler::is_replaceable_form(const ast::node* form) {
+    if (form->kind != ast::ak_list || form->list_length < 2
+            || form->list_length > SCALAR_REPLACE_MAX * 2 + 1
+            || form->datum.list[0]->kind != ast::ak_symbol) {
+        return false;
+    }
+    auto op = form->datum.list[0]->datum.str_id;
+    if (scanner_name(*sst, op) == "List") {
+        return form->list_length <= SCALAR_REPLACE_MAX + 1;
+    }
+    auto fun = builtin_fun(op);
+    if (!fun || !builtin_table(fun) || (form->list_length & 1) != 1) {
+        return false;
+    }
+    for (u32 i = 1; i < form->list_length; i += 2) {
+        auto key = form->datum.list[i];
+        if (!is_quoted_symbol(key)) {
+            return false;
+        }
+        for (u32 j = 1; j < i; j += 2) {
+            if (form->datum.list[j]->datum.list[1]->datum.str_id
+                    == key->datum.list[1]->datum.str_id) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool bc_compiler::match_elem_access(u32& index, const ast::node* expr,
+        sst_id name, const ast::node* agg) {
+    if (expr->kind != ast::ak_list || expr->list_length < 2
+            || expr->datum.list[0]->kind != ast::ak_symbol
+            || macroexpand(expr)) {
+        return false;
+    }
+    if (scanner_name(*sst, agg->datum.list[0]->datum.str_id) != "List") {
+        // (. x 'key)
+        auto obj = expr->datum.list[1];
+        auto key = expr->list_length == 3 ? expr->datum.list[2] : nullptr;
+        if (scanner_name(*sst, expr->datum.list[0]->datum.str_id) != "."
+                || !key || !is_quoted_symbol(key)
+                || obj->kind != ast::ak_symbol || obj->datum.str_id != name) {
+            return false;
+        }
+        index = (u32)-1;
+        for (u32 i = 1; i < agg->list_length; i += 2) {
+            if (agg->datum.list[i]->datum.list[1]->datum.str_id
+                    == key->datum.list[1]->datum.str_id) {
+                index = i / 2;
+            }
+        }
+        return true;
+    }
+    // (head (tail ... (tail x)))
+    bool is_head;
+    auto fun = builtin_fun(expr->datum.list[0]->datum.str_id);
+    if (expr->list_length != 2 || !fun || !builtin_list_access(is_head, fun)
+            || !is_head) {
+        return false;
+    }
+    u32 num_tails = 0;
+    auto x = expr->datum.list[1];
+    while (x->kind == ast::ak_list) {
+        if (x->list_length != 2 || x->datum.list[0]->kind != ast::ak_symbol
+                || macroexpand(x)) {
+            return false;
+        }
+        fun = builtin_fun(x->datum.list[0]->datum.str_id);
+        if (!fun || !builtin_list_access(is_head, fun) || is_head) {
+            return false;
+        }
+        ++num_tails;
+        x = x->datum.list[1];
+    }
+    if (x->kind != ast::ak_symbol || x->datum.str_id != name
+            || num_tails >= agg->list_length - 1) {
+        return false;
+    }
+    index = num_tails;
+    return true;
+}
+
+bool bc_compiler::var_escapes(sst_id name, const ast::node* expr,
+        const ast::node* agg) {
+    if (has_error(S)) {
+        return true;
+    }
+    if (expr->kind == ast::ak_symbol) {
+        return expr->datum.str_id == name;
+    } else if (expr->kind != ast::ak_list) {
+        return false;
+    }
+    auto expanded = macroexpand(expr);
+    if (has_error(S)) {
+        return true;
+    } else if (expanded) {
+        return var_escapes(name, expanded, agg);
+    }
+    u32 index;
+    if (agg && match_elem_access(index, expr, name, agg)) {
+        return false;
+    }
+    // set! on a field needs the real object
+    if (expr->list_length > 0 && expr->datum.list[0]->kind == ast::ak_symbol
+            && intern_id(S, scanner_name(*sst, expr->datum.list[0]->datum.str_id))
+            == cached_sym(S, SC_SET)) {
+        agg = nullptr;
+    }
+    for (u32 i = 0; i < expr->list_length; ++i) {
+        if (var_escapes(name, expr->datum.list[i], agg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+sst_id bc_compiler::elem_var_name(sst_id name, u32 id, u32 index) {
+    // the spaces keep these from colliding with real variables
+    return scanner_intern(*sst, scanner_name(*sst, name) + " "
+            + std::to_string(id) + " " + std::to_string(index));
+}
+
+bool bc_compiler::scalar_replace(const ast::node* let_form, u32 i, u8 index,
+        const ast::node** rest, u32 rest_len) {
+    auto name = let_form->datum.list[i-1]->datum.str_id;
+    auto form = macroexpand(let_form->datum.list[i]);
+    if (!form) {
+        form = let_form->datum.list[i];
+    }
+    if (has_error(S) || !is_replaceable_form(form)) {
+        return false;
+    }
+    for (u32 j = 1; j < let_form->list_length; ++j) {
+        auto x = let_form->datum.list[j];
+        if ((j & 1) == 1) {
+            // another binding of the same name
+            if (j != i - 1 && x->datum.str_id == name) {
+                return false;
             }
+        } else if (var_escapes(name, x, j > i ? form : nullptr)) {
+            // the elements don't exist yet in this or earlier values
+            return false;
+        }
+    }
+    for (u32 j = 0; j < rest_len; ++j) {
+        if (var_escapes(name, rest[j], form)) {
             return false;
         }
     }
-    if (did_expand) {
-        ast::free_graph(expanded);
+
+    // the elements go on the stack in order, and each becomes a variable
+    bool is_list = scanner_name(*sst, form->datum.list[0]->datum.str_id)
+        == "List";
+    auto id = local_var_at(index)->id;
+    u32 k = 0;
+    for (u32 j = is_list ? 1 : 2; j < form->list_length; j += is_list ? 1 : 2) {
+        auto type = infer_type(form->datum.list[j]);
+        compile(form->datum.list[j], false);
+        --sp;
+        push_var(elem_var_name(name, id, k++));
+        vars[vars.size - 1].type = type;
+        inc_sp();
+    }
+    auto var = local_var_at(index);
+    var->agg = form;
+    var->initialized = true;
+    return true;
+}
+
+bool bc_compiler::find_elem_access(sst_id& elem, bool& present,
+        const ast::node* expr) {
+    // find the variable the object would be in
+    if (expr->kind != ast::ak_list || expr->list_length < 2) {
+        return false;
+    }
+    auto x = expr->datum.list[1];
+    while (x->kind == ast::ak_list && x->list_length == 2) {
+        x = x->datum.list[1];
+    }
+    if (x->kind != ast::ak_symbol) {
+        return false;
+    }
+    auto var = lookup_lexical_var(x->datum.str_id);
+    u32 index;
+    if (!var || !var->agg
+            || !match_elem_access(index, expr, x->datum.str_id, var->agg)) {
+        return false;
+    }
+    present = index != (u32)-1;
+    if (present) {
+        elem = elem_var_name(x->datum.str_id, var->id, index);
     }
     return true;
 }
@@ -768,9 +2977,9 @@ bool bc_compiler::compile_int(const ast::node* root) {
                 bck_int,
                 {.i = root->datum.i}
             });
-    emit8(OP_CONST);
+    emit_op(OP_CONST);
     emit16(cid);
-    ++sp;
+    inc_sp();
     return true;
 }
 
@@ -781,9 +2990,9 @@ bool bc_compiler::compile_float(const ast::node* root) {
                 bck_float,
                 {.f = root->datum.f}
             });
-    emit8(OP_CONST);
+    emit_op(OP_CONST);
     emit16(cid);
-    ++sp;
+    inc_sp();
     return true;
 }
 
@@ -794,54 +3003,66 @@ bool bc_compiler::compile_string(const ast::node* root) {
                 bck_string, 
                 {.str_id = root->datum.str_id}
             });
-    emit8(OP_CONST);
+    emit_op(OP_CONST);
     emit16(cid);
-    ++sp;
+    inc_sp();
     return true;
 }
 
 bool bc_compiler::compile_symbol(const ast::node* root) {
     auto sid = intern_id(S, scanner_name(*sst, root->datum.str_id));
     if (sid == cached_sym(S, SC_YES)) {
-        emit8(OP_YES);
-        ++sp;
+        emit_op(OP_YES);
+        inc_sp();
     } else if (sid == cached_sym(S, SC_NO)) {
-        emit8(OP_NO);
-        ++sp;
+        emit_op(OP_NO);
+        inc_sp();
     } else if (sid == cached_sym(S, SC_NIL)) {
-        emit8(OP_NIL);
-        ++sp;
+        emit_op(OP_NIL);
+        inc_sp();
     } else {
         // variable lookup
-        u8 index;
-        if (find_local_var(index, root->datum.str_id)) {
-            emit8(OP_LOCAL);
-            emit8(index);
-            ++sp;
-        } else if (find_upvalue_var(index, root->datum.str_id)) {
-            emit8(OP_UPVALUE);
-            emit8(index);
-            ++sp;
-        } else {
+        if (!compile_lexical_ref(root->datum.str_id)) {
             u32 gid;
             if (!lookup_global_id(gid, root->datum.str_id)) {
                 compile_error(root->loc, "Failed to resolve global variable "
                         + scanner_name(*sst, root->datum.str_id));
                 return false;
             }
-            emit8(OP_GLOBAL);
+            emit_op(OP_GLOBAL);
             emit32(gid);
-            ++sp;
+            inc_sp();
         }
     }
     return true;
 }
 
+bool bc_compiler::compile_lexical_ref(sst_id name) {
+    u8 index;
+    bool flat;
+    if (find_local_var(index, name)) {
+        emit_op(OP_LOCAL);
+        emit8(index);
+    } else if (find_upvalue_var(index, flat, name)) {
+        emit_op(flat ? OP_FLAT_UPVALUE : OP_UPVALUE);
+        emit8(index);
+    } else {
+        return false;
+    }
+    inc_sp();
+    return true;
+}
+
 bool bc_compiler::compile_list(const ast::node* root, bool tail) {
     if (root->list_length == 0) {
         compile_error(root->loc, "Empty list is not a legal expression.");
         return false;
     }
+    value v;
+    if (eval_constant(v, root)) {
+        compile_constant(v);
+        return true;
+    }
     if (root->datum.list[0]->kind == ast::ak_symbol) {
         return compile_symbol_list(root, tail);
     } else {
@@ -850,11 +3071,13 @@ bool bc_compiler::compile_list(const ast::node* root, bool tail) {
     return true;
 }
 
-// TODO: track stack space required by each function
 bool bc_compiler::compile(const ast::node* root, bool tail) {
     update_source(root->loc);
     auto expanded = macroexpand(root);
     if (expanded) {
+        if (root == toplevel_form) {
+            toplevel_form = expanded;
+        }
         root = expanded;
     }
     bool res;
@@ -880,32 +3103,616 @@ bool bc_compiler::compile(const ast::node* root, bool tail) {
         res = false;
         break;
     }
-    if (expanded) {
-        ast::free_graph(expanded);
-    }
     return res;
 }
 
+// NOTE: (Peephole optimizer). Once a function has been compiled, its code is
+// cleaned up by a pass over the finished bytecode. The compiler emits code one
+// form at a time, so it leaves behind sequences like the nil pushed and popped
+// after every let, the no-op close 1 at the end of a body with no variables,
+// jumps to jumps and to returns, and values which are pushed only to be
+// popped. The pass decodes the code into a list of instructions, with each jump
+// pointing at the index of its target, and repeatedly applies the rewrites
+// below until nothing changes. Then it lays out the surviving instructions,
+// re-fusing superinstructions where removals made new pairs adjacent, and
+// recomputes the jump offsets and code_info addresses. Instructions are never
+// combined across a jump target.
+//
+// A let variable is allocated by pushing nil and later given its value with
+// set-local. When the value is a single instruction that pushes it without
+// looking at the stack slot, nil; <push>; set-local just becomes <push>. To
+// make sure the set-local refers to the slot the nil was pushed into, the pass
+// computes the stack depth at each instruction. If that fails (which would
+// mean the compiler emitted inconsistent code), the rewrite is skipped.
+
+struct peep_instr {
+    // opcode followed by operands. guard-global is the widest instruction.
+    u8 bytes[16];
+    u8 width;
+    bool live;
+    // stack depth before the instruction, or -1 if unknown
+    i32 depth;
+    // index of the jump target, for jump instructions
+    u32 target;
+};
+
+static bool is_jump_op(u8 op) {
+    switch (op) {
+    case OP_JUMP:
+    case OP_CJUMP:
+    case OP_EQ_CJUMP:
+    case OP_LT_CJUMP:
+    case OP_LE_CJUMP:
+    case OP_GT_CJUMP:
+    case OP_GE_CJUMP:
+    case OP_LT_INT_CJUMP:
+    case OP_LE_INT_CJUMP:
+    case OP_GT_INT_CJUMP:
+    case OP_GE_INT_CJUMP:
+    case OP_GUARD_INT:
+    case OP_GUARD_SELF:
+    case OP_GUARD_GLOBAL:
+        return true;
+    }
+    return false;
+}
+
+// instructions which push one value and have no other effect
+static bool is_pure_push(u8 op) {
+    switch (op) {
+    case OP_LOCAL:
+    case OP_COPY:
+    case OP_UPVALUE:
+    case OP_FLAT_UPVALUE:
+    case OP_CONST:
+    case OP_NIL:
+    case OP_NO:
+    case OP_YES:
+        return true;
+    }
+    return false;
+}
+
+// change in stack depth caused by an instruction. Returns false for
+// instructions that don't continue to the next one or whose effect isn't known.
+static bool stack_effect(i32& res, const peep_instr& in,
+        const bc_compiler_output& out) {
+    auto n = (i32)in.bytes[1];
+    switch (in.bytes[0]) {
+    case OP_NOP:
+    case OP_CLOSE_FROM:
+    case OP_SET_GLOBAL:
+    case OP_GET_FIELD:
+    case OP_SET_MACRO:
+    case OP_JUMP:
+    case OP_GUARD_INT:
+    case OP_GUARD_SELF:
+    case OP_GUARD_GLOBAL:
+        res = 0;
+        return true;
+    case OP_LOCAL:
+    case OP_COPY:
+    case OP_UPVALUE:
+    case OP_FLAT_UPVALUE:
+    case OP_GLOBAL:
+    case OP_MACRO:
+    case OP_CONST:
+    case OP_NIL:
+    case OP_NO:
+    case OP_YES:
+    case OP_LOCAL_GET_FIELD:
+        res = 1;
+        return true;
+    case OP_LOCAL2:
+    case OP_LOCAL_CONST:
+    case OP_GLOBAL_LOCAL:
+        res = 2;
+        return true;
+    case OP_POP:
+    case OP_SET_LOCAL:
+    case OP_SET_UPVALUE:
+    case OP_OBJ_GET:
+    case OP_SET_FIELD:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_ADD_INT:
+    case OP_SUB_INT:
+    case OP_MUL_INT:
+    case OP_ADD_FLOAT:
+    case OP_SUB_FLOAT:
+    case OP_MUL_FLOAT:
+    case OP_LT_INT:
+    case OP_LE_INT:
+    case OP_GT_INT:
+    case OP_GE_INT:
+    case OP_CJUMP:
+        res = -1;
+        return true;
+    case OP_OBJ_SET:
+    case OP_IMPORT:
+    case OP_EQ_CJUMP:
+    case OP_LT_CJUMP:
+    case OP_LE_CJUMP:
+    case OP_GT_CJUMP:
+    case OP_GE_CJUMP:
+    case OP_LT_INT_CJUMP:
+    case OP_LE_INT_CJUMP:
+    case OP_GT_INT_CJUMP:
+    case OP_GE_INT_CJUMP:
+        res = -2;
+        return true;
+    case OP_CLOSURE: {
+        auto fid = *(u16*)&in.bytes[1];
+        if (fid >= out.sub_funs.size) {
+            return false;
+        }
+        res = 1 - (i32)out.sub_funs[fid].num_opt;
+        return true;
+    }
+    case OP_CLOSE:
+    case OP_LIST:
+        res = 1 - n;
+        return true;
+    case OP_CALL:
+    case OP_TCALL:
+    case OP_CALLM:
+    case OP_TCALLM:
+        // tail calls to foreign functions continue to the next instruction
+        res = -n;
+        return true;
+    case OP_CALL_KNOWN:
+    case OP_TCALL_KNOWN:
+    case OP_CALL_FOREIGN:
+        res = 1 - (i32)in.bytes[5];
+        return true;
+    case OP_APPLY:
+    case OP_TAPPLY:
+        res = -n - 1;
+        return true;
+    }
+    return false;
+}
+
+struct peephole_pass {
+    bc_compiler_output& out;
+    // stack depth on entry to the function, i.e. its number of parameters
+    u32 base_sp;
+    dyn_array<peep_instr> instrs;
+    // instruction index of each original address, or -1 if an address isn't
+    // the start of an instruction
+    dyn_array<u32> index_of;
+    // whether some live jump lands on each instruction
+    dyn_array<bool> is_target;
+
+    peephole_pass(bc_compiler_output& out, u32 base_sp)
+        : out{out}
+        , base_sp{base_sp} {
+    }
+
+    // returns false if the code couldn't be decoded, in which case it's left
+    // alone
+    bool run() {
+        if (!decode()) {
+            return false;
+        }
+        compute_depths();
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            find_targets();
+            changed = thread_jumps() || changed;
+            changed = remove_dead_code() || changed;
+            find_targets();
+            changed = simplify() || changed;
+        }
+        encode();
+        return true;
+    }
+
+    bool decode() {
+        auto& code = out.code;
+        for (u32 i = 0; i <= code.size; ++i) {
+            index_of.push_back((u32)-1);
+        }
+        for (u32 pc = 0; pc < code.size; ) {
+            peep_instr in;
+            in.width = instr_width(code[pc]);
+            if (pc + in.width > code.size || in.width > sizeof(in.bytes)) {
+                return false;
+            }
+            for (u32 j = 0; j < in.width; ++j) {
+                in.bytes[j] = code[pc + j];
+            }
+            in.live = true;
+            in.depth = -1;
+            in.target = 0;
+            index_of[pc] = instrs.size;
+            instrs.push_back(in);
+            pc += in.width;
+        }
+        index_of[code.size] = instrs.size;
+        // resolve jump targets to instruction indices
+        u32 pc = 0;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            auto& in = instrs[i];
+            pc += in.width;
+            if (is_jump_op(in.bytes[0])) {
+                auto dest = (i64)pc + (i16)read_operand16(in);
+                if (dest < 0 || dest > (i64)code.size
+                        || index_of[dest] == (u32)-1) {
+                    return false;
+                }
+                in.target = index_of[dest];
+            }
+        }
+        return true;
+    }
+
+    static u16 read_operand16(const peep_instr& in) {
+        // the jump offset is always the last operand
+        return *(u16*)&in.bytes[in.width - 2];
+    }
+
+    // forward data flow over the original code. Depths are left unknown if
+    // they don't agree where control flow meets.
+    void compute_depths() {
+        dyn_array<u32> work;
+        if (instrs.size == 0) {
+            return;
+        }
+        instrs[0].depth = base_sp;
+        work.push_back(0);
+        while (work.size > 0) {
+            auto i = work[work.size - 1];
+            work.pop();
+            auto& in = instrs[i];
+            auto op = in.bytes[0];
+            if (op == OP_RETURN) {
+                continue;
+            }
+            i32 effect;
+            if (!stack_effect(effect, in, out)) {
+                clear_depths();
+                return;
+            }
+            auto d = in.depth + effect;
+            if (d < 0) {
+                clear_depths();
+                return;
+            }
+            if (is_jump_op(op)) {
+                if (!flow_to(work, in.target, d)) {
+                    return;
+                }
+            }
+            if (op != OP_JUMP && !flow_to(work, i + 1, d)) {
+                return;
+            }
+        }
+    }
+
+    bool flow_to(dyn_array<u32>& work, u32 i, i32 depth) {
+        if (i >= instrs.size) {
+            clear_depths();
+            return false;
+        }
+        if (instrs[i].depth == -1) {
+            instrs[i].depth = depth;
+            work.push_back(i);
+        } else if (instrs[i].depth != depth) {
+            clear_depths();
+            return false;
+        }
+        return true;
+    }
+
+    void clear_depths() {
+        for (u32 i = 0; i < instrs.size; ++i) {
+            instrs[i].depth = -1;
+        }
+    }
+
+    // index of the first live instruction at or after i
+    u32 next_live(u32 i) {
+        while (i < instrs.size && !instrs[i].live) {
+            ++i;
+        }
+        return i;
+    }
+
+    void find_targets() {
+        is_target.resize(0);
+        for (u32 i = 0; i <= instrs.size; ++i) {
+            is_target.push_back(false);
+        }
+        // self tail calls jump back to the start
+        is_target[0] = true;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            auto& in = instrs[i];
+            if (in.live && is_jump_op(in.bytes[0])) {
+                in.target = next_live(in.target);
+                is_target[in.target] = true;
+            }
+        }
+    }
+
+    bool thread_jumps() {
+        bool changed = false;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            auto& in = instrs[i];
+            if (!in.live || !is_jump_op(in.bytes[0])) {
+                continue;
+            }
+            // follow chains of unconditional jumps. The bound keeps us out of
+            // infinite loops.
+            for (u32 k = 0; k < 8 && in.target < instrs.size; ++k) {
+                auto& dest = instrs[in.target];
+                if (dest.bytes[0] != OP_JUMP || dest.target == in.target) {
+                    break;
+                }
+                in.target = next_live(dest.target);
+                changed = true;
+            }
+            if (in.bytes[0] == OP_JUMP && in.target < instrs.size
+                    && instrs[in.target].bytes[0] == OP_RETURN) {
+                // a jump to a return is just a return
+                in.bytes[0] = OP_RETURN;
+                in.width = 1;
+                changed = true;
+            } else if (in.bytes[0] == OP_JUMP
+                    && in.target == next_live(i + 1)) {
+                in.live = false;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool remove_dead_code() {
+        dyn_array<bool> reached;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            reached.push_back(false);
+        }
+        dyn_array<u32> work;
+        work.push_back(0);
+        while (work.size > 0) {
+            auto i = next_live(work[work.size - 1]);
+            work.pop();
+            while (i < instrs.size && !reached[i]) {
+                reached[i] = true;
+                auto op = instrs[i].bytes[0];
+                if (is_jump_op(op)) {
+                    work.push_back(instrs[i].target);
+                }
+                if (op == OP_JUMP || op == OP_RETURN) {
+                    break;
+                }
+                i = next_live(i + 1);
+            }
+        }
+        bool changed = false;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            if (instrs[i].live && !reached[i]) {
+                instrs[i].live = false;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool simplify() {
+        bool changed = false;
+        for (u32 i = next_live(0); i < instrs.size; i = next_live(i + 1)) {
+            auto& in = instrs[i];
+            auto op = in.bytes[0];
+            // close 1 leaves the stack as is. (The slot it would close is the
+            // one holding the result.)
+            if (op == OP_CLOSE && in.bytes[1] == 1) {
+                in.live = false;
+                changed = true;
+                continue;
+            }
+            auto j = next_live(i + 1);
+            if (j >= instrs.size || is_target[j]) {
+                continue;
+            }
+            auto& next = instrs[j];
+            // values pushed only to be popped
+            if (next.bytes[0] == OP_POP) {
+                if (is_pure_push(op)) {
+                    in.live = false;
+                    next.live = false;
+                    changed = true;
+                } else if (op == OP_LOCAL2 || op == OP_LOCAL_CONST) {
+                    in.bytes[0] = OP_LOCAL;
+                    in.width = 2;
+                    next.live = false;
+                    changed = true;
+                }
+                continue;
+            }
+            // nil; <push>; set-local for a let variable
+            auto k = next_live(j + 1);
+            if (op == OP_NIL && in.depth >= 0 && k < instrs.size
+                    && !is_target[k] && instrs[k].bytes[0] == OP_SET_LOCAL
+                    && instrs[k].bytes[1] == in.depth
+                    && is_pure_push(next.bytes[0]) && next.bytes[0] != OP_COPY
+                    && !(next.bytes[0] == OP_LOCAL
+                            && next.bytes[1] == in.depth)) {
+                in.live = false;
+                instrs[k].live = false;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // new address corresponding to an old one. Addresses can point into the
+    // middle of a superinstruction, in which case they keep their offset if
+    // it's still there.
+    u32 map_addr(u32 addr, dyn_array<u32>& new_addr, dyn_array<bool>& emitted) {
+        if (addr >= index_of.size) {
+            return new_addr[instrs.size];
+        }
+        auto start = addr;
+        while (start > 0 && index_of[start] == (u32)-1) {
+            --start;
+        }
+        auto i = index_of[start];
+        auto offset = addr - start;
+        if (offset == 0 || i >= instrs.size) {
+            return new_addr[i];
+        } else if (emitted[i] && instrs[i].live && offset < instrs[i].width) {
+            return new_addr[i] + offset;
+        }
+        return new_addr[i + 1];
+    }
+
+    void encode() {
+        // lay out the code, fusing superinstructions as emit_op() does
+        dyn_array<u32> new_addr;
+        dyn_array<bool> emitted;
+        dyn_array<u8> code;
+        u32 last = (u32)-1;
+        for (u32 i = 0; i < instrs.size; ++i) {
+            auto& in = instrs[i];
+            new_addr.push_back(code.size);
+            emitted.push_back(false);
+            if (!in.live) {
+                continue;
+            }
+            emitted[i] = true;
+            if (last != (u32)-1 && !is_target[i]) {
+                auto& prev = instrs[last];
+                auto fused = fuse_instrs(prev.bytes[0], in.bytes[0]);
+                if (fused != OP_NOP) {
+                    prev.bytes[0] = fused;
+                    code[new_addr[last]] = fused;
+                    for (u32 j = 1; j < in.width; ++j) {
+                        prev.bytes[prev.width++] = in.bytes[j];
+                        code.push_back(in.bytes[j]);
+                    }
+                    prev.target = in.target;
+                    in.live = false;
+                    // the second instruction starts inside the superinstruction,
+                    // just like when emit_op() fuses them
+                    new_addr[i] = new_addr[last] + prev.width - in.width + 1;
+                    // superinstructions are only made from two instructions
+                    last = (u32)-1;
+                    continue;
+                }
+            }
+            for (u32 j = 0; j < in.width; ++j) {
+                code.push_back(in.bytes[j]);
+            }
+            last = i;
+        }
+        new_addr.push_back(code.size);
+        // removed instructions map to the next one that's left
+        for (u32 i = instrs.size; i > 0; --i) {
+            if (!emitted[i-1]) {
+                new_addr[i-1] = new_addr[i];
+            }
+        }
+        // patch jump offsets
+        for (u32 i = 0; i < instrs.size; ++i) {
+            auto& in = instrs[i];
+            if (!in.live || !is_jump_op(in.bytes[0])) {
+                continue;
+            }
+            auto end = new_addr[i] + in.width;
+            auto offset = (i16)((i32)new_addr[in.target] - (i32)end);
+            *(u16*)&code[end - 2] = (u16)offset;
+        }
+        // fix up source locations. When several entries land on the same
+        // address, the last one applies.
+        dyn_array<code_info> ci_arr;
+        for (u32 i = 0; i < out.ci_arr.size; ++i) {
+            auto ci = out.ci_arr[i];
+            ci.start_addr = map_addr(ci.start_addr, new_addr, emitted);
+            if (ci_arr.size > 1
+                    && ci_arr[ci_arr.size-1].start_addr == ci.start_addr) {
+                ci_arr[ci_arr.size-1] = ci;
+            } else {
+                ci_arr.push_back(ci);
+            }
+        }
+        out.code = code;
+        out.ci_arr = ci_arr;
+    }
+};
+
 bool bc_compiler::compile_function_body(const ast::node** exprs, u32 len) {
+    auto base_sp = sp;
+    auto base_vars = vars.size;
+    auto base_num_vars = num_vars;
+    // guards for specialized parameters (see NOTE: (Type inference))
+    dyn_array<u32> guards;
+    for (auto i : spec_params) {
+        emit_op(OP_GUARD_INT);
+        emit8(i);
+        guards.push_back(output->code.size);
+        emit16(0);
+        local_var_at(i)->type = nt_int;
+    }
     if (len == 0) {
-        emit8(OP_NIL);
-        ++sp;
+        emit_op(OP_NIL);
+        inc_sp();
     }
     if (!compile_body(exprs, len, true)) {
         return false;
     }
-    emit8(OP_RETURN);
+    emit_op(OP_RETURN);
+    if (guards.size > 0) {
+        // the unspecialized body. Variable IDs must match the first copy's.
+        for (auto g : guards) {
+            patch_jump(g);
+        }
+        sp = base_sp;
+        vars.resize(base_vars);
+        num_vars = base_num_vars;
+        for (auto i : spec_params) {
+            local_var_at(i)->type = nt_unknown;
+        }
+        if (!compile_body(exprs, len, true)) {
+            return false;
+        }
+        emit_op(OP_RETURN);
+    }
+    finish_stack_required();
+    peephole_pass(*output, base_sp).run();
     return true;
 }
 
 bool bc_compiler::compile_toplevel(const ast::node* root) {
+    toplevel_form = root;
+    bool fns = false;
+    collect_set_targets(set_targets, root, fns);
+    if (has_error(S)) {
+        return false;
+    }
     if (!compile(root, true)) {
         return false;
     }
-    emit8(OP_RETURN);
+    emit_op(OP_RETURN);
+    finish_stack_required();
+    peephole_pass(*output, 0).run();
     return true;
 }
 
+void bc_compiler::finish_stack_required() {
+    // arrange_call_stack() pushes an indicator argument for each optional
+    // parameter, and method calls on tables may insert a self argument above
+    // the top of the stack.
+    output->stack_required += output->num_opt + 1;
+}
+
 void bc_compiler::compile_error(const source_loc& loc, const string& message) {
     std::ostringstream os;
     os << "Line " << loc.line << ", col " << loc.col << ":\n  " << message;
@@ -914,7 +3721,9 @@ void bc_compiler::compile_error(const source_loc& loc, const string& message) {
 
 bool compile_to_bytecode(bc_compiler_output& out, istate* S,
         scanner_string_table& sst, const ast::node* root) {
+    expansion_cache expansions;
     bc_compiler c{nullptr, S, sst, out};
+    c.expansions = &expansions;
     return c.compile_toplevel(root);
 }
 
@@ -946,12 +3755,18 @@ static void disassemble_instr(u8* code_start, std::ostream& out) {
     case OP_SET_UPVALUE:
         out << "set-upvalue " << (i32)code_start[1];
         break;
+    case OP_FLAT_UPVALUE:
+        out << "flat-upvalue " << (i32)code_start[1];
+        break;
     case OP_CLOSURE:
         out << "closure " << read_short(&code_start[1]);
         break;
     case OP_CLOSE:
         out << "close " << (i32)code_start[1];
         break;
+    case OP_CLOSE_FROM:
+        out << "close-from " << (i32)code_start[1];
+        break;
     case OP_GLOBAL:
         // TODO: print GLOBAL and SET_GLOBAL IDs
         out << "global ";
@@ -984,10 +3799,20 @@ static void disassemble_instr(u8* code_start, std::ostream& out) {
         out << "set-macro " << read_short(&code_start[1]);
         break;
     case OP_CALLM:
-        out << "callm " << (i32)code_start[1];
+        out << "callm " << (i32)code_start[1] << " "
+            << read_short(&code_start[2]);
         break;
     case OP_TCALLM:
-        out << "tcallm " << (i32)code_start[1];
+        out << "tcallm " << (i32)code_start[1] << " "
+            << read_short(&code_start[2]);
+        break;
+    case OP_GET_FIELD:
+        out << "get-field " << read_short(&code_start[1]) << " "
+            << read_short(&code_start[3]);
+        break;
+    case OP_SET_FIELD:
+        out << "set-field " << read_short(&code_start[1]) << " "
+            << read_short(&code_start[3]);
         break;
     case OP_IMPORT:
         out << "import";
@@ -998,12 +3823,33 @@ static void disassemble_instr(u8* code_start, std::ostream& out) {
     case OP_CJUMP:
         out << "cjump " << (i32)(static_cast<i16>(read_short(&code_start[1])));
         break;
+    case OP_GUARD_INT:
+        out << "guard-int " << (i32)code_start[1] << " "
+            << (i32)(static_cast<i16>(read_short(&code_start[2])));
+        break;
+    case OP_GUARD_SELF:
+        out << "guard-self "
+            << (i32)(static_cast<i16>(read_short(&code_start[5])));
+        break;
+    case OP_GUARD_GLOBAL:
+        out << "guard-global "
+            << (i32)(static_cast<i16>(read_short(&code_start[13])));
+        break;
     case OP_CALL:
         out << "call " << (i32)code_start[1];
         break;
     case OP_TCALL:
         out << "tcall " << (i32)code_start[1];
         break;
+    case OP_CALL_KNOWN:
+        out << "call-known " << (i32)code_start[5];
+        break;
+    case OP_TCALL_KNOWN:
+        out << "tcall-known " << (i32)code_start[5];
+        break;
+    case OP_CALL_FOREIGN:
+        out << "call-foreign " << (i32)code_start[5];
+        break;
     case OP_APPLY:
         out << "apply " << (i32)code_start[1];
         break;
@@ -1013,6 +3859,111 @@ static void disassemble_instr(u8* code_start, std::ostream& out) {
     case OP_RETURN:
         out << "return";
         break;
+    case OP_ADD:
+        out << "add";
+        break;
+    case OP_SUB:
+        out << "sub";
+        break;
+    case OP_MUL:
+        out << "mul";
+        break;
+    case OP_EQ:
+        out << "eq";
+        break;
+    case OP_LT:
+        out << "lt";
+        break;
+    case OP_LE:
+        out << "le";
+        break;
+    case OP_GT:
+        out << "gt";
+        break;
+    case OP_GE:
+        out << "ge";
+        break;
+    case OP_ADD_INT:
+        out << "add-int";
+        break;
+    case OP_SUB_INT:
+        out << "sub-int";
+        break;
+    case OP_MUL_INT:
+        out << "mul-int";
+        break;
+    case OP_ADD_FLOAT:
+        out << "add-float";
+        break;
+    case OP_SUB_FLOAT:
+        out << "sub-float";
+        break;
+    case OP_MUL_FLOAT:
+        out << "mul-float";
+        break;
+    case OP_LT_INT:
+        out << "lt-int";
+        break;
+    case OP_LE_INT:
+        out << "le-int";
+        break;
+    case OP_GT_INT:
+        out << "gt-int";
+        break;
+    case OP_GE_INT:
+        out << "ge-int";
+        break;
+    case OP_LOCAL2:
+        out << "local2 " << (i32)code_start[1] << " " << (i32)code_start[2];
+        break;
+    case OP_LOCAL_CONST:
+        out << "local-const " << (i32)code_start[1] << " "
+            << read_short(&code_start[2]);
+        break;
+    case OP_GLOBAL_LOCAL:
+        out << "global-local " << (i32)code_start[5];
+        break;
+    case OP_LOCAL_GET_FIELD:
+        out << "local-get-field " << (i32)code_start[1] << " "
+            << read_short(&code_start[2]) << " "
+            << read_short(&code_start[4]);
+        break;
+    case OP_EQ_CJUMP:
+        out << "eq-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_LT_CJUMP:
+        out << "lt-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_LE_CJUMP:
+        out << "le-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_GT_CJUMP:
+        out << "gt-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_GE_CJUMP:
+        out << "ge-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_LT_INT_CJUMP:
+        out << "lt-int-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_LE_INT_CJUMP:
+        out << "le-int-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_GT_INT_CJUMP:
+        out << "gt-int-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
+    case OP_GE_INT_CJUMP:
+        out << "ge-int-cjump "
+            << (i32)(static_cast<i16>(read_short(&code_start[1])));
+        break;
     case OP_TABLE:
         out << "table";
         break;
@@ -1030,6 +3981,10 @@ static void disassemble_stub(std::ostringstream& os, istate* S, function_stub* s
             auto id = read_short(&stub->code[i+1]);
             auto val = stub->const_arr[id];
             os << "    " << "; " << v_to_string(val, S->symtab, true);
+        } else if (stub->code[i] == OP_LOCAL_CONST) {
+            auto id = read_short(&stub->code[i+2]);
+            auto val = stub->const_arr[id];
+            os << "    " << "; " << v_to_string(val, S->symtab, true);
         } else if (stub->code[i] == OP_GLOBAL) {
             // TODO: print global value
             // auto id = read_u32(&stub->code[i+1]);
@@ -1041,10 +3996,15 @@ static void disassemble_stub(std::ostringstream& os, istate* S, function_stub* s
 
 static void disassemble_with_header(std::ostringstream& os, istate* S,
         function_stub* stub, const string& header, bool recur) {
+    if (stub->lazy && stub->sub_funs[0]) {
+        stub = stub->sub_funs[0];
+    }
     os << header << '\n';
     if (stub->foreign) {
         os << "; <foreign_fun>";
         return;
+    } else if (stub->lazy) {
+        os << "; <not compiled yet>";
     } else {
         disassemble_stub(os, S, stub);
         if (recur) {
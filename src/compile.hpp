@@ -74,7 +74,8 @@ struct bc_compiler_output {
     dyn_array<bc_compiler_output> sub_funs;
     dyn_array<code_info> ci_arr;
 
-    // stack space required. FIXME: unused
+    // maximum number of stack slots used by the function, counting from its
+    // base pointer. Checked once when the function is called.
     u32 stack_required;
 
     // params info
@@ -83,18 +84,58 @@ struct bc_compiler_output {
     bool has_vari;
     symbol_id vari_param;
 
+    // number of method call sites and constant-key field accesses. Each of
+    // these gets an inline cache in the function stub.
+    u16 num_method_caches;
+    u16 num_field_caches;
+
+    // see function_stub::memo_id
+    u64 memo_id;
+    // see function_stub::code_id
+    u64 code_id;
+    // if non-null, the function hasn't been compiled and the rest of this
+    // structure is empty (see NOTE: (Lazy compilation) in compile.cpp)
+    lazy_fun* lazy;
+
     // upvalues
     u8 num_upvals;
     // the next two arrays always have the same length
     dyn_array<u8> upvals;
     dyn_array<u8> upvals_direct;
+    // flat upvalues, i.e. captured variables which are copied into the closure
+    // rather than shared through an upvalue cell. These are laid out like the
+    // upvalue arrays above.
+    u8 num_flat_upvals;
+    dyn_array<u8> flat_upvals;
+    dyn_array<u8> flat_upvals_direct;
 };
 
 // structure representing a local variable
+// what the compiler knows about the type of a value (see NOTE: (Type
+// inference) in compile.cpp)
+enum num_type : u8 {
+    nt_unknown,
+    nt_int,
+    nt_float
+};
+
 struct lexical_var {
     // scanner_string_table id
     sst_id name;
     u8 index;
+    // number of variables declared in the function before this one. This
+    // identifies the variable when the function is compiled again.
+    u32 id;
+    // false for let variables until their value has been assigned
+    bool initialized;
+    // whether the variable is the target of a set! (see NOTE: (Mutated
+    // variables) in compile.cpp)
+    bool mutated;
+    // type of the variable's value, if it's known
+    num_type type;
+    // for a let variable bound to a List or Table form that was scalar
+    // replaced, the form. Its elements are held in other local variables.
+    const ast::node* agg;
 };
 
 struct local_upvalue {
@@ -109,10 +150,51 @@ struct local_upvalue {
     u8 index;
 };
 
+// how a function refers to itself, i.e. the variable it's being bound to. This
+// is used to compile self tail calls as loops.
+struct self_binding {
+    sst_id name;
+    // true if the variable is a local variable of the enclosing function (from
+    // let), false if it's a global variable (from def)
+    bool local;
+    // index of the local variable in the enclosing function
+    u8 index;
+};
+
+// Macro expansions made while compiling a toplevel form. The compiler looks at
+// some forms more than once, e.g. to check whether they're constant before
+// compiling them, so each expansion is kept and reused rather than running the
+// macro again. Lists which turn out not to be macro calls are recorded too.
+// The keys are node addresses, so nodes that were looked up must stay alive
+// as long as the cache does.
+struct expansion_cache {
+    // expansion of each list, or nullptr if it isn't a macro call
+    table<u64,ast::node*> forms;
+    // nodes freed along with the cache
+    dyn_array<ast::node*> owned;
+    // string table ids of symbols in expansions
+    table<symbol_id,sst_id> sym_ids;
+
+    ~expansion_cache();
+};
+
+// largest function body, in AST nodes, which will be inlined
+constexpr u32 INLINE_MAX_COST = 16;
+// largest function, in bytes of bytecode, which will be specialized for int
+// parameters
+constexpr u32 SPECIALIZE_MAX_CODE = 512;
+// largest number of elements in a List or Table form which will be scalar
+// replaced
+constexpr u32 SCALAR_REPLACE_MAX = 16;
+// number of memoized macro expansions kept before they're all discarded
+constexpr u32 MACRO_MEMO_MAX = 1 << 16;
+
 class bc_compiler {
 private:
     friend bool compile_to_bytecode(bc_compiler_output& out, istate* S,
             scanner_string_table& sst, const ast::node* root);
+    friend bool compile_lazy_fun(bc_compiler_output& out, istate* S,
+            lazy_fun* f);
 
     // when compiling a function within a function, this is set to the compiler
     // for the enclosing function. It is used for lexical variable search.
@@ -124,10 +206,49 @@ private:
     dyn_array<lexical_var> vars;
     // values here are the upvalue IDs in the function
     table<sst_id, u8> upvals;
+    // same for flat upvalues
+    table<sst_id, u8> flat_upvals;
     u8 sp;
+    // number of local variables declared so far
+    u32 num_vars;
+    // names which are the target of a set! somewhere in the function,
+    // including in the functions nested in it
+    dyn_array<sst_id> set_targets;
 
     // output from the compiler
     bc_compiler_output* output;
+    // address of the last instruction emitted, used to form superinstructions
+    u32 last_op;
+    // the most recent jump target address. Instructions are never fused
+    // across it.
+    u32 jump_target;
+    // value of the def or let binding being compiled and the variable it's
+    // being bound to. A fn form in this position is named after the variable
+    // and knows how to refer to itself.
+    const ast::node* bound_value;
+    self_binding bound_var;
+    // set for functions bound to a variable, if their arity is fixed
+    bool has_self;
+    self_binding self;
+    // whether any local variable of this function has been captured by a
+    // closure in an upvalue cell
+    bool captured;
+    // indices of the parameters used directly as operands of arithmetic or
+    // comparisons, and those the function is being specialized for
+    dyn_array<u8> num_params_used;
+    dyn_array<u8> spec_params;
+    // the form being compiled by compile_toplevel(), after macroexpansion.
+    // Only defs made here can be inlined.
+    const ast::node* toplevel_form;
+    // FQNs of the functions currently being inlined, used to stop recursion
+    dyn_array<symbol_id> inlining;
+    // while inlining is non-empty, the origin recorded by update_source()
+    inline_origin origin;
+    // shared by all the compilers for a toplevel form
+    expansion_cache* expansions;
+    // the function most recently deferred by defer_sub_fun(), and its fn form
+    lazy_fun* deferred;
+    const ast::node* deferred_form;
 
     // if parent is non-nil, this assumes that the top of the stack is holding
     // the parent function
@@ -141,29 +262,58 @@ private:
     void pop_vars(u8 base);
     // add a new local variable at the current stack pointer. Does not increment
     // the stack pointer!
-    void push_var(sst_id name);
+    void push_var(sst_id name, bool initialized = true);
     // attempt to find a function-local variable. Returns true on success and
     // sets index to the index of the variable
     bool find_local_var(u8& index, sst_id name);
-    // attempt to find a variable in any enclosing functions
-    bool find_upvalue_var(u8& index, sst_id name);
-
+    // get the local variable with the given name or stack index, or nullptr
+    lexical_var* lookup_local_var(sst_id name);
+    lexical_var* local_var_at(u8 index);
+    // get the local variable with the given name in this or the nearest
+    // enclosing function which has one, or nullptr
+    lexical_var* lookup_lexical_var(sst_id name);
+    // attempt to find a variable in any enclosing functions. flat is set to
+    // true if the variable is held in a flat upvalue rather than an upvalue
+    // cell.
+    bool find_upvalue_var(u8& index, bool& flat, sst_id name);
+    // add the names which are the targets of set! forms in expr to out. The
+    // bodies of fn forms are only searched if fns is true; at toplevel, it's set
+    // by the first let form.
+    void collect_set_targets(dyn_array<sst_id>& out, const ast::node* expr,
+            bool& fns);
+
+    // increment sp, keeping track of the most stack space used
+    void inc_sp();
+    // account for stack space used outside the function body
+    void finish_stack_required();
+
+    // emit an instruction opcode. This may combine it with the previous
+    // instruction to form a superinstruction, so operands must be emitted
+    // immediately afterwards.
+    void emit_op(u8 op);
     // emit bytecode
     void emit8(u8 u);
     void emit16(u16 u);
     void emit32(u32 u);
+    void emit64(u64 u);
     // update the source code location
     void update_source(const source_loc& loc);
 
     // update a 16-bit value at the given address
     void patch16(u16 u, u32 addr);
+    // patch the jump whose offset is at addr to jump to the current address
+    void patch_jump(u32 addr);
 
     // helper to process function argument lists.
     bool process_params(const ast::node* params, dyn_array<sst_id>& pos_params,
             dyn_array<ast::node*>& init_vals, bool& has_vari, sst_id& vari);
 
-    // expand macros. macro_form must be a list of length >= 1
-    ast::node* macroexpand(const ast::node* macro_form);
+    // expand macros, returning nullptr if macro_form isn't a macro call. The
+    // expansion belongs to the expansion cache.
+    const ast::node* macroexpand(const ast::node* macro_form);
+    // expand a single macro call. Returns nullptr if form isn't a macro call
+    // or on error.
+    ast::node* expand_once(const ast::node* form);
 
     // Compile special forms. Note that cond, defn, dollar-fn, letfn, and
     // quasiquote are not compiled directly here. These are implemented as
@@ -189,22 +339,165 @@ private:
 
     // compile a global variable reference. Sets an error on failure.
     bool lookup_global_id(u32& out, sst_id str_id);
+    // add a symbol to the constant table, returning its id
+    u16 add_const_symbol(sst_id str_id);
+    // if key is a quoted symbol or a string literal, add it to the constant
+    // table and store its id in cid. Such keys are accessed with get-field and
+    // set-field.
+    bool add_const_key(u16& cid, const ast::node* key);
     // compile a constant symbol
     bool compile_const_symbol(sst_id str_id);
     // compile a subordinate function. This involves creating a child
     // bc_compiler_output object
     bool compile_sub_fun(const ast::node* params, const ast::node** body,
-            u32 body_len, const string& name);
+            u32 body_len, const string& name,
+            const self_binding* self = nullptr);
+    // put off compiling a function until it's called, if that's possible.
+    // Returns false without doing anything if it isn't.
+    bool defer_sub_fun(const ast::node* root, const string& name,
+            const self_binding* self);
+    // copy the fn form root into f, with the macro calls that have already
+    // been expanded replaced by their expansions
+    void copy_lazy_form(lazy_fun* f, const ast::node* root);
     // compile a list whose operator is a symbol
     bool compile_symbol_list(const ast::node* root, bool tail);
     bool compile_call(const ast::node* root, bool tail);
+    // check whether a call's operator is a global variable holding a function
+    // (or the global being defined by the function under compilation), which
+    // can be called by its global ID. The ID is stored in gid, and foreign is
+    // set if the function is a builtin.
+    bool find_known_fun(u32& gid, bool& foreign, const ast::node* root);
+    // check whether a call in tail position is a call of the function being
+    // compiled by the variable it's bound to, with the right number of
+    // arguments. Such calls are compiled as loops by compile_self_call().
+    bool is_self_call(const ast::node* root);
+    bool compile_self_call(const ast::node* root);
+    // check whether name refers to a local variable of this or any enclosing
+    // function. Unlike find_upvalue_var(), this doesn't create upvalues.
+    bool is_lexical_var(sst_id name);
+    // check whether a call can be compiled to arithmetic/comparison
+    // instructions, i.e. whether it calls a builtin like + with a suitable
+    // number of arguments. The instruction is stored in op. guarded is set if
+    // the global isn't one of the builtins' own (see NOTE: (Guarded globals)).
+    bool find_binary_op(u8& op, bool& guarded, const ast::node* root);
+    // find the type of the value of expr, if it can be proven without
+    // compiling it
+    num_type infer_type(const ast::node* expr);
+    // choose the parameters to specialize the function for after compiling
+    // it once. Returns false if it's not worth it.
+    bool choose_spec_params(dyn_array<u8>& out,
+            const dyn_array<ast::node*>& init_vals);
+    bool compile_binary_op(const ast::node* root, u8 op, bool guarded);
+    // Try to evaluate an expression at compile time. This works for number
+    // literals, yes, no, and nil, if and do forms made of constants, and calls
+    // to pure builtins (see builtin_pure()) with constant arguments. Only
+    // numbers, yes, no, and nil are produced, so out needs no protection from
+    // the garbage collector.
+    bool eval_constant(value& out, const ast::node* expr);
+    bool eval_constant_list(value& out, const ast::node* expr);
+    // emit an instruction to push a value produced by eval_constant()
+    void compile_constant(value v);
+    // remember a function defined at toplevel if it can be inlined, and forget
+    // any previous inlinable definition of the same variable
+    void register_inline(symbol_id fqn, sst_id name, const ast::node* val,
+            bool toplevel);
+    // convert an expression from a function body to the form stored in an
+    // inline_fun, adding its size to cost. Returns nullptr if it can't be
+    // inlined.
+    ast::node* make_inline_body(const ast::node* expr,
+            const dyn_array<sst_id>& params, symbol_id fqn, u32& cost);
+    // convert a stored function body back into an expression to compile here,
+    // renaming its parameters so they can't clash with other variables
+    ast::node* instantiate_inline(const ast::node* body, const inline_fun* f,
+            symbol_id fqn);
+    // check whether a call is to an inlinable global function with the right
+    // number of arguments
+    bool find_inline_fun(inline_fun*& out, symbol_id& fqn,
+            const ast::node* root);
+    bool compile_inline_call(const ast::node* root, inline_fun* f,
+            symbol_id fqn, bool tail);
+    // Compute an ID for a pure expression, i.e. one without side effects
+    // whose value depends only on the local variables in locals, which are
+    // given by symbol ID. The ID is mixed into id. Returns false if the
+    // expression may not be pure. (See NOTE: (Macro memoization)).
+    bool pure_id(u64& id, const ast::node* expr, dyn_array<symbol_id>& locals);
+    bool pure_list_id(u64& id, const ast::node* expr,
+            dyn_array<symbol_id>& locals);
+    // same for a function with the given parameters and body
+    bool pure_fun_id(u64& id, const ast::node* params, const ast::node** body,
+            u32 body_len, dyn_array<symbol_id>& locals);
+    // get the ID of a global variable whose value is pure
+    bool global_pure_id(u64& id, symbol_id fqn);
+    // remember the ID of a global defined at toplevel if its value is pure
+    void register_pure(symbol_id fqn, const ast::node* val, bool toplevel);
+    // get the symbol ID of a string table entry, caching it in the table
+    symbol_id sst_symbol(sst_id id);
+    // mix a syntax tree into a hash, looking at its structure and names
+    // using two different hash functions
+    void hash_syntax(u64& h, u64& check, const ast::node* expr);
+    // look up a memoized expansion of a call to a pure macro, given the hashes
+    // of its arguments. Returns nullptr if there isn't one.
+    ast::node* find_macro_memo(const ast::node* form, u64 macro_id, u64 key,
+            u64 check);
+    // memoize the expansion of a call to a pure macro. copies lists the nodes
+    // of expansion which pop_syntax() copied from the arguments.
+    void add_macro_memo(const ast::node* form, const ast::node* expansion,
+            u64 macro_id, u64 key, u64 check,
+            const dyn_array<syntax_copy>& copies);
+    // convert syntax to or from the form stored in a macro_memo. copy_paths
+    // maps nodes copied from the arguments to their offsets in paths.
+    void flatten_memo(macro_memo* m, const ast::node* expr,
+            const table<u64,u32>& copy_paths, const dyn_array<u32>& paths);
+    ast::node* instantiate_memo(const macro_memo* m, u32& i,
+            const ast::node* form);
+
+    // compile a call whose operator is a quoted symbol, e.g. ('name obj)
+    bool compile_method_call(const ast::node* root, bool tail);
     bool validate_let_form(const ast::node* expr);
     bool is_do_inline_form(const ast::node* node);
     bool is_dot_form(const ast::node* node);
+    bool is_quoted_symbol(const ast::node* node);
     bool is_let_form(const ast::node* node);
     bool compile_body(const ast::node** exprs, u32 len, bool tail);
     // compile a form within a body. This accounts for let and do-inline forms.
-    bool compile_within_body(const ast::node* expr, bool tail);
+    // rest holds the forms after it in the body, i.e. the scope of its let
+    // variables, or is nullptr if that's not known.
+    bool compile_within_body(const ast::node* expr, bool tail,
+            const ast::node** rest = nullptr, u32 rest_len = 0);
+
+    // scalar replacement of List and Table forms (see NOTE: (Scalar
+    // replacement) in compile.cpp)
+
+    // get the function held by the global variable name, unless name is
+    // lexical, or nullptr
+    fn_function* global_fun(sst_id name);
+    // like global_fun(), but only for globals in fn/builtin (see NOTE: (Guarded
+    // globals) in compile.cpp)
+    fn_function* builtin_fun(sst_id name);
+    // check whether form builds an object that can be scalar replaced
+    bool is_replaceable_form(const ast::node* form);
+    // if expr takes an element out of the object the variable name would hold
+    // if it were built by agg, set index to the element's position and return
+    // true. The index is (u32)-1 for fields that agg doesn't include.
+    bool match_elem_access(u32& index, const ast::node* expr, sst_id name,
+            const ast::node* agg);
+    // check whether name appears in expr anywhere other than in element
+    // accesses, or anywhere at all if agg is nullptr
+    bool var_escapes(sst_id name, const ast::node* expr,
+            const ast::node* agg);
+    // name of the variable holding an element of a scalar replaced object
+    sst_id elem_var_name(sst_id name, u32 id, u32 index);
+    // compile the ith value of let_form, whose variable has the given stack
+    // index, by scalar replacement, if possible. Returns false without doing
+    // anything if it isn't.
+    bool scalar_replace(const ast::node* let_form, u32 i, u8 index,
+            const ast::node** rest, u32 rest_len);
+    // if expr is an element access of a scalar replaced object, set elem to
+    // the name of the variable holding the element and return true. present
+    // is set to false for fields the object doesn't have, which are nil.
+    bool find_elem_access(sst_id& elem, bool& present, const ast::node* expr);
+    // like compile_symbol(), but for a variable which must be lexical
+    bool compile_lexical_ref(sst_id name);
 
     bool compile_int(const ast::node* root);
     bool compile_float(const ast::node* root);
@@ -224,6 +517,15 @@ private:
 // contain weak references to the ast::node passed in, so take care about that.
 bool compile_to_bytecode(bc_compiler_output& out, istate* S,
         scanner_string_table& sst, const ast::node* root);
+// compile the function saved in f by defer_sub_fun(), using f's string table.
+// This must be done in the namespace the function was defined in.
+bool compile_lazy_fun(bc_compiler_output& out, istate* S, lazy_fun* f);
+// set the compiler's information about a global variable, as it would be after
+// compiling its definition. This is used to load compiled code from the bytecode
+// cache. pure_id is its pure_tab entry and f is its inline_tab entry, or
+// nullptr if it can't be inlined. Takes ownership of f.
+void restore_global_info(istate* S, symbol_id fqn, u64 pure_id,
+        inline_fun* f);
 // peek at the top of the stack, disassemble it, and push the result as a
 // string. Decompiles subfunctions recursively if recur=true.
 void disassemble_top(istate* S, bool recur=false);
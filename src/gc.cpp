@@ -1,4 +1,5 @@
 #include "gc.hpp"
+#include "jit.hpp"
 
 // uncomment to do a GC after every allocation
 //#define GC_STRESS
@@ -45,6 +46,8 @@ static void reinit_fun(gc_header* obj) {
     f->init_vals = (value*)(sizeof(fn_function) + (u8*)f);
     f->upvals = (upvalue_cell**) (sizeof(fn_function)
             + stub->num_opt * sizeof(value) + (u8*)f);
+    f->flat_upvals = (value*) (stub->num_upvals * sizeof(upvalue_cell*)
+            + (u8*)f->upvals);
 }
 
 static void reinit_fun_stub(gc_header* obj) {
@@ -53,8 +56,10 @@ static void reinit_fun_stub(gc_header* obj) {
     auto code_sz = round_to_align(s->code_length);
     auto const_sz = sizeof(value) * s->num_const;
     auto sub_funs_sz = sizeof(function_stub*) * s->num_sub_funs;
-    auto upvals_sz = sizeof(upvalue_cell*) * s->num_upvals;
-    auto upvals_direct_sz = round_to_align(sizeof(bool) * s->num_upvals);
+    auto num_all_upvals = s->num_upvals + s->num_flat_upvals;
+    auto upvals_sz = sizeof(upvalue_cell*) * num_all_upvals;
+    auto upvals_direct_sz = round_to_align(sizeof(bool) * num_all_upvals);
+    auto code_info_sz = round_to_align(sizeof(code_info) * s->ci_length);
     s->code = (u8*)raw_ptr_add(s, sizeof(function_stub));
     s->const_arr = (value*)raw_ptr_add(s, sizeof(function_stub) + code_sz);
     s->sub_funs = (function_stub**)raw_ptr_add(s, sizeof(function_stub)
@@ -65,6 +70,17 @@ static void reinit_fun_stub(gc_header* obj) {
             + const_sz + sub_funs_sz + upvals_sz);
     s->ci_arr = (code_info*)raw_ptr_add(s, sizeof(function_stub) + code_sz
             + const_sz + sub_funs_sz + upvals_sz + upvals_direct_sz);
+    auto mcache_sz = sizeof(method_cache_entry) * s->num_method_caches;
+    if (s->num_method_caches > 0) {
+        s->method_caches = (method_cache_entry*)raw_ptr_add(s,
+                sizeof(function_stub) + code_sz + const_sz + sub_funs_sz
+                + upvals_sz + upvals_direct_sz + code_info_sz);
+    }
+    if (s->num_field_caches > 0) {
+        s->field_caches = (field_cache_entry*)raw_ptr_add(s,
+                sizeof(function_stub) + code_sz + const_sz + sub_funs_sz
+                + upvals_sz + upvals_direct_sz + code_info_sz + mcache_sz);
+    }
 }
 
 static void reinit_gc_bytes(gc_header* obj) {
@@ -127,6 +143,9 @@ static void scavenge_fun(gc_header* obj, gc_scavenge_state* s) {
     for (u32 i = 0; i < f->stub->num_opt; ++i) {
         scavenge_boxed_pointer(&f->init_vals[i], s);
     }
+    for (u32 i = 0; i < f->stub->num_flat_upvals; ++i) {
+        scavenge_boxed_pointer(&f->flat_upvals[i], s);
+    }
 }
 
 static void scavenge_upvalue(gc_header* obj, gc_scavenge_state* s) {
@@ -150,6 +169,10 @@ static void scavenge_fun_stub(gc_header* obj, gc_scavenge_state* s) {
     for (u64 i = 0; i < stub->num_const; ++i) {
         scavenge_boxed_pointer(&stub->const_arr[i], s);
     }
+    for (u64 i = 0; i < stub->num_method_caches; ++i) {
+        scavenge_boxed_pointer(&stub->method_caches[i].metatable, s);
+        scavenge_boxed_pointer(&stub->method_caches[i].method, s);
+    }
     // metadata
     if (stub->name) {
         scavenge_pointer((gc_header**)&stub->name, s);
@@ -235,6 +258,7 @@ void init_allocator(allocator& alloc, istate* S) {
     alloc.nursery_size = DEFAULT_NURSERY_SIZE;
     alloc.majorgc_th = DEFAULT_MAJORGC_TH;
     alloc.handles = nullptr;
+    alloc.collecting = false;
 }
 
 void deinit_allocator(allocator& alloc, istate* S) {
@@ -492,6 +516,9 @@ static void copy_gc_roots(istate* S) {
     for (auto& u : S->open_upvals) {
         u = (upvalue_cell*)copy_live_object((gc_header*)u, S);
     }
+    for (auto& f : S->frames) {
+        f.callee = (fn_function*)copy_live_object((gc_header*)f.callee, S);
+    }
     for (auto& v : S->G->def_arr) {
         v = copy_live_value(v, S);
     }
@@ -625,6 +652,34 @@ static void unset_large_marks(gc_deck& deck) {
     }
 }
 
+#ifdef FN_JIT
+// Native code isn't a gc object, so it isn't found by scavenging. Instead, each
+// jit_code is checked against its stub once all live objects have been copied.
+// Stubs that were copied or kept in place keep their code, and the rest are
+// dead, so their code is freed. This must run before from space is cleared.
+static void sweep_jit_code(istate* S) {
+    auto J = S->jit;
+    if (!J) {
+        return;
+    }
+    u32 i = 0;
+    while (i < J->code.size) {
+        auto jc = J->code[i];
+        auto obj = (gc_header*)jc->stub;
+        auto card = get_gc_card_header(obj);
+        if (obj->forward) {
+            jc->stub = (function_stub*)obj->forward;
+        } else if (card->gen <= S->alloc->max_compact_gen
+                && !(card->large && card->mark)) {
+            // free_jit_code() moves the last entry into slot i
+            free_jit_code(J, i);
+            continue;
+        }
+        ++i;
+    }
+}
+#endif
+
 void minor_gc(istate* S) {
     S->alloc->max_compact_gen = GC_GEN_SURVIVOR;
 
@@ -673,6 +728,9 @@ void minor_gc(istate* S) {
         }
     }
 
+#ifdef FN_JIT
+    sweep_jit_code(S);
+#endif
     // delete all the cards in from space
     clear_deck(S->alloc->nursery_from_space, S);
     clear_deck(S->alloc->survivor_from_space, S);
@@ -725,6 +783,9 @@ void major_gc(istate* S) {
         }
     }
 
+#ifdef FN_JIT
+    sweep_jit_code(S);
+#endif
     // delete all the cards in from space
     clear_deck(S->alloc->nursery_from_space, S);
     clear_deck(S->alloc->survivor_from_space, S);
@@ -735,6 +796,7 @@ void collect_now(istate* S) {
 #ifdef GC_DISABLE
     return;
 #endif
+    S->alloc->collecting = true;
     // NOTE: maybe add a timer to prevent major gc from occurring too often
     if (S->alloc->tenured.num_cards > S->alloc->majorgc_th) {
         major_gc(S);
@@ -744,6 +806,7 @@ void collect_now(istate* S) {
     } else {
         minor_gc(S);
     }
+    S->alloc->collecting = false;
 }
 
 }
@@ -150,6 +150,9 @@ struct allocator {
 
     // used during collection; the maximum generation being copied
     u8 max_compact_gen;
+    // true while a collection is in progress. Checked by the sampling profiler,
+    // since objects are in motion.
+    volatile bool collecting;
 
     u64 nursery_size;
     u64 majorgc_th;
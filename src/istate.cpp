@@ -1,12 +1,16 @@
 #include "api.hpp"
 #include "alloc.hpp"
+#include "cache.hpp"
 #include "compile.hpp"
 #include "gc.hpp"
 #include "istate.hpp"
+#include "jit.hpp"
 #include "namespace.hpp"
 #include "parse.hpp"
+#include "profile.hpp"
 #include "vm.hpp"
 
+#include <algorithm>
 #include <filesystem>
 
 namespace fn {
@@ -26,6 +30,16 @@ void free_istate(istate* S) {
     delete S->alloc;
     delete S->symtab;
     delete S->symcache;
+    free(S->stack);
+#ifdef FN_JIT
+    if (S->jit) {
+        free_jit_state(S->jit);
+    }
+#endif
+#ifdef FN_PROFILE_OPS
+    delete S->op_prof;
+#endif
+    free_bytecode_cache(S->cache);
     delete S;
 }
 
@@ -49,6 +63,23 @@ bool has_error(istate* S) {
     return S->err.happened;
 }
 
+bool grow_stack(istate* S, u32 min_size) {
+    if (min_size > MAX_STACK_SIZE) {
+        ierror(S, "Not enough stack space for call.");
+        return false;
+    }
+    auto new_size = S->stack_size;
+    while (new_size < min_size) {
+        new_size *= 2;
+    }
+    if (new_size > MAX_STACK_SIZE) {
+        new_size = MAX_STACK_SIZE;
+    }
+    S->stack = (value*)realloc(S->stack, new_size * sizeof(value));
+    S->stack_size = new_size;
+    return true;
+}
+
 void push(istate* S, value v) {
     S->stack[S->sp++] = v;
 }
@@ -111,10 +142,67 @@ void push_quoted(istate* S, const scanner_string_table& sst,
     }
 }
 
-bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst) {
+// returns false if push_quoted() changes any of the symbols in root
+static bool record_origins_rec(syntax_origins& origins, value v,
+        const ast::node* root, const scanner_string_table& sst) {
+    switch (root->kind) {
+    case ast::ak_symbol: {
+        auto& name = scanner_name(sst, root->datum.str_id);
+        return name.empty() || name[0] != ':';
+    }
+    case ast::ak_list: {
+        bool res = true;
+        auto lst = v;
+        for (u32 i = 0; i < root->list_length; ++i) {
+            if (!record_origins_rec(origins, vhead(lst), root->datum.list[i],
+                            sst)) {
+                res = false;
+            }
+            lst = vtail(lst);
+        }
+        if (res && root->list_length > 0) {
+            origins.conses.push_back(syntax_origin{v.raw, root});
+        }
+        return res;
+    }
+    default:
+        return true;
+    }
+}
+
+void record_syntax_origins(syntax_origins& origins, value v,
+        const ast::node* root, const scanner_string_table& sst) {
+    record_origins_rec(origins, v, root, sst);
+}
+
+void finish_syntax_origins(syntax_origins& origins) {
+    auto& c = origins.conses;
+    std::sort(c.data, c.data + c.size,
+            [](const syntax_origin& a, const syntax_origin& b) {
+                return a.raw < b.raw;
+            });
+}
+
+static const ast::node* find_syntax_origin(const syntax_origins& origins,
+        value v) {
+    auto& c = origins.conses;
+    auto it = std::lower_bound(c.data, c.data + c.size, v.raw,
+            [](const syntax_origin& a, u64 raw) {
+                return a.raw < raw;
+            });
+    if (it != c.data + c.size && it->raw == v.raw) {
+        return it->node;
+    }
+    return nullptr;
+}
+
+static bool pop_syntax_loc(ast::node*& result, istate* S,
+        scanner_string_table& sst, const syntax_origins* origins) {
     auto v = peek(S);
-    // FIXME: get the source loc from the person asking to pop syntax
     source_loc loc{0, 0, false, 0};
+    if (origins) {
+        loc = origins->loc;
+    }
     if (vis_int(v)) {
         result = ast::mk_int(loc, vint(peek(S)));
     } else if (vis_float(v)) {
@@ -123,17 +211,36 @@ bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst) {
         result = ast::mk_string(loc,
                 scanner_intern(sst, convert_fn_str(vstr(v))));
     } else if (vis_symbol(v)) {
-        result = ast::mk_symbol(loc,
-                scanner_intern(sst, symname(S, vsymbol(v))));
+        auto sym_ids = origins ? origins->sym_ids : nullptr;
+        auto e = sym_ids ? sym_ids->get2(vsymbol(v)) : nullptr;
+        sst_id id;
+        if (e) {
+            id = e->val;
+        } else {
+            id = scanner_intern(sst, symname(S, vsymbol(v)));
+            if (sym_ids) {
+                sym_ids->insert(vsymbol(v), id);
+            }
+        }
+        result = ast::mk_symbol(loc, id);
     } else if (vis_emptyl(v)) {
         result = ast::mk_list(loc, 0, nullptr);
     } else if (vis_cons(v)) {
+        auto orig = origins ? find_syntax_origin(*origins, v) : nullptr;
+        if (orig) {
+            result = ast::copy_graph(orig);
+            if (origins->copies) {
+                origins->copies->push_back(syntax_copy{result, orig});
+            }
+            pop(S);
+            return true;
+        }
         dyn_array<ast::node*> buf;
         auto lst_addr = S->sp - 1;
         while(!vis_emptyl(S->stack[lst_addr])) {
             push(S, vhead(S->stack[lst_addr]));
             ast::node* sub;
-            if (!pop_syntax(sub, S, sst)) {
+            if (!pop_syntax_loc(sub, S, sst, origins)) {
                 for (auto n : buf) {
                     ast::free_graph(n);
                 }
@@ -150,6 +257,15 @@ bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst) {
     return true;
 }
 
+bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst) {
+    return pop_syntax_loc(result, S, sst, nullptr);
+}
+
+bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst,
+        const syntax_origins& origins) {
+    return pop_syntax_loc(result, S, sst, &origins);
+}
+
 void push_foreign_fun(istate* S,
         void (*foreign)(istate*),
         const string& name,
@@ -190,31 +306,89 @@ void print_top(istate* S) {
     std::cout << v_to_string(peek(S), S->symtab, true) << '\n';
 }
 
+static void print_trace_frame(istate* S, std::ostream& os,
+        const trace_frame& f) {
+    if (f.callee->stub->foreign) {
+        os //<< "  File " << convert_fn_str(f.callee->stub->filename)
+           << "  In foreign function "
+           << convert_fn_str(f.callee->stub->name) << '\n';
+    } else {
+        auto c = instr_loc(f.callee->stub, f.pc);
+        auto loc = c->loc;
+        if (c->inlined) {
+            // inlined code gets a frame of its own above the caller's
+            os << "  File " << symname(S, c->origin.filename)
+               << ", line " << loc.line << ", col " << loc.col
+               << " in " << symname(S, c->origin.name) << '\n';
+            loc = c->origin.call_loc;
+        }
+        os << "  File " << string{(char*)f.callee->stub->filename->data}
+           << ", line " << loc.line << ", col " << loc.col;
+        // FIXME: make it so this is never null
+        if (f.callee->stub->name) {
+            os << " in "
+               << string{(char*)f.callee->stub->name->data};
+        }
+        os << '\n';
+    }
+}
+
+// Runaway recursion can leave millions of frames in the trace. Runs of frames
+// at the same place in the same function are printed once with a count, and if
+// there are still more than TRACE_PRINT_MAX entries, only the ones at either
+// end are printed.
 void print_stack_trace(istate* S) {
+    // index of the first frame of each run, and its length
+    dyn_array<u32> starts;
+    dyn_array<u32> counts;
+    for (u32 i = 0; i < S->stack_trace.size; ++i) {
+        auto& f = S->stack_trace[i];
+        if (!f.callee) {
+            continue;
+        }
+        if (starts.size > 0) {
+            auto& prev = S->stack_trace[starts[starts.size - 1]];
+            if (prev.callee->stub == f.callee->stub && prev.pc == f.pc) {
+                ++counts[counts.size - 1];
+                continue;
+            }
+        }
+        starts.push_back(i);
+        counts.push_back(1);
+    }
     std::ostringstream os;
     os << "Stack trace:\n";
-    for (auto& f : S->stack_trace) {
-        if (f.callee) {
-            if (f.callee->stub->foreign) {
-                os //<< "  File " << convert_fn_str(f.callee->stub->filename)
-                   << "  In foreign function "
-                   << convert_fn_str(f.callee->stub->name) << '\n';
-            } else {
-                auto c = instr_loc(f.callee->stub, f.pc);
-                os << "  File " << string{(char*)f.callee->stub->filename->data}
-                   << ", line " << c->loc.line << ", col " << c->loc.col;
-                // FIXME: make it so this is never null
-                if (f.callee->stub->name) {
-                    os << " in "
-                       << string{(char*)f.callee->stub->name->data};
-                }
-                os << '\n';
-            }
+    for (u32 i = 0; i < starts.size; ++i) {
+        if (starts.size > TRACE_PRINT_MAX && i == TRACE_PRINT_MAX / 2) {
+            auto skip = starts.size - TRACE_PRINT_MAX;
+            os << "  ... " << skip << " more entries ...\n";
+            i += skip - 1;
+            continue;
+        }
+        print_trace_frame(S, os, S->stack_trace[starts[i]]);
+        if (counts[i] > 1) {
+            os << "  (repeated " << counts[i] - 1 << " more times)\n";
         }
     }
     std::cout << os.str();
 }
 
+// compile a toplevel form, recording it for the bytecode cache, and push the
+// resulting function
+static bool compile_form(istate* S, scanner_string_table& sst,
+        const ast::node* root) {
+    dyn_array<symbol_id> info_log;
+    auto token = begin_cache_form(S, info_log);
+    bc_compiler_output bco;
+    if (!compile_to_bytecode(bco, S, sst, root)) {
+        end_cache_form(S, token, sst, nullptr, info_log);
+        return false;
+    }
+    end_cache_form(S, token, sst, &bco, info_log);
+    reify_function(S, sst, bco);
+    return !has_error(S);
+}
+
 void interpret_stream(istate* S, std::istream* in) {
     // nil for empty files
     scanner_string_table sst;
@@ -233,6 +407,7 @@ void interpret_stream(istate* S, std::istream* in) {
                 == cached_sym(S, SC_NAMESPACE)) {
             switch_ns(S, intern_id(S, scanner_name(sst,
                                     form0->datum.list[1]->datum.str_id)));
+            cache_namespace(S, S->ns_id);
             ast::free_graph(form0);
         } else {
             if (has_error(S)) {
@@ -240,13 +415,11 @@ void interpret_stream(istate* S, std::istream* in) {
                 return;
             }
             pop(S);
-            bc_compiler_output bco;
             if (form0 == nullptr) {
                 ast::free_graph(form0);
                 return;
             }
-            compile_to_bytecode(bco, S, sst, form0);
-            reify_function(S, sst, bco);
+            compile_form(S, sst, form0);
             ast::free_graph(form0);
             if (has_error(S)) {
                 return;
@@ -289,14 +462,16 @@ bool load_file(istate* S, const string& pathname) {
         return false;
     }
 
-    std::ifstream in{p};
+    std::ifstream in{p, std::ios::binary};
     if (in.bad()) {
         ierror(S, "load_file() failed. Could not open file: " + p.string());
         return false;
     }
+    std::ostringstream src;
+    src << in.rdbuf();
     auto old_filename = convert_fn_str(S->filename);
     set_filename(S, p.string());
-    interpret_stream(S, &in);
+    interpret_cached(S, p.string(), src.str());
     set_filename(S, old_filename);
     return !has_error(S);
 }
@@ -330,14 +505,57 @@ string find_package(istate* S, const string& spec) {
 bool compile_next_function(istate* S, scanner& sc) {
     bool resumable;
     auto root = parse_next_node(S, sc, &resumable);
-    bc_compiler_output bco;
-    if (!compile_to_bytecode(bco, S, sc.get_sst(), root)) {
-        ast::free_graph(root);
-        return false;
-    }
-    reify_function(S, sc.get_sst(), bco);
+    auto res = compile_form(S, sc.get_sst(), root);
     ast::free_graph(root);
-    return !has_error(S);
+    return res;
+}
+
+bool compile_lazy(istate* S, u32 where) {
+    auto stub = vfunction(S->stack[where])->stub;
+    if (!stub->sub_funs[0]) {
+        auto f = stub->lazy;
+        if (f->compiling) {
+            std::ostringstream os;
+            os << "Line " << f->form->loc.line << ", col "
+               << f->form->loc.col << ":\n  Function "
+               << scanner_name(f->sst, f->name)
+               << " was called while it was being compiled.";
+            ierror(S, os.str());
+            return false;
+        }
+        // compile in the function's own namespace and file
+        auto save_ns_id = S->ns_id;
+        // a failed macro call can leave values above this on the stack
+        auto save_sp = S->sp;
+        push(S, vbox_string(S->filename));
+        S->ns_id = stub->ns_id;
+        S->filename = stub->filename;
+        bc_compiler_output bco;
+        auto code_id = stub->code_id;
+        f->compiling = true;
+        auto ok = compile_lazy_fun(bco, S, f);
+        f->compiling = false;
+        if (ok) {
+            bco.code_id = code_id;
+            auto h = gen_function_stub(S, f->sst, bco);
+            stub = vfunction(S->stack[where])->stub;
+            stub->sub_funs[0] = h->obj;
+            write_guard(get_gc_card_header((gc_header*)stub), &h->obj->h);
+            release_handle(h);
+            ast::free_graph(f->form);
+            f->form = nullptr;
+        }
+        S->ns_id = save_ns_id;
+        S->filename = vstr(S->stack[save_sp]);
+        S->sp = save_sp;
+        if (has_error(S)) {
+            return false;
+        }
+    }
+    auto fun = vfunction(S->stack[where]);
+    fun->stub = fun->stub->sub_funs[0];
+    write_guard(get_gc_card_header(&fun->h), &fun->stub->h);
+    return true;
 }
 
 
@@ -7,25 +7,43 @@
 #include "parse.hpp"
 #include "scan.hpp"
 #include "symbols.hpp"
+#include "table.hpp"
 #include "values.hpp"
 
+#include <csignal>
+
 namespace fn {
 
-// size used for the istate stack
-constexpr u32 STACK_SIZE = 512;
+// initial size of the istate stack. It's grown on demand up to MAX_STACK_SIZE
+constexpr u32 INITIAL_STACK_SIZE = 512;
+constexpr u32 MAX_STACK_SIZE = 1 << 22;
 // the minimum amount of spare stack space for foreign functions
 constexpr u32 FOREIGN_MIN_STACK = 20;
+// most entries print_stack_trace() prints. Longer traces lose their middle.
+constexpr u32 TRACE_PRINT_MAX = 100;
 // default root search directory
 constexpr const char* DEFAULT_PKG_ROOT = PREFIX "/lib/fn/pkg";
 
 struct allocator;
+struct bytecode_cache;
 struct global_env;
+struct jit_state;
+struct op_profile;
 
 struct trace_frame {
     fn_function* callee;
     u32 pc;
 };
 
+// saved state of a Fn function which is waiting for a call to return. These are
+// pushed and popped by execute_fun(), so Fn-to-Fn calls don't recurse on the
+// native stack.
+struct call_frame {
+    fn_function* callee;                     // the calling function
+    u32 bp;                                  // caller's base pointer
+    u32 pc;                                  // return address
+};
+
 struct istate {
     allocator* alloc;
     symbol_table* symtab;
@@ -38,7 +56,13 @@ struct istate {
     fn_function* callee;                     // current function
     u8* code;                                // function code
     dyn_array<upvalue_cell*> open_upvals;    // open upvalues on the stack
-    value stack[STACK_SIZE];
+    dyn_array<call_frame> frames;            // suspended callers
+    volatile sig_atomic_t growing_frames;    // set while frames is reallocated
+    value* stack;                            // reallocated as it grows
+    u32 stack_size;                          // number of values in stack
+    jit_state* jit;                          // native code, if any
+    op_profile* op_prof;                     // opcode profiler, if enabled
+    bytecode_cache* cache;                   // compiled code saved on disk
     fn_str* filename;                     // for function metadata
     fn_str* wd;                           // working directory
 
@@ -77,6 +101,11 @@ void set_directory(istate* S, const string& pathname);
 void ierror(istate* S, const string& message);
 bool has_error(istate* S);
 
+// grow the stack so that it holds at least min_size values. This reallocates the
+// stack, so pointers into it are invalidated (but indices are not).
+// Returns false and sets an error if min_size exceeds MAX_STACK_SIZE.
+bool grow_stack(istate* S, u32 min_size);
+
 void push(istate* S, value v);
 // peek values relative to the top of the stack
 value peek(istate* S);
@@ -108,6 +137,43 @@ void push_quoted(istate* S, const scanner_string_table& sst,
 // convert an Fn value to an ast form
 bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst);
 
+// Used to convert a macro expansion back to syntax. Lists in the expansion
+// which were made by push_quoted() from the macro's arguments are copied from
+// the original AST rather than being converted, which keeps their source
+// locations and avoids interning their strings again. Other nodes get the
+// location of the macro call.
+struct syntax_origin {
+    // raw value of the cons
+    u64 raw;
+    const ast::node* node;
+};
+// a node created by copying the AST
+struct syntax_copy {
+    const ast::node* copy;
+    const ast::node* node;
+};
+struct syntax_origins {
+    // sorted by raw value once they've all been recorded
+    dyn_array<syntax_origin> conses;
+    source_loc loc;
+    // string table ids of symbols converted so far. May be shared between
+    // several conversions with the same string table.
+    table<symbol_id,sst_id>* sym_ids = nullptr;
+    // if non-null, each copied list is recorded here
+    dyn_array<syntax_copy>* copies = nullptr;
+};
+
+// record the nodes that the conses in v, which was made by push_quoted() from
+// root, came from. Nothing is recorded for lists that push_quoted() doesn't
+// convert faithfully. The conses must not be moved by the garbage collector
+// until the origins are no longer in use.
+void record_syntax_origins(syntax_origins& origins, value v,
+        const ast::node* root, const scanner_string_table& sst);
+// sort the origins for lookup. Call once after recording them.
+void finish_syntax_origins(syntax_origins& origins);
+bool pop_syntax(ast::node*& result, istate* S, scanner_string_table& sst,
+        const syntax_origins& origins);
+
 // push a foreign function by that wraps the provided function pointer
 void push_foreign_fun(istate* S,
         void (*foreign)(istate*),
@@ -140,6 +206,11 @@ bool require(istate* S, const string& spec);
 
 // compile a function and push the result to the stack
 bool compile_next_function(istate* S, scanner& sc);
+// compile the function at S->stack[where], which was made from a placeholder
+// stub (see NOTE: (Lazy compilation) in compile.cpp), unless another closure
+// made from the placeholder has already done so, and point it at the compiled
+// stub. Returns false and sets an error on failure.
+bool compile_lazy(istate* S, u32 where);
 
 }
 
@@ -0,0 +1,791 @@
+#include "jit.hpp"
+
+#ifdef FN_JIT
+
+#include "bytes.hpp"
+#include "namespace.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fn {
+
+// x86_64 general purpose registers
+enum x64_reg : u8 {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes, as used in jcc, setcc, and cmovcc
+enum x64_cond : u8 {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_S = 0x8,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf
+};
+
+// Register assignments in generated code. These are all callee-saved, so they
+// survive calls to the runtime routines.
+constexpr x64_reg REG_S = RBX;        // istate* S
+constexpr x64_reg REG_BP = R12;       // &S->stack[S->bp]
+constexpr x64_reg REG_SP = R13;       // &S->stack[S->sp]
+constexpr x64_reg REG_STACK = R15;    // S->stack
+
+// Field offsets used by the generated code. offsetof() isn't guaranteed for
+// these types, but they have no virtual functions or bases, so it works fine.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static const i32 OFF_S_STACK = offsetof(istate, stack);
+static const i32 OFF_S_SP = offsetof(istate, sp);
+static const i32 OFF_S_BP = offsetof(istate, bp);
+static const i32 OFF_S_CALLEE = offsetof(istate, callee);
+static const i32 OFF_S_G = offsetof(istate, G);
+static const i32 OFF_G_DEF_ARR = offsetof(global_env, def_arr)
+    + offsetof(dyn_array<value>, data);
+static const i32 OFF_FUN_STUB = offsetof(fn_function, stub);
+static const i32 OFF_FUN_FLAT_UPVALS = offsetof(fn_function, flat_upvals);
+static const i32 OFF_STUB_CONST_ARR = offsetof(function_stub, const_arr);
+static const i32 OFF_STUB_CODE_ID = offsetof(function_stub, code_id);
+#pragma GCC diagnostic pop
+
+// machine code buffer with labels. Memory operands always use a 32-bit
+// displacement, which keeps the encoder simple.
+struct x64_emitter {
+    dyn_array<u8> buf;
+    // label addresses (or -1 when unbound), and the rel32 fields that refer to
+    // them
+    dyn_array<u32> labels;
+    struct fixup {
+        u32 at;
+        u32 label;
+    };
+    dyn_array<fixup> fixups;
+
+    void byte(u8 b) {
+        buf.push_back(b);
+    }
+    void imm32(u32 x) {
+        for (u32 i = 0; i < 4; ++i) {
+            byte((x >> (8*i)) & 0xff);
+        }
+    }
+    void imm64(u64 x) {
+        for (u32 i = 0; i < 8; ++i) {
+            byte((x >> (8*i)) & 0xff);
+        }
+    }
+
+    u32 new_label() {
+        labels.push_back((u32)-1);
+        return labels.size - 1;
+    }
+    void bind(u32 label) {
+        labels[label] = buf.size;
+    }
+    void rel32(u32 label) {
+        fixups.push_back(fixup{buf.size, label});
+        imm32(0);
+    }
+    void resolve() {
+        for (auto& f : fixups) {
+            i32 rel = labels[f.label] - (f.at + 4);
+            memcpy(&buf[f.at], &rel, 4);
+        }
+    }
+
+    void rex(bool w, u8 reg, u8 rm) {
+        u8 r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40) {
+            byte(r);
+        }
+    }
+    // opcodes > 0xff are two-byte 0x0f opcodes
+    void opcode(u16 op) {
+        if (op > 0xff) {
+            byte(0x0f);
+        }
+        byte(op & 0xff);
+    }
+    // op reg, [base + disp]
+    void mem(u16 op, bool w, u8 reg, u8 base, i32 disp) {
+        rex(w, reg, base);
+        opcode(op);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) {
+            byte(0x24);
+        }
+        imm32(disp);
+    }
+    // op reg, rm with register operands
+    void rr(u16 op, bool w, u8 reg, u8 rm) {
+        rex(w, reg, rm);
+        opcode(op);
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void load64(u8 dst, u8 base, i32 disp) {
+        mem(0x8b, true, dst, base, disp);
+    }
+    void store64(u8 base, i32 disp, u8 src) {
+        mem(0x89, true, src, base, disp);
+    }
+    void load32(u8 dst, u8 base, i32 disp) {
+        mem(0x8b, false, dst, base, disp);
+    }
+    void store32(u8 base, i32 disp, u8 src) {
+        mem(0x89, false, src, base, disp);
+    }
+    void mov(u8 dst, u8 src) {
+        rr(0x89, true, src, dst);
+    }
+    void mov_imm64(u8 dst, u64 imm) {
+        rex(true, 0, dst);
+        byte(0xb8 + (dst & 7));
+        imm64(imm);
+    }
+    void mov_imm32(u8 dst, u32 imm) {
+        rex(false, 0, dst);
+        byte(0xb8 + (dst & 7));
+        imm32(imm);
+    }
+    // 0x81 group with a sign-extended 32-bit immediate. ext selects the
+    // operation: 0 = add, 1 = or, 4 = and, 5 = sub, 7 = cmp
+    void alu_imm(u8 ext, bool w, u8 dst, i32 imm) {
+        rex(w, 0, dst);
+        byte(0x81);
+        byte(0xc0 | (ext << 3) | (dst & 7));
+        imm32(imm);
+    }
+    void add_imm(u8 dst, i32 imm) {
+        alu_imm(0, true, dst, imm);
+    }
+    void sub_imm(u8 dst, i32 imm) {
+        alu_imm(5, true, dst, imm);
+    }
+    // shifts: ext 4 = shl, 5 = shr
+    void shift(u8 ext, u8 dst, u8 amount) {
+        rex(true, 0, dst);
+        byte(0xc1);
+        byte(0xc0 | (ext << 3) | (dst & 7));
+        byte(amount);
+    }
+    // dst = base + 8*index
+    void lea_scaled(u8 dst, u8 base, u8 index) {
+        u8 r = 0x48 | ((dst >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        byte(r);
+        byte(0x8d);
+        byte(0x44 | ((dst & 7) << 3));
+        byte(0xc0 | ((index & 7) << 3) | (base & 7));
+        byte(0);
+    }
+    void jmp(u32 label) {
+        byte(0xe9);
+        rel32(label);
+    }
+    void jcc(u8 cc, u32 label) {
+        byte(0x0f);
+        byte(0x80 | cc);
+        rel32(label);
+    }
+    void setcc_al(u8 cc) {
+        byte(0x0f);
+        byte(0x90 | cc);
+        byte(0xc0);
+    }
+    void push_reg(u8 r) {
+        rex(false, 0, r);
+        byte(0x50 + (r & 7));
+    }
+    void pop_reg(u8 r) {
+        rex(false, 0, r);
+        byte(0x58 + (r & 7));
+    }
+    void call_abs(const void* f) {
+        mov_imm64(RAX, (u64)f);
+        byte(0xff);
+        byte(0xd0);
+    }
+};
+
+// translates a single function_stub
+struct jit_translator {
+    function_stub* stub;
+    x64_emitter e;
+    // label for each bytecode address
+    u32 pc_labels;
+    // shared exit paths
+    u32 exit_label;      // write back sp and return eax
+    u32 error_label;     // return JIT_ERROR
+
+    u32 pc_label(u32 pc) {
+        return pc_labels + pc;
+    }
+
+    // sp = &S->stack[S->sp], bp = &S->stack[S->bp]. Clobbers rcx.
+    void load_regs() {
+        e.load64(REG_STACK, REG_S, OFF_S_STACK);
+        e.load32(RCX, REG_S, OFF_S_SP);
+        e.lea_scaled(REG_SP, REG_STACK, RCX);
+        e.load32(RCX, REG_S, OFF_S_BP);
+        e.lea_scaled(REG_BP, REG_STACK, RCX);
+    }
+    // S->sp = sp - stack. Clobbers rcx.
+    void save_sp() {
+        e.mov(RCX, REG_SP);
+        e.rr(0x29, true, REG_STACK, RCX);
+        e.shift(5, RCX, 3);
+        e.store32(REG_S, OFF_S_SP, RCX);
+    }
+
+    void push(u8 r) {
+        e.store64(REG_SP, 0, r);
+        e.add_imm(REG_SP, 8);
+    }
+
+    // call a runtime routine with up to three integer arguments after S. The
+    // return value is left in rax.
+    void call_runtime(const void* f, u32 a1 = 0, u32 a2 = 0, u32 a3 = 0) {
+        save_sp();
+        e.mov(RDI, REG_S);
+        e.mov_imm32(RSI, a1);
+        e.mov_imm32(RDX, a2);
+        e.mov_imm32(RCX, a3);
+        e.call_abs(f);
+        load_regs();
+    }
+    // same, but jump to the error exit if the routine returns false
+    void call_checked(const void* f, u32 a1 = 0, u32 a2 = 0, u32 a3 = 0) {
+        call_runtime(f, a1, a2, a3);
+        e.rr(0x84, false, RAX, RAX);        // test al, al
+        e.jcc(CC_E, error_label);
+    }
+
+    void load_local(u8 dst, u32 i) {
+        e.load64(dst, REG_BP, 8 * i);
+    }
+    void load_const(u8 dst, u32 cid) {
+        e.load64(dst, REG_S, OFF_S_CALLEE);
+        e.load64(dst, dst, OFF_FUN_STUB);
+        e.load64(dst, dst, OFF_STUB_CONST_ARR);
+        e.load64(dst, dst, 8 * cid);
+    }
+    void emit_global(u32 id, u32 pc) {
+        auto ok = e.new_label();
+        e.load64(RAX, REG_S, OFF_S_G);
+        e.load64(RAX, RAX, OFF_G_DEF_ARR);
+        e.load64(RAX, RAX, 8 * id);
+        e.mov_imm64(RCX, V_UNIN.raw);
+        e.rr(0x39, true, RCX, RAX);
+        e.jcc(CC_NE, ok);
+        call_runtime((void*)jit_global_error, id, pc);
+        e.jmp(error_label);
+        e.bind(ok);
+        push(RAX);
+    }
+
+    // jump to label unless r holds an int. Clobbers rcx.
+    void check_int(u8 r, u32 label) {
+        e.mov(RCX, r);
+        e.alu_imm(4, false, RCX, TAG_MASK);
+        e.alu_imm(7, false, RCX, TAG_INT);
+        e.jcc(CC_NE, label);
+    }
+
+    // typed is set for the int versions of the instructions, whose operands
+    // are known to be ints
+    void emit_arith(u8 op, u32 pc, bool typed = false) {
+        auto slow = e.new_label();
+        auto done = e.new_label();
+        e.load64(RAX, REG_SP, -16);
+        e.load64(RDX, REG_SP, -8);
+        if (!typed) {
+            check_int(RAX, slow);
+            check_int(RDX, slow);
+        }
+        // unbox, operate on the 32-bit payloads, and rebox
+        e.shift(5, RAX, 5);
+        e.shift(5, RDX, 5);
+        if (op == OP_ADD) {
+            e.rr(0x01, false, RDX, RAX);
+        } else if (op == OP_SUB) {
+            e.rr(0x29, false, RDX, RAX);
+        } else {
+            e.rr(0x0faf, false, RAX, RDX);
+        }
+        e.shift(4, RAX, 5);
+        e.alu_imm(1, true, RAX, TAG_INT);
+        e.store64(REG_SP, -16, RAX);
+        e.sub_imm(REG_SP, 8);
+        if (typed) {
+            return;
+        }
+        e.jmp(done);
+        e.bind(slow);
+        call_checked((void*)jit_arith, op, pc);
+        e.bind(done);
+    }
+
+    // compare the top two elements of the stack and pop them, leaving the
+    // result in al
+    void emit_compare(u8 op, u32 pc, bool typed = false) {
+        auto slow = e.new_label();
+        auto pop = e.new_label();
+        auto done = e.new_label();
+        e.load64(RAX, REG_SP, -16);
+        e.load64(RDX, REG_SP, -8);
+        if (op == OP_EQ) {
+            auto differ = e.new_label();
+            e.rr(0x39, true, RDX, RAX);
+            e.jcc(CC_NE, differ);
+            e.mov_imm32(RAX, 1);
+            e.jmp(pop);
+            e.bind(differ);
+            // distinct ints are never equal
+            check_int(RAX, slow);
+            check_int(RDX, slow);
+            e.mov_imm32(RAX, 0);
+            e.jmp(pop);
+        } else {
+            if (!typed) {
+                check_int(RAX, slow);
+                check_int(RDX, slow);
+            }
+            e.shift(5, RAX, 5);
+            e.shift(5, RDX, 5);
+            e.rr(0x39, false, RDX, RAX);
+            u8 cc = op == OP_LT ? CC_L
+                : op == OP_LE ? CC_LE
+                : op == OP_GT ? CC_G
+                : CC_GE;
+            e.setcc_al(cc);
+            e.jmp(pop);
+        }
+        e.bind(slow);
+        call_runtime((void*)jit_compare, op, pc);
+        e.rr(0x85, false, RAX, RAX);
+        e.jcc(CC_S, error_label);
+        e.jmp(done);
+        e.bind(pop);
+        e.sub_imm(REG_SP, 16);
+        e.bind(done);
+    }
+    // push the boolean in al
+    void push_bool() {
+        e.mov_imm64(RCX, V_NO.raw);
+        e.mov_imm64(RDX, V_YES.raw);
+        e.rr(0x84, false, RAX, RAX);
+        e.rr(0x0f40 | CC_NE, true, RCX, RDX);
+        push(RCX);
+    }
+    // jump to the target of the jump instruction at pc if al is false
+    void jump_false(u32 pc) {
+        e.rr(0x84, false, RAX, RAX);
+        e.jcc(CC_E, pc_label(jump_target(pc)));
+    }
+
+    u32 code_short(u32 pc) {
+        u16 res;
+        memcpy(&res, &stub->code[pc], 2);
+        return res;
+    }
+    u32 code_u32(u32 pc) {
+        u32 res;
+        memcpy(&res, &stub->code[pc], 4);
+        return res;
+    }
+    u64 code_u64(u32 pc) {
+        u64 res;
+        memcpy(&res, &stub->code[pc], 8);
+        return res;
+    }
+    u32 jump_target(u32 pc) {
+        return pc + 3 + (i16)code_short(pc + 1);
+    }
+
+    // return to the interpreter to execute the instruction at pc
+    void exit_at(u32 pc) {
+        e.mov_imm32(RAX, pc);
+        e.jmp(exit_label);
+    }
+
+    void translate();
+};
+
+void jit_translator::translate() {
+    auto code = stub->code;
+    auto len = stub->code_length;
+    pc_labels = e.labels.size;
+    for (u32 i = 0; i < len; ++i) {
+        e.new_label();
+    }
+    exit_label = e.new_label();
+    error_label = e.new_label();
+
+    // prologue. Five pushes keep rsp 16-byte aligned for calls.
+    e.push_reg(RBX);
+    e.push_reg(R12);
+    e.push_reg(R13);
+    e.push_reg(R14);
+    e.push_reg(R15);
+    e.mov(REG_S, RDI);
+    load_regs();
+    // dispatch on the entry point in esi. These are the start of the function
+    // and the return addresses of non-tail calls.
+    u8 prev = OP_CALL;
+    for (u32 pc = 0; pc < len; pc += instr_width(code[pc])) {
+        if (prev == OP_CALL || prev == OP_CALLM || prev == OP_APPLY
+                || prev == OP_CALL_KNOWN || prev == OP_CALL_FOREIGN) {
+            e.alu_imm(7, false, RSI, pc);
+            e.jcc(CC_E, pc_label(pc));
+        }
+        prev = code[pc];
+    }
+    e.mov(RAX, RSI);
+    e.jmp(exit_label);
+
+    for (u32 pc = 0; pc < len; pc += instr_width(code[pc])) {
+        e.bind(pc_label(pc));
+        auto op = code[pc];
+        switch (op) {
+        case OP_NOP:
+            break;
+        case OP_POP:
+            e.sub_imm(REG_SP, 8);
+            break;
+        case OP_LOCAL:
+            load_local(RAX, code[pc+1]);
+            push(RAX);
+            break;
+        case OP_SET_LOCAL:
+            e.sub_imm(REG_SP, 8);
+            e.load64(RAX, REG_SP, 0);
+            e.store64(REG_BP, 8 * code[pc+1], RAX);
+            break;
+        case OP_COPY:
+            e.load64(RAX, REG_SP, -8 * (code[pc+1] + 1));
+            push(RAX);
+            break;
+        case OP_UPVALUE:
+            call_runtime((void*)jit_upvalue, code[pc+1]);
+            break;
+        case OP_SET_UPVALUE:
+            call_runtime((void*)jit_set_upvalue, code[pc+1]);
+            break;
+        case OP_FLAT_UPVALUE:
+            e.load64(RAX, REG_S, OFF_S_CALLEE);
+            e.load64(RAX, RAX, OFF_FUN_FLAT_UPVALS);
+            e.load64(RAX, RAX, 8 * code[pc+1]);
+            push(RAX);
+            break;
+        case OP_CLOSURE:
+            call_runtime((void*)jit_closure, code_short(pc+1));
+            break;
+        case OP_CLOSE:
+            call_runtime((void*)jit_close, code[pc+1]);
+            break;
+        case OP_CLOSE_FROM:
+            call_runtime((void*)jit_close_from, code[pc+1]);
+            break;
+        case OP_GLOBAL:
+            emit_global(code_u32(pc+1), pc);
+            break;
+        case OP_SET_GLOBAL:
+            call_runtime((void*)jit_set_global, code_u32(pc+1));
+            break;
+        case OP_OBJ_GET:
+            call_checked((void*)jit_obj_get, pc);
+            break;
+        case OP_OBJ_SET:
+            call_checked((void*)jit_obj_set, pc);
+            break;
+        case OP_GET_FIELD:
+            call_checked((void*)jit_get_field, code_short(pc+1),
+                    code_short(pc+3), pc);
+            break;
+        case OP_SET_FIELD:
+            call_checked((void*)jit_set_field, code_short(pc+1),
+                    code_short(pc+3), pc);
+            break;
+        case OP_MACRO:
+            call_checked((void*)jit_macro, code_short(pc+1), pc);
+            break;
+        case OP_SET_MACRO:
+            call_runtime((void*)jit_set_macro, code_short(pc+1));
+            break;
+        case OP_CONST:
+            load_const(RAX, code_short(pc+1));
+            push(RAX);
+            break;
+        case OP_NIL:
+            e.mov_imm64(RAX, V_NIL.raw);
+            push(RAX);
+            break;
+        case OP_NO:
+            e.mov_imm64(RAX, V_NO.raw);
+            push(RAX);
+            break;
+        case OP_YES:
+            e.mov_imm64(RAX, V_YES.raw);
+            push(RAX);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            emit_arith(op, pc);
+            break;
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+            emit_compare(op, pc);
+            push_bool();
+            break;
+        case OP_ADD_INT:
+            emit_arith(OP_ADD, pc, true);
+            break;
+        case OP_SUB_INT:
+            emit_arith(OP_SUB, pc, true);
+            break;
+        case OP_MUL_INT:
+            emit_arith(OP_MUL, pc, true);
+            break;
+        case OP_ADD_FLOAT:
+            call_checked((void*)jit_arith, OP_ADD, pc);
+            break;
+        case OP_SUB_FLOAT:
+            call_checked((void*)jit_arith, OP_SUB, pc);
+            break;
+        case OP_MUL_FLOAT:
+            call_checked((void*)jit_arith, OP_MUL, pc);
+            break;
+        case OP_LT_INT:
+            emit_compare(OP_LT, pc, true);
+            push_bool();
+            break;
+        case OP_LE_INT:
+            emit_compare(OP_LE, pc, true);
+            push_bool();
+            break;
+        case OP_GT_INT:
+            emit_compare(OP_GT, pc, true);
+            push_bool();
+            break;
+        case OP_GE_INT:
+            emit_compare(OP_GE, pc, true);
+            push_bool();
+            break;
+        case OP_GUARD_INT:
+            load_local(RAX, code[pc+1]);
+            check_int(RAX, pc_label(pc + 4 + (i16)code_short(pc+2)));
+            break;
+        case OP_GUARD_SELF:
+            e.load64(RAX, REG_S, OFF_S_G);
+            e.load64(RAX, RAX, OFF_G_DEF_ARR);
+            e.load64(RAX, RAX, 8 * code_u32(pc+1));
+            e.load64(RCX, REG_S, OFF_S_CALLEE);
+            e.alu_imm(1, true, RCX, TAG_FUNC);
+            e.rr(0x39, true, RCX, RAX);
+            e.jcc(CC_NE, pc_label(pc + 7 + (i16)code_short(pc+5)));
+            break;
+        case OP_GUARD_GLOBAL: {
+            auto fail = pc_label(pc + 15 + (i16)code_short(pc+13));
+            e.load64(RAX, REG_S, OFF_S_G);
+            e.load64(RAX, RAX, OFF_G_DEF_ARR);
+            e.load64(RAX, RAX, 8 * code_u32(pc+1));
+            e.mov(RCX, RAX);
+            e.alu_imm(4, false, RCX, TAG_MASK);
+            e.alu_imm(7, false, RCX, TAG_FUNC);
+            e.jcc(CC_NE, fail);
+            e.sub_imm(RAX, TAG_FUNC);
+            e.load64(RAX, RAX, OFF_FUN_STUB);
+            e.load64(RAX, RAX, OFF_STUB_CODE_ID);
+            e.mov_imm64(RCX, code_u64(pc+5));
+            e.rr(0x39, true, RCX, RAX);
+            e.jcc(CC_NE, fail);
+        }
+            break;
+        case OP_JUMP:
+            e.jmp(pc_label(jump_target(pc)));
+            break;
+        case OP_CJUMP:
+            e.sub_imm(REG_SP, 8);
+            e.load64(RAX, REG_SP, 0);
+            e.mov_imm64(RCX, V_NIL.raw);
+            e.rr(0x39, true, RCX, RAX);
+            e.jcc(CC_E, pc_label(jump_target(pc)));
+            e.mov_imm64(RCX, V_NO.raw);
+            e.rr(0x39, true, RCX, RAX);
+            e.jcc(CC_E, pc_label(jump_target(pc)));
+            break;
+        case OP_LIST:
+            call_runtime((void*)jit_list, code[pc+1]);
+            break;
+        case OP_LOCAL2:
+            load_local(RAX, code[pc+1]);
+            push(RAX);
+            load_local(RAX, code[pc+2]);
+            push(RAX);
+            break;
+        case OP_LOCAL_CONST:
+            load_local(RAX, code[pc+1]);
+            push(RAX);
+            load_const(RAX, code_short(pc+2));
+            push(RAX);
+            break;
+        case OP_GLOBAL_LOCAL:
+            emit_global(code_u32(pc+1), pc);
+            load_local(RAX, code[pc+5]);
+            push(RAX);
+            break;
+        case OP_LOCAL_GET_FIELD:
+            load_local(RAX, code[pc+1]);
+            push(RAX);
+            call_checked((void*)jit_get_field, code_short(pc+2),
+                    code_short(pc+4), pc);
+            break;
+        case OP_EQ_CJUMP:
+            emit_compare(OP_EQ, pc);
+            jump_false(pc);
+            break;
+        case OP_LT_CJUMP:
+            emit_compare(OP_LT, pc);
+            jump_false(pc);
+            break;
+        case OP_LE_CJUMP:
+            emit_compare(OP_LE, pc);
+            jump_false(pc);
+            break;
+        case OP_GT_CJUMP:
+            emit_compare(OP_GT, pc);
+            jump_false(pc);
+            break;
+        case OP_GE_CJUMP:
+            emit_compare(OP_GE, pc);
+            jump_false(pc);
+            break;
+        case OP_LT_INT_CJUMP:
+            emit_compare(OP_LT, pc, true);
+            jump_false(pc);
+            break;
+        case OP_LE_INT_CJUMP:
+            emit_compare(OP_LE, pc, true);
+            jump_false(pc);
+            break;
+        case OP_GT_INT_CJUMP:
+            emit_compare(OP_GT, pc, true);
+            jump_false(pc);
+            break;
+        case OP_GE_INT_CJUMP:
+            emit_compare(OP_GE, pc, true);
+            jump_false(pc);
+            break;
+        default:
+            // calls, returns, and imports are left to the interpreter
+            exit_at(pc);
+            break;
+        }
+    }
+    // in case the code runs off the end
+    exit_at(len);
+
+    e.bind(exit_label);
+    save_sp();
+    auto epilogue = e.new_label();
+    e.jmp(epilogue);
+    e.bind(error_label);
+    e.mov_imm32(RAX, JIT_ERROR);
+    e.bind(epilogue);
+    e.pop_reg(R15);
+    e.pop_reg(R14);
+    e.pop_reg(R13);
+    e.pop_reg(R12);
+    e.pop_reg(RBX);
+    e.byte(0xc3);
+    e.resolve();
+}
+
+static void write_perf_map(istate* S, function_stub* stub, jit_code* jc,
+        u64 size) {
+    auto J = S->jit;
+    if (!J->perf_map) {
+        auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        J->perf_map = fopen(path.c_str(), "w");
+        if (!J->perf_map) {
+            return;
+        }
+    }
+    string name = stub->name ? convert_fn_str(stub->name) : "";
+    if (name.empty()) {
+        name = "<anonymous>";
+    }
+    string file = stub->filename ? convert_fn_str(stub->filename) : "";
+    fprintf(J->perf_map, "%lx %lx fn:%s %s\n", (unsigned long)jc->mem,
+            (unsigned long)size, name.c_str(), file.c_str());
+    fflush(J->perf_map);
+}
+
+bool jit_compile(istate* S, function_stub* stub) {
+    if (stub->foreign || stub->code_length == 0) {
+        return false;
+    }
+    jit_translator t;
+    t.stub = stub;
+    t.translate();
+
+    // copy the code into its own pages, then make them executable
+    auto page = (u64)sysconf(_SC_PAGESIZE);
+    u64 size = t.e.buf.size;
+    u64 mem_size = (size + page - 1) / page * page;
+    auto mem = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    memcpy(mem, t.e.buf.data, size);
+    if (mprotect(mem, mem_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, mem_size);
+        return false;
+    }
+
+    if (!S->jit) {
+        S->jit = new jit_state;
+    }
+    auto jc = new jit_code;
+    jc->run = (u32 (*)(istate*, u32))mem;
+    jc->mem = mem;
+    jc->mem_size = mem_size;
+    jc->stub = stub;
+    S->jit->code.push_back(jc);
+    stub->jit = jc;
+    write_perf_map(S, stub, jc, size);
+    return true;
+}
+
+void free_jit_code(jit_state* J, u32 i) {
+    auto jc = J->code[i];
+    munmap(jc->mem, jc->mem_size);
+    delete jc;
+    J->code[i] = J->code[J->code.size - 1];
+    J->code.pop();
+}
+
+void free_jit_state(jit_state* J) {
+    for (auto jc : J->code) {
+        munmap(jc->mem, jc->mem_size);
+        delete jc;
+    }
+    if (J->perf_map) {
+        fclose(J->perf_map);
+    }
+    delete J;
+}
+
+}
+
+#endif
@@ -0,0 +1,101 @@
+// jit.hpp -- baseline template JIT compiler
+#ifndef __FN_JIT_HPP
+#define __FN_JIT_HPP
+
+#include "config.h"
+
+#include "base.hpp"
+#include "istate.hpp"
+#include "obj.hpp"
+
+#include <cstdio>
+
+namespace fn {
+
+// NOTE: (Baseline JIT). Once a function has been entered JIT_THRESHOLD times,
+// its bytecode is translated to native code by pasting together a fixed
+// template for each instruction. The generated code uses the same value stack,
+// base pointer, and constant table as the interpreter, so the garbage
+// collector and stack traces work unchanged.
+//
+// Native code never performs calls or returns itself. When it reaches a call,
+// return, or import instruction, it writes back the stack pointer and returns
+// that instruction's address to the interpreter, which executes it. The
+// interpreter resumes native code when the function is entered (pc 0) or when
+// a call made from it returns (the address after a call instruction). Other
+// instructions which are too involved to inline are implemented by calling the
+// jit_* runtime routines declared below.
+
+// number of times a function is entered before it is compiled
+constexpr u32 JIT_THRESHOLD = 500;
+// returned by native code when an error occurs
+constexpr u32 JIT_ERROR = (u32)-1;
+
+// native code for a single function_stub
+struct jit_code {
+    // Run native code starting at pc. Returns the address of the next
+    // instruction for the interpreter to execute, or JIT_ERROR. If pc isn't an
+    // entry point, it's returned right away.
+    u32 (*run)(istate* S, u32 pc);
+    // executable memory region holding the code
+    void* mem;
+    u64 mem_size;
+    // the stub this code was compiled from. The garbage collector updates this
+    // when the stub is moved and frees the code when the stub dies.
+    function_stub* stub;
+};
+
+// per-istate JIT bookkeeping
+struct jit_state {
+    dyn_array<jit_code*> code;
+    // perf map file used to symbolize native code, /tmp/perf-PID.map
+    FILE* perf_map = nullptr;
+};
+
+#ifdef FN_JIT
+
+// compile stub to native code, setting stub->jit on success
+bool jit_compile(istate* S, function_stub* stub);
+// free the native code J->code[i]. The last entry of J->code takes its place.
+void free_jit_code(jit_state* J, u32 i);
+// free all native code
+void free_jit_state(jit_state* J);
+
+// count an entry into the function and compile it if it's hot. Returns true
+// if the stub has native code.
+inline bool jit_enter(istate* S, function_stub* stub) {
+    if (!stub->jit && ++stub->jit_count == JIT_THRESHOLD) {
+        jit_compile(S, stub);
+    }
+    return stub->jit != nullptr;
+}
+
+// runtime routines called from native code. These are defined in vm.cpp
+// alongside the interpreter. All expect S->sp to be up to date. The ones that
+// can fail add a stack trace frame for the instruction at pc and return false.
+void jit_upvalue(istate* S, u32 i);
+void jit_set_upvalue(istate* S, u32 i);
+void jit_closure(istate* S, u32 fid);
+void jit_close(istate* S, u32 n);
+void jit_close_from(istate* S, u32 i);
+void jit_global_error(istate* S, u32 id, u32 pc);
+void jit_set_global(istate* S, u32 id);
+bool jit_obj_get(istate* S, u32 pc);
+bool jit_obj_set(istate* S, u32 pc);
+bool jit_get_field(istate* S, u32 cid, u32 cache_id, u32 pc);
+bool jit_set_field(istate* S, u32 cid, u32 cache_id, u32 pc);
+bool jit_macro(istate* S, u32 cid, u32 pc);
+void jit_set_macro(istate* S, u32 cid);
+void jit_list(istate* S, u32 n);
+// arithmetic on the top two stack elements for all the cases not handled
+// inline
+bool jit_arith(istate* S, u32 op, u32 pc);
+// comparison of the top two stack elements, popping them. Returns 1 for true,
+// 0 for false, and -1 on error.
+i32 jit_compare(istate* S, u32 op, u32 pc);
+
+#endif
+
+}
+
+#endif
@@ -1,9 +1,11 @@
 #include "base.hpp"
 #include "builtin.hpp"
 #include "bytes.hpp"
+#include "cache.hpp"
 #include "gc.hpp"
 #include "compile.hpp"
 #include "platform.hpp"
+#include "profile.hpp"
 #include "table.hpp"
 #include "values.hpp"
 #include "vm.hpp"
@@ -28,6 +30,15 @@ void show_usage() {
         "  -D dir        Set working directory.\n"
         "  -I dir        Add a package search directory. Can occur multiple times.\n"
         "  -             Take file input directly from STDIN.\n"
+        "  --no-cache    Don't load or save compiled code in .fnc files.\n"
+        "  --profile file\n"
+        "                Sample the Fn call stack while running and write the\n"
+        "                samples to file as folded stacks for flamegraph.pl.\n"
+        "  --profile-ops Print instruction counts and timings on exit. Requires\n"
+        "                a build with FN_PROFILE_OPS enabled.\n"
+        "  --profile-ops-json file\n"
+        "                Like --profile-ops, and also write the data to file\n"
+        "                as JSON.\n"
         "  FILE          File or package to interpret. Omitting this starts a REPL.\n"
         "Running with no options starts REPL in namespace fn/user/repl.\n"
         "When evaluating a file, the package and namespace are determined\n"
@@ -49,6 +60,14 @@ struct interpreter_options {
     bool repl = false;
     // package include directories
     dyn_array<string> include;
+    // don't use the bytecode cache
+    bool no_cache = false;
+    // if nonempty, where to write the output of the sampling profiler
+    string profile = "";
+    // whether to profile instruction execution, and where to write JSON
+    // output. An empty filename means no JSON.
+    bool profile_ops = false;
+    string profile_ops_json = "";
 
     // if true, the argument list was malformed and the other fields are not
     // guaranteed to be properly initialized
@@ -111,6 +130,34 @@ void process_args(int argc, char** argv, interpreter_options* opt) {
             case '\0':
                 stdin_flag = true;
                 break;
+            case '-':
+                // long options
+                if (s == "--no-cache") {
+                    opt->no_cache = true;
+                } else if (s == "--profile") {
+                    if (i == argc - 1) {
+                        opt->err = true;
+                        opt->message = "Option --profile requires an argument.";
+                        return;
+                    }
+                    opt->profile = argv[++i];
+                } else if (s == "--profile-ops") {
+                    opt->profile_ops = true;
+                } else if (s == "--profile-ops-json") {
+                    if (i == argc - 1) {
+                        opt->err = true;
+                        opt->message = "Option --profile-ops-json requires "
+                            "an argument.";
+                        return;
+                    }
+                    opt->profile_ops = true;
+                    opt->profile_ops_json = argv[++i];
+                } else {
+                    opt->err = true;
+                    opt->message = "Unrecognized option: " + s;
+                    return;
+                }
+                break;
             default:
                 opt->err = true;
                 opt->message = "Unrecognized option: " + s;
@@ -146,6 +193,9 @@ int main(int argc, char** argv) {
 
     setup_gc_methods();
     auto S = init_istate();
+    if (opt.no_cache) {
+        disable_bytecode_cache(S);
+    }
     install_builtin(S);
     if (has_error(S)) {
         std::cout << "Error: " << *S->err.message << '\n';
@@ -154,7 +204,23 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    if (opt.profile_ops) {
+#ifdef FN_PROFILE_OPS
+        enable_op_profile(S);
+#else
+        std::cout << "Error: --profile-ops requires a build with "
+                  << "FN_PROFILE_OPS enabled.\n";
+        free_istate(S);
+        return -1;
+#endif
+    }
+
     set_directory(S, opt.dir);
+    if (opt.profile != "" && !start_profiler(S)) {
+        std::cout << "Error: failed to start the profiler.\n";
+        free_istate(S);
+        return -1;
+    }
     set_ns_name(S, "fn/user");
     if (opt.src != "") {
         if (load_file_or_package(S, opt.src)) {
@@ -176,6 +242,20 @@ int main(int argc, char** argv) {
         std::cout << "Error: " << *S->err.message << '\n';
         print_stack_trace(S);
     }
+    if (opt.profile != "" && !stop_profiler(S, opt.profile)) {
+        std::cout << "Error: failed to write profile to " << opt.profile
+                  << '\n';
+    }
+#ifdef FN_PROFILE_OPS
+    if (opt.profile_ops) {
+        print_op_profile(S, std::cerr);
+        if (opt.profile_ops_json != ""
+                && !write_op_profile_json(S, opt.profile_ops_json)) {
+            std::cout << "Error: failed to write opcode profile to "
+                      << opt.profile_ops_json << '\n';
+        }
+    }
+#endif
     free_istate(S);
 
     return 0;
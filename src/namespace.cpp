@@ -2,10 +2,43 @@
 
 namespace fn {
 
+static void free_shape_tree(table_shape* shape) {
+    for (auto e : shape->add_key) {
+        free_shape_tree(e->val);
+    }
+    if (shape->rehash) {
+        free_shape_tree(shape->rehash);
+    }
+    delete shape;
+}
+
 global_env::~global_env() {
     for (auto e : ns_tab) {
         delete e->val;
     }
+    for (auto e : root_shapes) {
+        free_shape_tree(e->val);
+    }
+    for (auto e : inline_tab) {
+        if (e->val) {
+            ast::free_graph(e->val->body);
+            delete e->val;
+        }
+    }
+    for (auto f : lazy_funs) {
+        if (f->form) {
+            ast::free_graph(f->form);
+        }
+        delete f;
+    }
+    clear_macro_memos(this);
+}
+
+void clear_macro_memos(global_env* G) {
+    for (auto e : G->macro_memos) {
+        delete e->val;
+    }
+    G->macro_memos = table<u64,macro_memo*>{};
 }
 
 bool resolve_symbol(symbol_id& out, istate* S, symbol_id name) {
@@ -4,6 +4,7 @@
 #include "api.hpp"
 #include "base.hpp"
 #include "istate.hpp"
+#include "parse.hpp"
 #include "values.hpp"
 
 namespace fn {
@@ -19,6 +20,61 @@ struct fn_namespace {
     dyn_array<symbol_id> exports;
 };
 
+// a global function which the compiler may inline at its call sites (see NOTE
+// (Inlining) in compile.cpp)
+struct inline_fun {
+    dyn_array<symbol_id> params;
+    // the function's unqualified name and source file, for stack traces
+    symbol_id name;
+    symbol_id filename;
+    // code_id given to the function's stub, which inlined copies are guarded
+    // on (see NOTE: (Guarded globals) in compile.cpp)
+    u64 code_id;
+    // the macroexpanded function body. Symbol and string nodes hold symbol IDs
+    // rather than scanner_string_table IDs, since the body may be inlined into
+    // code from another file. Global variables are given by their FQNs.
+    ast::node* body;
+};
+
+// node kind used in macro_memo for lists copied from the macro arguments
+constexpr u8 MEMO_ARG_REF = 0xff;
+
+// a memoized expansion of a call to a pure macro (see NOTE: (Macro
+// memoization) in compile.cpp)
+struct macro_memo {
+    // memo_id of the macro
+    u64 macro_id;
+    // second hash of the arguments, which must match too
+    u64 check;
+    // The expansion, flattened in prefix order. Each node starts with a word
+    // holding its ast_kind in the low 8 bits and its integer value, symbol ID,
+    // or list length in the rest. Floats are followed by a word holding their
+    // bits. Lists taken unchanged from the arguments have kind MEMO_ARG_REF and
+    // hold the offset of their path in arg_paths, so that they can be copied
+    // from the new call along with their source locations.
+    dyn_array<u64> expansion;
+    // Each path is stored as its length followed by the index of the argument
+    // and then the indices of the nested lists leading to the node.
+    dyn_array<u32> arg_paths;
+};
+
+// source of a function whose compilation has been put off until it's first
+// called (see NOTE: (Lazy compilation) in compile.cpp)
+struct lazy_fun {
+    // the string table used by form
+    scanner_string_table sst;
+    // the function's name, and whether it's bound to the global variable of
+    // that name (see self_binding)
+    sst_id name;
+    bool self;
+    // the parameter list followed by the body. Freed once the function has
+    // been compiled.
+    ast::node* form;
+    // set while the function is being compiled. A macro used in its body could
+    // call it then.
+    bool compiling = false;
+};
+
 struct global_env {
     // definition IDs indexed by fully qualified name (FQN)
     table<symbol_id,u32> def_tab;
@@ -32,14 +88,36 @@ struct global_env {
     table<symbol_id,fn_function*> macro_tab;
     // table of namespaces by name
     table<symbol_id,fn_namespace*> ns_tab;
+    // inlinable functions indexed by FQN. The entry is set to nullptr if the
+    // variable is defined again.
+    table<symbol_id,inline_fun*> inline_tab;
+    // IDs of globals defined at toplevel with pure values, indexed by FQN. The
+    // entry is 0 if the value may not be pure.
+    table<symbol_id,u64> pure_tab;
+    // memoized macro expansions, indexed by a hash of the macro's ID and its
+    // arguments
+    table<u64,macro_memo*> macro_memos;
+    // if non-null, the compiler appends the FQNs of globals whose entries in
+    // inline_tab or pure_tab it changes. Used by the bytecode cache.
+    dyn_array<symbol_id>* info_log = nullptr;
+    // every lazy_fun made so far. These are referred to by function stubs, so
+    // they're kept until the global environment is freed.
+    dyn_array<lazy_fun*> lazy_funs;
 
     // metatables for builtin types
     value list_meta = V_NIL;
     value string_meta = V_NIL;
 
+    // root table shapes, indexed by capacity
+    table<u32,table_shape*> root_shapes;
+    u32 num_shapes = 0;
+
     ~global_env();
 };
 
+// discard all memoized macro expansions
+void clear_macro_memos(global_env* G);
+
 // get the unique 32-bit identifier for a global variable. The variable will be
 // created and set to V_UNIN if necessary.
 u32 get_global_id(istate* S, symbol_id fqn);
@@ -173,6 +173,32 @@ struct alignas (OBJ_ALIGN) fn_subvec {
     u64 length;
 };
 
+// maximum number of keys a table can have before it leaves shape mode
+constexpr u32 MAX_SHAPE_KEYS = 64;
+// total number of shapes which may be created
+constexpr u32 MAX_TABLE_SHAPES = 1 << 16;
+
+// Tables whose keys are all symbols carry a shape describing the layout of their
+// data array. Since the hash table layout is determined entirely by the initial
+// capacity and the order in which keys were inserted, two tables with the same
+// shape hold the same keys in the same slots. This lets field accesses cache a
+// slot index per shape. Shapes form a transition tree rooted at an empty shape
+// for each initial capacity. They are owned by the global_env, not the GC.
+struct table_shape {
+    table_shape* parent;
+    // key added by the transition to this shape. V_UNIN for root shapes and
+    // shapes created by rehashing.
+    value key;
+    // index of key in the data array (even, since keys and values alternate)
+    u32 slot;
+    // capacity of tables with this shape
+    u32 cap;
+    u32 num_keys;
+    // transitions
+    table<symbol_id,table_shape*> add_key;
+    table_shape* rehash;
+};
+
 // hash tables
 struct alignas (OBJ_ALIGN) fn_table {
     gc_header h;
@@ -182,9 +208,15 @@ struct alignas (OBJ_ALIGN) fn_table {
     u32 cap;
     // size at which the table will be rehashed
     u32 rehash;
+    // incremented whenever an entry is added or changed. Used to validate
+    // method caches.
+    u32 version;
     // array of size 2*cap*sizeof(value) holding the table
     gc_bytes* data;
     value metatable;
+    // nullptr for tables in dictionary mode, i.e. tables with non-symbol keys
+    // or too many keys
+    table_shape* shape;
 };
 
 // A location storing a captured variable. These are shared across functions.
@@ -199,6 +231,8 @@ struct alignas(OBJ_ALIGN) upvalue_cell {
 
 struct istate;
 struct fn_namespace;
+struct jit_code;
+struct lazy_fun;
 
 // used to track the providence of the bytecode instructions within a function
 struct source_info {
@@ -210,10 +244,42 @@ struct source_info {
 };
 
 
+// for code inlined from another function (see NOTE: (Inlining) in
+// compile.cpp), the function it came from and where it was called
+struct inline_origin {
+    symbol_id name;
+    symbol_id filename;
+    // location of the outermost inlined call, in the enclosing function
+    source_loc call_loc;
+};
+
 // linked list used to associate instructions to source code locations
 struct code_info {
     u32 start_addr;
     source_loc loc;
+    bool inlined;
+    inline_origin origin;
+};
+
+// number of entries in the polymorphic inline cache at each method call site
+constexpr u32 METHOD_CACHE_WAYS = 4;
+
+// An inline cache entry for a method call site. The entry is valid if the
+// receiver's metatable is identical to the cached one and its version hasn't
+// changed. Empty entries have a nil metatable.
+struct method_cache_entry {
+    value metatable;
+    value method;
+    u32 version;
+};
+
+// An inline cache for a constant-key field access. Valid when the table has the
+// cached shape, in which case the key is at data[slot]. The hash of the key is
+// computed when the stub is created, for lookups in tables without a shape.
+struct field_cache_entry {
+    table_shape* shape;
+    u32 slot;
+    u64 hash;
 };
 
 // a stub describing a function
@@ -227,7 +293,8 @@ struct alignas(OBJ_ALIGN) function_stub {
     u8 num_params;      // # of parameters
     u8 num_opt;         // # of optional params (i.e. of initforms)
     bool vari;          // variadic parameter
-    u8 space;           // stack space required
+    bool simple;        // no optional or variadic params (and not foreign)
+    u16 space;          // stack space required
 
     symbol_id ns_id;                   // namespace ID
 
@@ -243,8 +310,12 @@ struct alignas(OBJ_ALIGN) function_stub {
     u32 num_sub_funs;                  // contained functions
     function_stub** sub_funs;
     u32 num_upvals;                    // upvals
+    u32 num_flat_upvals;               // flat upvals
     // Array of upvalue addresses. These are stack addresses for direct upvalues
-    // and upvalue IDs for indirect upvalues.
+    // and upvalue IDs for indirect upvalues. The num_upvals upvalue cells come
+    // first, followed by the flat upvalues, whose values are copied into the
+    // function object when it's created. An indirect flat upvalue is copied
+    // from a flat upvalue of the enclosing function.
     u8* upvals;
     // Corresponding array telling whether each upvalue is direct or not. An
     // upval is considered direct if it is from the immediately surrounding call
@@ -253,6 +324,28 @@ struct alignas(OBJ_ALIGN) function_stub {
     // source code locations
     u32 ci_length;
     code_info* ci_arr;
+    // method call inline caches, METHOD_CACHE_WAYS entries per call site
+    u32 num_method_caches;
+    method_cache_entry* method_caches;
+    // field access inline caches, one per call site
+    u32 num_field_caches;
+    field_cache_entry* field_caches;
+    // number of times the function has been entered, and its native code once
+    // it's been compiled by the JIT
+    u32 jit_count;
+    jit_code* jit;
+    // for macros which the compiler found to be pure, an ID identifying the
+    // macro's code, used to memoize its expansions. Otherwise 0.
+    u64 memo_id;
+    // an ID for the function's code, which guard-global compares against to
+    // check that a global still holds the function some code was compiled for
+    // (see NOTE: (Guarded globals) in compile.cpp). Builtins use a hash of
+    // their name. 0 if the function can't be guarded on.
+    u64 code_id;
+    // for functions that haven't been compiled yet, their source. The stub
+    // is then a placeholder with no code, and sub_funs[0] holds the compiled
+    // stub once the function has been called (see NOTE: (Lazy compilation)).
+    lazy_fun* lazy;
 };
 
 // get the location of an instruction based on the code_info array in the
@@ -266,6 +359,7 @@ struct alignas (OBJ_ALIGN) fn_function {
     function_stub* stub;
     upvalue_cell** upvals;
     value* init_vals;
+    value* flat_upvals;
 };
 
 // symbols in fn are represented by a 32-bit unsigned ids
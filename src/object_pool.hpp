@@ -21,30 +21,26 @@ private:
     // we can actually embed the free list into the block directly. (This is why
     // we require that sizeof(T) >= sizeof(void*)
     T* first_free;
+    // number of objects in first_block that have never been handed out. These
+    // aren't on the free list. Instead they're taken in order, so that a new
+    // block isn't written to (or even paged in, for big objects like gc cards)
+    // until its objects are actually used.
+    u32 num_fresh;
 
-    // Allocate another block for the pool. This works perfectly fine, but it's
-    // absolutely vile.
+    // Allocate another block for the pool.
     T* new_block() {
         auto res = (T*)aligned_alloc(alignof(T), (1 + block_size)*sizeof(T));
         ((void**)res)[0] = nullptr;
-
-        auto objs = &res[1];
-        for (u32 i = 0; i < block_size-1; ++i) {
-            // store the pointer to objs[i+1] in objs[i]
-            *(void**)(&objs[i]) = &objs[i + 1];
-        }
-        // look at those casts. C++ is screaming at me not to do this
-        *(void**)(&objs[block_size - 1]) = nullptr;
         return res;
     }
 
 public:
     object_pool(u32 block_size=128)
         : block_size{block_size}
-        , first_free{nullptr} {
+        , first_free{nullptr}
+        , num_fresh{block_size} {
         static_assert(sizeof(T) >= sizeof(void*));
         first_block = new_block();
-        first_free = &first_block[1];
     }
     ~object_pool() {
         while (first_block != nullptr) {
@@ -57,16 +53,19 @@ public:
     // get a new object. THIS DOES NOT INVOKE new; you must use placement new on
     // the returned pointer.
     T* new_object() {
-        if (first_free == nullptr) {
+        if (first_free != nullptr) {
+            auto res = first_free;
+            // *first_free is actually a pointer to the next free position
+            first_free = *((T**)first_free);
+            return res;
+        }
+        if (num_fresh == 0) {
             auto tmp = first_block;
             first_block = new_block();
             ((T**)first_block)[0] = tmp;
-            first_free = &first_block[1];
+            num_fresh = block_size;
         }
-        auto res = first_free;
-        // *first_free is actually a pointer to the next free position
-        first_free = *((T**)first_free);
-        return res;
+        return &first_block[1 + block_size - num_fresh--];
     }
     // free an object within the pool. THIS DOES NOT INVOKE THE DESTRUCTOR. You
     // must do that yourself.
@@ -0,0 +1,524 @@
+#include "profile.hpp"
+
+#include "bytes.hpp"
+#include "gc.hpp"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sys/time.h>
+#include <vector>
+
+namespace fn {
+
+// this must list a name for every opcode, in order
+static const char* op_names[] = {
+    "nop",
+    "pop",
+    "local",
+    "set-local",
+    "copy",
+    "upvalue",
+    "set-upvalue",
+    "flat-upvalue",
+    "closure",
+    "close",
+    "close-from",
+    "global",
+    "set-global",
+    "obj-get",
+    "obj-set",
+    "get-field",
+    "set-field",
+    "macro",
+    "set-macro",
+    "callm",
+    "tcallm",
+    "const",
+    "nil",
+    "no",
+    "yes",
+    "add",
+    "sub",
+    "mul",
+    "eq",
+    "lt",
+    "le",
+    "gt",
+    "ge",
+    "add-int",
+    "sub-int",
+    "mul-int",
+    "add-float",
+    "sub-float",
+    "mul-float",
+    "lt-int",
+    "le-int",
+    "gt-int",
+    "ge-int",
+    "jump",
+    "cjump",
+    "guard-int",
+    "guard-self",
+    "guard-global",
+    "call",
+    "tcall",
+    "call-known",
+    "tcall-known",
+    "call-foreign",
+    "apply",
+    "tapply",
+    "return",
+    "local2",
+    "local-const",
+    "global-local",
+    "local-get-field",
+    "eq-cjump",
+    "lt-cjump",
+    "le-cjump",
+    "gt-cjump",
+    "ge-cjump",
+    "lt-int-cjump",
+    "le-int-cjump",
+    "gt-int-cjump",
+    "ge-int-cjump",
+    "import",
+    "list",
+    "table"
+};
+static_assert(sizeof(op_names)/sizeof(const char*) == OP_TABLE + 1,
+        "op_names is out of sync with OPCODES");
+
+const char* op_name(u8 op) {
+    if (op > OP_TABLE) {
+        return "<unrecognized>";
+    }
+    return op_names[op];
+}
+
+#ifdef FN_PROFILE_OPS
+
+void enable_op_profile(istate* S) {
+    if (S->op_prof) {
+        return;
+    }
+    auto P = new op_profile;
+    P->overhead = (u64)-1;
+    for (u32 i = 0; i < 100; ++i) {
+        auto t = read_cycles();
+        auto d = read_cycles() - t;
+        if (d < P->overhead) {
+            P->overhead = d;
+        }
+    }
+    S->op_prof = P;
+}
+
+// average sampled cycles for op, or -1 if there are no samples
+static f64 avg_cycles(op_profile* P, u32 op) {
+    if (P->samples[op] == 0) {
+        return -1;
+    }
+    f64 res = (f64)P->cycles[op] / P->samples[op] - P->overhead;
+    return res < 0 ? 0 : res;
+}
+
+// opcodes which were executed, most frequent first
+static std::vector<u32> sorted_ops(op_profile* P) {
+    std::vector<u32> res;
+    for (u32 op = 0; op < 256; ++op) {
+        if (P->count[op] > 0) {
+            res.push_back(op);
+        }
+    }
+    std::sort(res.begin(), res.end(), [P](u32 a, u32 b) {
+        return P->count[a] > P->count[b];
+    });
+    return res;
+}
+
+// executed opcode pairs (as indices into P->pairs), most frequent first
+static std::vector<u32> sorted_pairs(op_profile* P) {
+    std::vector<u32> res;
+    for (u32 i = 0; i < 256*256; ++i) {
+        if (P->pairs[i] > 0) {
+            res.push_back(i);
+        }
+    }
+    std::sort(res.begin(), res.end(), [P](u32 a, u32 b) {
+        return P->pairs[a] > P->pairs[b];
+    });
+    return res;
+}
+
+// number of instruction pairs to show in the printed report
+constexpr u32 REPORT_PAIRS = 25;
+
+// column heading for a histogram bucket, giving its lowest cycle count
+static string bucket_label(u32 b) {
+    if (b == 0) {
+        return "0";
+    }
+    u64 lo = (u64)1 << b;
+    auto res = lo >= 1024 ? std::to_string(lo / 1024) + "k"
+        : std::to_string(lo);
+    return b == OP_CYCLE_BUCKETS - 1 ? res + "+" : res;
+}
+
+// print the cycle histograms of the sampled opcodes in ops, leaving out
+// buckets which are empty for all of them
+static void print_cycle_histograms(op_profile* P, const std::vector<u32>& ops,
+        std::ostream& out) {
+    u32 lo = OP_CYCLE_BUCKETS;
+    u32 hi = 0;
+    for (auto op : ops) {
+        for (u32 b = 0; b < OP_CYCLE_BUCKETS; ++b) {
+            if (P->hist[op * OP_CYCLE_BUCKETS + b] > 0) {
+                lo = std::min(lo, b);
+                hi = std::max(hi, b);
+            }
+        }
+    }
+    if (lo > hi) {
+        return;
+    }
+    out << "\nSampled cycles per opcode, by log2 bucket:\n";
+    out << std::left << std::setw(18) << "opcode" << std::right;
+    for (u32 b = lo; b <= hi; ++b) {
+        out << std::setw(8) << bucket_label(b);
+    }
+    out << '\n';
+    for (auto op : ops) {
+        if (P->samples[op] == 0) {
+            continue;
+        }
+        out << std::left << std::setw(18) << op_name(op) << std::right;
+        for (u32 b = lo; b <= hi; ++b) {
+            out << std::setw(8) << P->hist[op * OP_CYCLE_BUCKETS + b];
+        }
+        out << '\n';
+    }
+}
+
+void print_op_profile(istate* S, std::ostream& out) {
+    auto P = S->op_prof;
+    if (!P) {
+        return;
+    }
+    u64 total = 0;
+    // estimated total cycles, weighting each opcode's average by its count
+    f64 total_cycles = 0;
+    for (u32 op = 0; op < 256; ++op) {
+        total += P->count[op];
+        if (P->samples[op] > 0) {
+            total_cycles += avg_cycles(P, op) * P->count[op];
+        }
+    }
+    auto ops = sorted_ops(P);
+    auto flags = out.flags();
+    out << "Opcode profile: " << total << " instructions\n";
+    out << std::left << std::setw(18) << "opcode" << std::right
+        << std::setw(14) << "count" << std::setw(8) << "%"
+        << std::setw(12) << "cycles/op" << std::setw(10) << "%cycles"
+        << '\n';
+    out << std::fixed << std::setprecision(1);
+    for (auto op : ops) {
+        out << std::left << std::setw(18) << op_name(op) << std::right
+            << std::setw(14) << P->count[op]
+            << std::setw(8) << 100.0 * P->count[op] / total;
+        auto avg = avg_cycles(P, op);
+        if (avg < 0) {
+            out << std::setw(12) << "-" << std::setw(10) << "-";
+        } else {
+            out << std::setw(12) << avg
+                << std::setw(10) << 100.0 * avg * P->count[op] / total_cycles;
+        }
+        out << '\n';
+    }
+    print_cycle_histograms(P, ops, out);
+
+    auto pairs = sorted_pairs(P);
+    out << "\nMost frequent instruction pairs:\n";
+    for (u32 i = 0; i < pairs.size() && i < REPORT_PAIRS; ++i) {
+        auto name = string{op_name(pairs[i] / 256)} + " "
+            + op_name(pairs[i] % 256);
+        out << std::left << std::setw(32) << name << std::right
+            << std::setw(14) << P->pairs[pairs[i]]
+            << std::setw(8) << 100.0 * P->pairs[pairs[i]] / total << '\n';
+    }
+    out.flags(flags);
+}
+
+bool write_op_profile_json(istate* S, const string& path) {
+    auto P = S->op_prof;
+    if (!P) {
+        return false;
+    }
+    std::ofstream out{path};
+    if (!out) {
+        return false;
+    }
+    out << "{\n  \"timer_overhead\": " << P->overhead << ",\n  \"ops\": [";
+    bool first = true;
+    for (auto op : sorted_ops(P)) {
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "    {\"op\": \"" << op_name(op) << "\", \"count\": "
+            << P->count[op] << ", \"samples\": " << P->samples[op]
+            << ", \"cycles\": " << P->cycles[op] << ", \"histogram\": [";
+        for (u32 b = 0; b < OP_CYCLE_BUCKETS; ++b) {
+            out << (b == 0 ? "" : ", ") << P->hist[op * OP_CYCLE_BUCKETS + b];
+        }
+        out << "]}";
+    }
+    out << "\n  ],\n  \"pairs\": [";
+    first = true;
+    for (auto i : sorted_pairs(P)) {
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "    {\"first\": \"" << op_name(i / 256)
+            << "\", \"second\": \"" << op_name(i % 256)
+            << "\", \"count\": " << P->pairs[i] << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
+
+#endif
+
+
+// number of slots in the sample table. Must be a power of 2.
+constexpr u32 PROFILE_TABLE_SIZE = 1 << 16;
+// bytes of folded stack text that can be stored
+constexpr u32 PROFILE_ARENA_SIZE = 1 << 24;
+// longest folded stack recorded for a single sample, in bytes
+constexpr u32 PROFILE_MAX_STACK = 8192;
+// deeper call stacks only have their innermost frames recorded
+constexpr u32 PROFILE_MAX_DEPTH = 256;
+// call frames reserved in advance, so few samples land while S->frames is
+// being reallocated
+constexpr u32 PROFILE_FRAME_RESERVE = 1 << 14;
+
+// a distinct stack in the sample table
+struct sample_entry {
+    u64 hash;
+    u64 count;
+    // location of the folded stack in the arena. length is 0 for empty slots.
+    u32 offset;
+    u32 length;
+};
+
+struct sample_profiler {
+    istate* S;
+    sample_entry* table;
+    char* arena;
+    u32 arena_used;
+    u64 samples;
+    // samples whose stack didn't fit in the table or arena
+    u64 dropped;
+    struct sigaction old_action;
+};
+
+static sample_profiler* profiler = nullptr;
+
+static void free_profiler(sample_profiler* P) {
+    free(P->table);
+    free(P->arena);
+    delete P;
+}
+
+// writes folded stack text into a fixed buffer, truncating when it's full
+struct folded_writer {
+    char* buf;
+    u32 len;
+    u32 cap;
+
+    void put(char c) {
+        if (len < cap) {
+            buf[len++] = c;
+        }
+    }
+    // semicolons separate frames, so they're replaced in names
+    void str(const char* s, u32 n) {
+        for (u32 i = 0; i < n; ++i) {
+            put(s[i] == ';' ? '_' : s[i]);
+        }
+    }
+    void num(u32 n) {
+        char tmp[10];
+        u32 i = 0;
+        do {
+            tmp[i++] = '0' + n % 10;
+            n /= 10;
+        } while (n > 0);
+        while (i > 0) {
+            put(tmp[--i]);
+        }
+    }
+};
+
+// write a frame label like "name (file.fn:12)". If pc is nonzero, it's the
+// return address of a call and gives the line. Otherwise the line is where the
+// function is defined.
+static void write_frame(folded_writer& w, function_stub* stub, u32 pc) {
+    if (stub->name && stub->name->size > 0) {
+        w.str((const char*)stub->name->data, stub->name->size);
+    } else {
+        w.str("<anonymous>", 11);
+    }
+    if (stub->foreign || stub->ci_length == 0) {
+        return;
+    }
+    auto line = pc > 0 ? instr_loc(stub, pc - 1)->loc.line
+        : stub->ci_arr[0].loc.line;
+    w.str(" (", 2);
+    if (stub->filename) {
+        // only the last path component
+        auto name = (const char*)stub->filename->data;
+        u32 start = 0;
+        for (u32 i = 0; i < stub->filename->size; ++i) {
+            if (name[i] == '/') {
+                start = i + 1;
+            }
+        }
+        w.str(name + start, stub->filename->size - start);
+    }
+    w.put(':');
+    w.num(line);
+    w.put(')');
+}
+
+// add a sample to the table
+static void record_sample(sample_profiler* P, const char* buf, u32 len) {
+    ++P->samples;
+    // FNV-1a
+    u64 h = 14695981039346656037ull;
+    for (u32 i = 0; i < len; ++i) {
+        h = (h ^ (u8)buf[i]) * 1099511628211ull;
+    }
+    auto mask = PROFILE_TABLE_SIZE - 1;
+    for (u32 i = h & mask, n = 0; n < PROFILE_TABLE_SIZE; i = (i + 1) & mask,
+                 ++n) {
+        auto& e = P->table[i];
+        if (e.length == 0) {
+            if (P->arena_used + len > PROFILE_ARENA_SIZE) {
+                break;
+            }
+            memcpy(&P->arena[P->arena_used], buf, len);
+            e.hash = h;
+            e.count = 1;
+            e.offset = P->arena_used;
+            e.length = len;
+            P->arena_used += len;
+            return;
+        } else if (e.hash == h && e.length == len
+                && memcmp(&P->arena[e.offset], buf, len) == 0) {
+            ++e.count;
+            return;
+        }
+    }
+    ++P->dropped;
+}
+
+static void profile_handler(int) {
+    auto P = profiler;
+    if (!P) {
+        return;
+    }
+    auto S = P->S;
+    char buf[PROFILE_MAX_STACK];
+    folded_writer w{buf, 0, PROFILE_MAX_STACK};
+    if (S->alloc->collecting) {
+        w.str("[gc]", 4);
+    } else if (!S->callee || S->growing_frames) {
+        w.str("[runtime]", 9);
+    } else {
+        u32 n = S->frames.size;
+        u32 start = 0;
+        if (n > PROFILE_MAX_DEPTH) {
+            start = n - PROFILE_MAX_DEPTH;
+            w.str("[truncated]", 11);
+            w.put(';');
+        }
+        for (u32 i = start; i < n; ++i) {
+            auto& f = S->frames[i];
+            write_frame(w, f.callee->stub, f.pc);
+            w.put(';');
+        }
+        write_frame(w, S->callee->stub, 0);
+    }
+    record_sample(P, buf, w.len);
+}
+
+// set the profiling timer. An interval of 0 stops it.
+static bool set_profile_timer(u32 usec) {
+    struct itimerval t;
+    t.it_interval.tv_sec = usec / 1000000;
+    t.it_interval.tv_usec = usec % 1000000;
+    t.it_value = t.it_interval;
+    return setitimer(ITIMER_PROF, &t, nullptr) == 0;
+}
+
+bool start_profiler(istate* S) {
+    if (profiler) {
+        return false;
+    }
+    auto P = new sample_profiler;
+    P->S = S;
+    P->table = (sample_entry*)calloc(PROFILE_TABLE_SIZE, sizeof(sample_entry));
+    P->arena = (char*)malloc(PROFILE_ARENA_SIZE);
+    P->arena_used = 0;
+    P->samples = 0;
+    P->dropped = 0;
+    S->frames.ensure_capacity(PROFILE_FRAME_RESERVE);
+    profiler = P;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &P->old_action) != 0) {
+        profiler = nullptr;
+        free_profiler(P);
+        return false;
+    }
+    if (!set_profile_timer(PROFILE_INTERVAL_US)) {
+        sigaction(SIGPROF, &P->old_action, nullptr);
+        profiler = nullptr;
+        free_profiler(P);
+        return false;
+    }
+    return true;
+}
+
+bool stop_profiler(istate* S, const string& path) {
+    auto P = profiler;
+    if (!P || P->S != S) {
+        return false;
+    }
+    set_profile_timer(0);
+    sigaction(SIGPROF, &P->old_action, nullptr);
+    profiler = nullptr;
+
+    std::ofstream out{path};
+    if (out) {
+        for (u32 i = 0; i < PROFILE_TABLE_SIZE; ++i) {
+            auto& e = P->table[i];
+            if (e.length > 0) {
+                out.write(&P->arena[e.offset], e.length);
+                out << ' ' << e.count << '\n';
+            }
+        }
+        if (P->dropped > 0) {
+            out << "[dropped] " << P->dropped << '\n';
+        }
+    }
+    bool res = out.good();
+    free_profiler(P);
+    return res;
+}
+
+}
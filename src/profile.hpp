@@ -0,0 +1,161 @@
+// profile.hpp -- instrumentation for profiling Fn programs
+#ifndef __FN_PROFILE_HPP
+#define __FN_PROFILE_HPP
+
+#include "config.h"
+
+#include "base.hpp"
+#include "istate.hpp"
+
+#include <ostream>
+
+#ifdef FN_PROFILE_OPS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
+
+namespace fn {
+
+// gives the name of an opcode, as printed by the disassembler
+const char* op_name(u8 op);
+
+#ifdef FN_PROFILE_OPS
+
+// NOTE: (Opcode profiler). Builds configured with FN_PROFILE_OPS count every
+// instruction dispatched by execute_fun() once S->op_prof is set (which the fn
+// --profile-ops flag does). Besides per-opcode counts, this records how often
+// each opcode is followed by each other opcode, and samples the cycles spent
+// on about one out of every OP_SAMPLE_PERIOD instructions. The gaps between
+// samples are randomized so that loops whose length divides the period don't
+// get some instructions sampled and others not at all. A sample runs from an
+// instruction's dispatch to the next dispatch, so it includes the dispatch
+// overhead, and samples for calls and returns include whatever native code
+// runs in between. The cost of reading the timer itself is measured when the
+// profiler is enabled and subtracted in the report. The JIT is disabled in
+// these builds, since native code bypasses the dispatch loop.
+//
+// Averages hide cache misses and slow paths, so each opcode also gets a log2
+// histogram of its samples. Bucket b counts samples which took from 2^b up to
+// 2^(b+1) cycles after the timer overhead is taken out. Bucket 0 also holds
+// samples under 1 cycle, and the last bucket holds everything longer.
+
+// must be a power of 2
+constexpr u32 OP_SAMPLE_PERIOD = 64;
+// number of buckets in each opcode's cycle histogram
+constexpr u32 OP_CYCLE_BUCKETS = 16;
+
+struct op_profile {
+    u64 count[256] = {0};
+    // pairs[a*256+b] counts b executing right after a
+    u64 pairs[256*256] = {0};
+    // sampled cycles and number of samples for each opcode
+    u64 cycles[256] = {0};
+    u64 samples[256] = {0};
+    // hist[op*OP_CYCLE_BUCKETS+b] counts samples of op in bucket b
+    u64 hist[256*OP_CYCLE_BUCKETS] = {0};
+
+    // previously dispatched opcode
+    u8 prev_op = 0;
+    bool have_prev = false;
+    // sample in progress
+    bool sampling = false;
+    u8 sample_op = 0;
+    u64 sample_start = 0;
+    // instructions until the next sample, and random state used to pick it
+    u32 countdown = OP_SAMPLE_PERIOD;
+    u32 rand = 0x9e3779b9;
+    // cycles taken by back-to-back timer reads
+    u64 overhead = 0;
+};
+
+// read the CPU timestamp counter, or a nanosecond clock if there isn't one
+inline u64 read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// histogram bucket for a sample of the given number of cycles
+inline u32 cycle_bucket(u64 cycles) {
+    if (cycles < 2) {
+        return 0;
+    }
+    u32 b = 63 - __builtin_clzll(cycles);
+    return b < OP_CYCLE_BUCKETS ? b : OP_CYCLE_BUCKETS - 1;
+}
+
+// record the dispatch of op. Called from the interpreter loop.
+inline void profile_op(op_profile* P, u8 op) {
+    if (P->sampling) {
+        auto d = read_cycles() - P->sample_start;
+        P->cycles[P->sample_op] += d;
+        ++P->samples[P->sample_op];
+        d = d > P->overhead ? d - P->overhead : 0;
+        ++P->hist[P->sample_op * OP_CYCLE_BUCKETS + cycle_bucket(d)];
+        P->sampling = false;
+    }
+    ++P->count[op];
+    if (P->have_prev) {
+        ++P->pairs[P->prev_op * 256 + op];
+    }
+    P->prev_op = op;
+    P->have_prev = true;
+    if (--P->countdown == 0) {
+        // xorshift32
+        P->rand ^= P->rand << 13;
+        P->rand ^= P->rand >> 17;
+        P->rand ^= P->rand << 5;
+        P->countdown = 1 + (P->rand & (2 * OP_SAMPLE_PERIOD - 1));
+        P->sampling = true;
+        P->sample_op = op;
+        P->sample_start = read_cycles();
+    }
+}
+
+// start counting instructions executed by S
+void enable_op_profile(istate* S);
+// print a report sorted by instruction count
+void print_op_profile(istate* S, std::ostream& out);
+// write the profile as JSON. Returns false if the file can't be written.
+bool write_op_profile_json(istate* S, const string& path);
+
+#endif
+
+// NOTE: (Sampling profiler). fn --profile sets an ITIMER_PROF timer, and the
+// SIGPROF handler records the Fn call stack at each tick. The stack is read
+// from S->frames, which holds the suspended callers for both the interpreter's
+// own calls and the calls made from native code through icall(), followed by
+// the current function S->callee. Callers are labeled with the line of their
+// call instruction. The running function's pc lives in a register, so it's
+// labeled with the line where it's defined. Samples taken during garbage
+// collection are recorded as [gc], and those taken outside any Fn function
+// (e.g. while compiling) or while S->frames is being reallocated as [runtime].
+// push_frame() in vm.cpp sets S->growing_frames around the reallocation and
+// writes each frame before counting it, so the handler never reads freed or
+// half-written frames.
+//
+// The handler can't allocate, so stacks are written as folded strings into a
+// fixed-size arena and counted in a fixed-size hash table. Once either fills
+// up, new distinct stacks are dropped. Nothing is checked in the interpreter,
+// so there's no cost when the profiler isn't running. Only one istate can be
+// profiled at a time.
+
+// time between samples in microseconds
+constexpr u32 PROFILE_INTERVAL_US = 1000;
+
+// start sampling S. Returns false if the profiler is already running or the
+// timer can't be set.
+bool start_profiler(istate* S);
+// stop sampling and write the samples to path in the folded stack format read
+// by flamegraph.pl. Returns false if the file can't be written.
+bool stop_profiler(istate* S, const string& path);
+
+}
+
+#endif
@@ -20,6 +20,9 @@ using sst_id = u32;
 struct scanner_string_table {
     dyn_array<string> by_id;
     table<string,sst_id> by_name;
+    // symbol IDs of the strings plus one, or 0 where they haven't been looked
+    // up yet. Filled in by the compiler.
+    dyn_array<u32> syms;
 };
 
 sst_id scanner_intern(scanner_string_table& pt, const string& str);
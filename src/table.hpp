@@ -39,7 +39,9 @@ private:
             array[i].live = false;
         }
 
-        // insert the old data, deleting old entries as we go
+        // insert the old data, deleting old entries as we go. insert() counts
+        // the entries again.
+        size = 0;
         for (u32 i=0; i<old_cap; ++i) {
             if (prev[i].live) {
                 insert(prev[i].key, prev[i].val);
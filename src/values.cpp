@@ -189,7 +189,7 @@ static value* find_table_slot(fn_table* tab, value k) {
         }
     }
     // restart search from the beginning of the tree
-    for (u32 i = 0; i < start; ++i) {
+    for (u32 i = 0; i < start; i += 2) {
         if (data[i] == V_UNIN
                 || data[i] == k) {
             return &data[i];
@@ -199,7 +199,10 @@ static value* find_table_slot(fn_table* tab, value k) {
 }
 
 value* table_get(fn_table* tab, value k) {
-    auto h = hash(k);
+    return table_get_hashed(tab, k, hash(k));
+}
+
+value* table_get_hashed(fn_table* tab, value k, u64 h) {
     auto m = 2 * tab->cap;
     auto start = 2 * (h % tab->cap);
     auto data = (value*)tab->data->data;
@@ -211,7 +214,7 @@ value* table_get(fn_table* tab, value k) {
         }
     }
     // restart search from the beginning of the tree
-    for (u32 i = 0; i < start; ++i) {
+    for (u32 i = 0; i < start; i += 2) {
         if (data[i] == V_UNIN) {
             return nullptr;
         } else if (data[i] == k) {
@@ -233,17 +236,74 @@ value* table_get_linear(fn_table* tab, value k) {
 }
 
 
+static table_shape* new_table_shape(istate* S, table_shape* parent,
+        value key, u32 slot, u32 cap, u32 num_keys) {
+    if (S->G->num_shapes >= MAX_TABLE_SHAPES) {
+        return nullptr;
+    }
+    ++S->G->num_shapes;
+    return new table_shape{
+        .parent = parent,
+        .key = key,
+        .slot = slot,
+        .cap = cap,
+        .num_keys = num_keys,
+        .add_key = {},
+        .rehash = nullptr
+    };
+}
+
+table_shape* root_table_shape(istate* S, u32 cap) {
+    auto x = S->G->root_shapes.get2(cap);
+    if (x) {
+        return x->val;
+    }
+    auto res = new_table_shape(S, nullptr, V_UNIN, 0, cap, 0);
+    if (res) {
+        S->G->root_shapes.insert(cap, res);
+    }
+    return res;
+}
+
+// shape transition for a table that was just rehashed
+static table_shape* rehash_transition(istate* S, table_shape* shape) {
+    if (!shape->rehash) {
+        shape->rehash = new_table_shape(S, shape, V_UNIN, 0, 2*shape->cap,
+                shape->num_keys);
+    }
+    return shape->rehash;
+}
+
+// shape transition for adding a new key to a table. slot must be the position
+// where the key was inserted.
+static table_shape* add_key_transition(istate* S, table_shape* shape, value k,
+        u32 slot) {
+    if (!vis_symbol(k) || shape->num_keys >= MAX_SHAPE_KEYS) {
+        return nullptr;
+    }
+    auto x = shape->add_key.get2(vsymbol(k));
+    if (x) {
+        return x->val;
+    }
+    auto res = new_table_shape(S, shape, k, slot, shape->cap,
+            shape->num_keys + 1);
+    if (res) {
+        shape->add_key.insert(vsymbol(k), res);
+    }
+    return res;
+}
+
 void table_insert(istate* S, u32 table_pos, u32 key_pos, u32 val_pos) {
     auto tab = vtable(S->stack[table_pos]);
     // grow the table if necessary. This uses a 3/4 threshold
     if (tab->size >= tab->rehash) {
         auto old_cap = tab->cap;
-        tab->cap = 2 * tab->cap;
-        tab->rehash = tab->cap * 3 / 4;
-        auto new_data = alloc_gc_bytes(S, 2*tab->cap*sizeof(value));
+        auto new_data = alloc_gc_bytes(S, 4*old_cap*sizeof(value));
         // allocation may trigger garbage collection and move the table we were
         // just working on
         tab = vtable(S->stack[table_pos]);
+        tab->cap = 2 * old_cap;
+        tab->rehash = tab->cap * 3 / 4;
         auto old_arr = (value*)tab->data->data;
         tab->data = new_data;
         write_guard(get_gc_card_header(&tab->h), &new_data->h);
@@ -262,14 +322,26 @@ void table_insert(istate* S, u32 table_pos, u32 key_pos, u32 val_pos) {
                 auto x = find_table_slot(tab, old_arr[i]);
                 x[0] = old_arr[i];
                 x[1] = old_arr[i+1];
+                ++tab->size;
             }
         }
+        if (tab->shape) {
+            tab->shape = rehash_transition(S, tab->shape);
+        }
     }
     auto k = S->stack[key_pos];
     auto v = S->stack[val_pos];
     auto x = find_table_slot(tab, k);
+    if (x[0] == V_UNIN) {
+        ++tab->size;
+        if (tab->shape) {
+            tab->shape = add_key_transition(S, tab->shape, k,
+                    x - (value*)tab->data->data);
+        }
+    }
     x[0] = k;
     x[1] = v;
+    ++tab->version;
     // set the dirty bit
     auto card = get_gc_card_header(&tab->h);
     if (vhas_header(k)) {
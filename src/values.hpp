@@ -83,14 +83,8 @@ inline gc_header* vheader(value v) {
 
 // creating values
 inline value vbox_int(i32 v) {
-    union {
-        u64 raw;
-        i32 i;
-    } u;
-    u.i = v;
-    value res = { .raw = u.raw << 5 };
-    res.raw = (res.raw & ~TAG_MASK) | TAG_INT;
-    return res;
+    // zero-extend so that equal ints always have the same representation
+    return { .raw = ((u64)(u32)v << 5) | TAG_INT };
 }
 inline value vbox_float(f64 v) {
     value res = { .f = v };
@@ -250,9 +244,14 @@ inline bool vequal(value a, value b) {
 // returns an array of two values, key followed by value, which should not be
 // freed
 value* table_get(fn_table* tab, value k);
+// same as table_get() with h = hash(k) already computed
+value* table_get_hashed(fn_table* tab, value k, u64 h);
 // get an element by doing linear probing. This is faster for small tables
 value* table_get_linear(fn_table* tab, value k);
 void table_insert(istate* S, u32 table_pos, u32 key_pos, u32 val_pos);
+// get the shape of an empty table with the given capacity. Returns nullptr if
+// the shape limit has been reached.
+table_shape* root_table_shape(istate* S, u32 cap);
 
 value get_metatable(istate* S, value obj);
 string type_string(value v);
@@ -5,9 +5,12 @@
 #include "alloc.hpp"
 #include "bytes.hpp"
 #include "gc.hpp"
+#include "jit.hpp"
 #include "namespace.hpp"
+#include "profile.hpp"
 #include "values.hpp"
 
+#include <atomic>
 #include <cstdlib>
 #include <iomanip>
 #include <iostream>
@@ -21,16 +24,36 @@ namespace fn {
 // multiple times.
 #define cur_fun() (vfunction(S->stack[S->bp-1]))
 
-#define code_byte(S, where) (S->callee->stub->code[where])
-#define code_short(S, where) (*((u16*)&S->callee->stub->code[where]))
-#define code_u32(S, where) (*((u32*)&S->callee->stub->code[where]))
-// #define code_byte(S, where) (S->code[where])
-// #define code_short(S, where) (*((u16*)&S->code[where]))
-// #define code_u32(S, where) (*((u32*)&S->code[where]))
+// these read from the code pointer cached in execute_fun()
+#define code_byte(where) (code[where])
+#define code_short(where) (*((u16*)&code[where]))
+#define code_u32(where) (*((u32*)&code[where]))
+#define code_u64(where) (*((u64*)&code[where]))
 
 #define push(S, v) S->stack[S->sp] = v;++S->sp;
 #define peek(S, i) (S->stack[S->sp-((i))-1])
 
+// save the caller's state in S->frames. The sampling profiler reads the frames
+// from its signal handler, so each one is written before the size is bumped,
+// and growing_frames tells it not to look while the array is reallocated.
+static inline void push_frame(istate* S, fn_function* callee, u32 bp, u32 pc) {
+    auto& frames = S->frames;
+    if (frames.size == frames.capacity) {
+        S->growing_frames = 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        frames.ensure_capacity(frames.size + 1);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        S->growing_frames = 0;
+    }
+    frames.data[frames.size] = call_frame{
+        .callee = callee,
+        .bp = bp,
+        .pc = pc
+    };
+    std::atomic_signal_fence(std::memory_order_release);
+    ++frames.size;
+}
+
 static void add_trace_frame(istate* S, fn_function* callee, u32 pc) {
     S->stack_trace.push_back(
             trace_frame{
@@ -103,6 +126,90 @@ static inline bool get_method(istate* S, value obj, value key, u32 place) {
     return true;
 }
 
+// Like get_method(), but using the inline cache for a method call site in the
+// current function. On a miss, the new entry goes to the front of the cache,
+// replacing any stale entry for the same metatable or else the oldest entry.
+static inline bool get_method_cached(istate* S, value obj, value key,
+        u16 cache_id, u32 place) {
+    auto m = get_metatable(S, obj);
+    if (!vis_table(m)) {
+        return false;
+    }
+    auto tab = vtable(m);
+    auto stub = S->callee->stub;
+    auto c = &stub->method_caches[cache_id * METHOD_CACHE_WAYS];
+    u32 i;
+    for (i = 0; i < METHOD_CACHE_WAYS; ++i) {
+        if (vsame(c[i].metatable, m) && c[i].version == tab->version) {
+            S->stack[place] = c[i].method;
+            return true;
+        }
+    }
+    auto x = table_get(tab, key);
+    if (!x) {
+        return false;
+    }
+    for (i = 0; i < METHOD_CACHE_WAYS - 1; ++i) {
+        if (vsame(c[i].metatable, m)) {
+            break;
+        }
+    }
+    for (; i > 0; --i) {
+        c[i] = c[i-1];
+    }
+    c[0] = method_cache_entry{m, x[1], tab->version};
+    auto card = get_gc_card_header(&stub->h);
+    write_guard(card, vheader(m));
+    if (vhas_header(x[1])) {
+        write_guard(card, vheader(x[1]));
+    }
+    S->stack[place] = x[1];
+    return true;
+}
+
+// slow path for OP_GET_FIELD. Replaces the table on top of the stack with the
+// value for key, updating the inline cache if the table has a shape.
+static void get_field(istate* S, value key, field_cache_entry* cache) {
+    auto tab = vtable(peek(S, 0));
+    auto x = table_get_hashed(tab, key, cache->hash);
+    if (x) {
+        if (tab->shape) {
+            cache->shape = tab->shape;
+            cache->slot = x - (value*)tab->data->data;
+        }
+        S->stack[S->sp - 1] = x[1];
+    } else {
+        S->stack[S->sp - 1] = V_NIL;
+    }
+}
+
+// slow path for OP_SET_FIELD. Expects the table and new value on top of the
+// stack and leaves the value.
+static void set_field(istate* S, value key, u16 cache_id) {
+    push(S, key);
+    table_insert(S, S->sp - 3, S->sp - 1, S->sp - 2);
+    --S->sp;
+    auto tab = vtable(peek(S, 1));
+    if (tab->shape) {
+        // the stub might have moved during table_insert()
+        auto cache = &S->callee->stub->field_caches[cache_id];
+        cache->shape = tab->shape;
+        cache->slot = table_get(tab, key) - (value*)tab->data->data;
+    }
+    S->stack[S->sp - 2] = peek(S, 0);
+    --S->sp;
+}
+
+// raise an error for access to an undefined global variable
+static void global_error(istate* S, u32 id) {
+    if (id >= S->G->def_ids.size) {
+        ierror(S, "Global variable with invalid ID.\n");
+    } else {
+        ierror(S, "Failed to find global variable " +
+                symname(S, S->G->def_ids[id]));
+    }
+}
+
 static inline bool arrange_call_stack(istate* S, u32 n) {
     auto num_params = S->callee->stub->num_params;
     auto num_opt = S->callee->stub->num_opt;
@@ -166,414 +273,1297 @@ static inline void foreign_call(istate* S, fn_function* fun, u32 n, u32 pc) {
 }
 
 // unroll a list on top of the stack (i.e. place its elements in order on the
-// stack). Returns the length of the list
-static inline u32 unroll_list(istate* S) {
-    u32 n = 0;
+// stack). Adds the length of the list to *n. Returns false and sets an error if
+// the stack can't hold the list.
+static inline bool unroll_list(istate* S, u32* n) {
     while (peek(S,0) != V_EMPTY) {
+        // leave a spare slot in case a self argument needs to be inserted
+        if (S->sp + 2 > S->stack_size && !grow_stack(S, S->sp + 2)) {
+            return false;
+        }
         push(S, vtail(peek(S, 0)));
         S->stack[S->sp - 2] = vhead(S->stack[S->sp - 2]);
-        ++n;
+        ++*n;
     }
     --S->sp;
-    return n;
+    return true;
 }
 
-static void icall(istate* S, u32 n, u32 pc) {
-    // update the call frame
-    auto callee = peek(S, n);
+// Find the function to call for a call with n arguments whose callee is at
+// peek(S, n). Symbols and tables are resolved through method lookup, which may
+// insert a self argument and update *n. Returns nullptr and sets an error on
+// failure.
+static fn_function* resolve_callee(istate* S, u32* n, u32 pc) {
+    auto callee = peek(S, *n);
     while (!vis_function(callee)) {
         if (vis_symbol(callee)) {
             // method call
-            if (n == 0) {
+            if (*n == 0) {
                 add_trace_frame(S, S->callee, pc);
                 ierror(S, "Method call requires a self argument.");
-                return;
+                return nullptr;
             }
-            if (!get_method(S, peek(S, n-1), callee, S->sp - n - 1)) {
+            if (!get_method(S, peek(S, *n-1), callee, S->sp - *n - 1)) {
                 add_trace_frame(S, S->callee, pc);
                 ierror(S, "Method lookup failed.");
-                return;
+                return nullptr;
             }
         } else if (vis_table(callee)) {
             u32 i;
-            for (i = 0; i < n; ++i) {
+            for (i = 0; i < *n; ++i) {
                 S->stack[S->sp - i] = S->stack[S->sp - i - 1];
             }
             ++S->sp;
-            ++n;
+            ++*n;
             if (!get_method(S, callee,
                             vbox_symbol(cached_sym(S, SC___CALL)),
-                            S->sp - n - 1)) {
+                            S->sp - *n - 1)) {
                 add_trace_frame(S, S->callee, pc);
                 ierror(S, "Method lookup failed.");
-                return;
+                return nullptr;
             }
         } else {
             add_trace_frame(S, S->callee, pc);
             ierror(S, "Cannot call provided value.");
-            return;
+            return nullptr;
         }
-        callee = peek(S, n);
+        callee = peek(S, *n);
     }
-
-    auto fun = vfunction(callee);
-    // FIXME: ensure minimum stack space available
-    if (fun->stub->foreign) {
-        if (S->sp + n + FOREIGN_MIN_STACK >= STACK_SIZE) {
+    if (vfunction(callee)->stub->lazy) {
+        // compile the function on its first call (see NOTE: (Lazy
+        // compilation) in compile.cpp)
+        if ((S->sp + FOREIGN_MIN_STACK > S->stack_size
+                        && !grow_stack(S, S->sp + FOREIGN_MIN_STACK))
+                || !compile_lazy(S, S->sp - *n - 1)) {
             add_trace_frame(S, S->callee, pc);
-            ierror(S, "Not enough stack space for call.");
-            return;
+            return nullptr;
         }
-        foreign_call(S, fun, n, pc);
-    } else {
-        auto save_bp = S->bp;
-        bool restore_callee = S->callee;
-        S->callee = fun;
-        S->bp = S->sp - n;
-        if (S->bp + fun->stub->space >= STACK_SIZE) {
-            // Can't complete function call for lack of stack space
-            add_trace_frame(S, vfunction(S->stack[save_bp-1]), S->pc);
-            ierror(S, "Not enough stack space for call.");
-            return;
+        callee = peek(S, *n);
+    }
+    return vfunction(callee);
+}
+
+static inline bool call_foreign(istate* S, fn_function* fun, u32 n, u32 pc) {
+    if (S->sp + FOREIGN_MIN_STACK > S->stack_size
+            && !grow_stack(S, S->sp + FOREIGN_MIN_STACK)) {
+        add_trace_frame(S, S->callee, pc);
+        return false;
+    }
+    foreign_call(S, fun, n, pc);
+    return !has_error(S);
+}
+
+// set up the stack, base pointer, and callee to begin executing a Fn function.
+// The caller's state must be saved beforehand.
+static inline bool enter_fun(istate* S, fn_function* fun, u32 n, u32 pc) {
+    auto caller = S->callee;
+    S->bp = S->sp - n;
+    // space includes everything the function pushes, so this is the only stack
+    // check needed until the next call
+    if (S->bp + fun->stub->space > S->stack_size
+            && !grow_stack(S, S->bp + fun->stub->space)) {
+        add_trace_frame(S, caller, pc);
+        return false;
+    }
+    S->callee = fun;
+    if (!(fun->stub->simple && n == fun->stub->num_params)
+            && !arrange_call_stack(S, n)) {
+        add_trace_frame(S, caller, pc);
+        return false;
+    }
+    return true;
+}
+
+// call a function from outside the interpreter loop (i.e. from the API or a
+// foreign function). This starts a new activation of execute_fun().
+static void icall(istate* S, u32 n, u32 pc) {
+    auto fun = resolve_callee(S, &n, pc);
+    if (!fun) {
+        return;
+    }
+    if (fun->stub->foreign) {
+        call_foreign(S, fun, n, pc);
+        return;
+    }
+    auto save_bp = S->bp;
+    auto save_callee = S->callee;
+    // the caller gets a call frame like the interpreter's own calls, so the
+    // whole Fn call stack can be found in S->frames. This also keeps the
+    // caller up to date if the garbage collector moves it.
+    if (save_callee) {
+        push_frame(S, save_callee, save_bp, pc);
+    }
+    if (!enter_fun(S, fun, n, pc)) {
+        if (save_callee) {
+            S->frames.pop();
         }
-        if (!arrange_call_stack(S, n)) {
+        return;
+    }
+    execute_fun(S);
+    if (save_callee) {
+        save_callee = S->frames[S->frames.size - 1].callee;
+        S->frames.pop();
+    }
+    if (has_error(S)) {
+        if (save_callee) {
+            // notice we add the stack trace for the calling function, not the
+            // callee. The callee is added at the error origin
+            add_trace_frame(S, save_callee, pc);
             return;
         }
-        execute_fun(S);
-        if (has_error(S)) {
-            if (restore_callee) {
-                // notice we add the stack trace for the calling function, not
-                // the callee. The callee is added at the error origin
-                add_trace_frame(S, vfunction(S->stack[save_bp-1]), pc);
-                return;
-            }
-        }
-        // return value
-        S->stack[S->bp-1] = peek(S, 0);
-        S->sp = S->bp;  // with the return value, this is the new stack pointer
-        S->bp = save_bp;
-        S->callee = restore_callee ? vfunction(S->stack[save_bp - 1]) : nullptr;
     }
+    // return value
+    S->stack[S->bp-1] = peek(S, 0);
+    S->sp = S->bp;  // with the return value, this is the new stack pointer
+    S->bp = save_bp;
+    S->callee = save_callee;
 }
 
 void call(istate* S, u8 n) {
     icall(S, n, 0);
 }
 
-static inline bool tail_call(istate* S, u8 n, u32* pc) {
-    auto callee = peek(S, n);
-    while (!vis_function(callee)) {
-        if (vis_symbol(callee)) {
-            // method call
-            if (n == 0) {
-                add_trace_frame(S, S->callee, *pc);
-                ierror(S, "Method call requires a self argument.");
-                return false;
-            }
-            if (!get_method(S, peek(S, n-1), callee, S->sp - n - 1)) {
-                add_trace_frame(S, S->callee, *pc);
-                ierror(S, "Method lookup failed.");
-                return false;
-            }
-        } else if (vis_table(callee)) {
-            u32 i;
-            for (i = 0; i < n; ++i) {
-                S->stack[S->sp - i] = S->stack[S->sp - i - 1];
-            }
-            ++S->sp;
-            ++n;
-            if (!get_method(S, callee,
-                            vbox_symbol(cached_sym(S, SC___CALL)),
-                            S->sp - n - 1)) {
-                add_trace_frame(S, S->callee, *pc);
-                ierror(S, "Method lookup failed.");
-                return false;
-            }
-        } else {
-            add_trace_frame(S, S->callee, *pc);
-            ierror(S, "Cannot call provided value.");
-            return false;
-        }
-        callee = peek(S, n);
+static inline bool tail_call(istate* S, u32 n, u32* pc) {
+    // *pc is past the instruction. Like other errors, ones from the call are
+    // reported at a pc inside it.
+    auto where = *pc - 1;
+    auto fun = resolve_callee(S, &n, where);
+    if (!fun) {
+        return false;
     }
-
-    auto fun = vfunction(callee);
     if (fun->stub->foreign) {
-        foreign_call(S, fun, n, *pc);
-        return true;
+        return call_foreign(S, fun, n, where);
+    }
+    auto caller = S->callee;
+    if (S->bp + fun->stub->space > S->stack_size
+            && !grow_stack(S, S->bp + fun->stub->space)) {
+        add_trace_frame(S, caller, where);
+        return false;
     }
     // set these so the GC can't get 'em before we're done
     S->callee = fun;
-    S->stack[S->bp - 1] = callee;
+    S->stack[S->bp - 1] = vbox_function(fun);
     close_upvals(S, S->bp);
     // move the new call information to the base pointer
     for (u32 i = 0; i < n; ++i) {
         S->stack[S->bp + i] = S->stack[S->sp - n + i];
     }
     S->sp = S->bp + n;
-    if (!arrange_call_stack(S, n)) {
+    if (!(fun->stub->simple && n == fun->stub->num_params)
+            && !arrange_call_stack(S, n)) {
+        add_trace_frame(S, caller, where);
         return false;
     }
     *pc = 0;
     return true;
 }
 
+#ifdef FN_JIT
+// runtime routines for native code (see NOTE (Baseline JIT) in jit.hpp). These
+// mirror the corresponding instruction handlers in execute_fun() below.
+
+void jit_upvalue(istate* S, u32 i) {
+    auto u = S->callee->upvals[i];
+    if (u->closed) {
+        push(S, u->datum.val);
+    } else {
+        push(S, S->stack[u->datum.pos]);
+    }
+}
+
+void jit_set_upvalue(istate* S, u32 i) {
+    auto u = S->callee->upvals[i];
+    auto v = peek(S, 0);
+    if (u->closed) {
+        u->datum.val = v;
+        if (vhas_header(v)) {
+            write_guard(get_gc_card_header(&u->h), vheader(v));
+        }
+    } else {
+        S->stack[u->datum.pos] = v;
+    }
+    --S->sp;
+}
+
+void jit_closure(istate* S, u32 fid) {
+    create_fun(S, S->bp - 1, fid);
+}
+
+void jit_close(istate* S, u32 n) {
+    auto new_sp = S->sp - n;
+    close_upvals(S, new_sp);
+    S->stack[new_sp] = peek(S, 0);
+    S->sp = new_sp + 1;
+}
+
+void jit_close_from(istate* S, u32 i) {
+    close_upvals(S, S->bp + i);
+}
+
+void jit_global_error(istate* S, u32 id, u32 pc) {
+    add_trace_frame(S, S->callee, pc);
+    global_error(S, id);
+}
+
+void jit_set_global(istate* S, u32 id) {
+    S->G->def_arr[id] = peek(S, 0);
+    S->stack[S->sp - 1] = V_NIL;
+}
+
+bool jit_obj_get(istate* S, u32 pc) {
+    if (!vis_table(peek(S, 1))) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, "obj-get target is not a table.");
+        return false;
+    }
+    auto x = table_get(vtable(peek(S, 1)), peek(S, 0));
+    S->sp -= 2;
+    if (x) {
+        push(S, x[1]);
+    } else {
+        push(S, V_NIL);
+    }
+    return true;
+}
+
+bool jit_obj_set(istate* S, u32 pc) {
+    if (!vis_table(peek(S, 2))) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, "obj-set target is not a table.");
+        return false;
+    }
+    table_insert(S, S->sp - 3, S->sp - 2, S->sp - 1);
+    S->stack[S->sp - 3] = peek(S, 0);
+    S->sp -= 2;
+    return true;
+}
+
+bool jit_get_field(istate* S, u32 cid, u32 cache_id, u32 pc) {
+    auto obj = peek(S, 0);
+    if (!vis_table(obj)) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, "obj-get target is not a table.");
+        return false;
+    }
+    auto tab = vtable(obj);
+    auto cache = &S->callee->stub->field_caches[cache_id];
+    if (tab->shape && tab->shape == cache->shape) {
+        S->stack[S->sp - 1] = ((value*)tab->data->data)[cache->slot + 1];
+    } else {
+        get_field(S, S->callee->stub->const_arr[cid], cache);
+    }
+    return true;
+}
+
+bool jit_set_field(istate* S, u32 cid, u32 cache_id, u32 pc) {
+    auto obj = peek(S, 1);
+    if (!vis_table(obj)) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, "obj-set target is not a table.");
+        return false;
+    }
+    auto tab = vtable(obj);
+    auto cache = &S->callee->stub->field_caches[cache_id];
+    if (tab->shape && tab->shape == cache->shape) {
+        auto v = peek(S, 0);
+        ((value*)tab->data->data)[cache->slot + 1] = v;
+        ++tab->version;
+        if (vhas_header(v)) {
+            write_guard(get_gc_card_header(&tab->h), vheader(v));
+        }
+        S->stack[S->sp - 2] = v;
+        --S->sp;
+    } else {
+        set_field(S, S->callee->stub->const_arr[cid], cache_id);
+    }
+    return true;
+}
+
+bool jit_macro(istate* S, u32 cid, u32 pc) {
+    auto fqn = vsymbol(S->callee->stub->const_arr[cid]);
+    auto x = S->G->macro_tab.get2(fqn);
+    if (!x) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, "Failed to find global variable " + (*S->symtab)[fqn]);
+        return false;
+    }
+    push(S, vbox_function(x->val));
+    return true;
+}
+
+void jit_set_macro(istate* S, u32 cid) {
+    auto fqn = S->callee->stub->const_arr[cid];
+    set_macro(S, vsymbol(fqn), vfunction(peek(S, 0)));
+    S->stack[S->sp - 1] = S->callee->stub->const_arr[cid];
+}
+
+void jit_list(istate* S, u32 n) {
+    pop_to_list(S, n);
+}
+
+bool jit_arith(istate* S, u32 op, u32 pc) {
+    auto x = peek(S, 1);
+    auto y = peek(S, 0);
+    const char* name = op == OP_ADD ? "+" : op == OP_SUB ? "-" : "*";
+    if (!vis_number(x) || !vis_number(y)) {
+        add_trace_frame(S, S->callee, pc);
+        ierror(S, std::string{"Argument to "} + name + " not a number.");
+        return false;
+    }
+    if (vis_int(x) && vis_int(y)) {
+        auto a = (u32)vint(x);
+        auto b = (u32)vint(y);
+        auto res = op == OP_ADD ? a + b : op == OP_SUB ? a - b : a * b;
+        S->stack[S->sp - 2] = vbox_int((i32)res);
+    } else {
+        auto a = vcast_float(x);
+        auto b = vcast_float(y);
+        auto res = op == OP_ADD ? a + b : op == OP_SUB ? a - b : a * b;
+        S->stack[S->sp - 2] = vbox_float(res);
+    }
+    --S->sp;
+    return true;
+}
+
+i32 jit_compare(istate* S, u32 op, u32 pc) {
+    auto x = peek(S, 1);
+    auto y = peek(S, 0);
+    S->sp -= 2;
+    if (op == OP_EQ) {
+        return vsame(x, y) || (!(vis_int(x) && vis_int(y)) && x == y);
+    }
+    if (!vis_number(x) || !vis_number(y)) {
+        S->sp += 2;
+        add_trace_frame(S, S->callee, pc);
+        const char* name = op == OP_LT ? "<" : op == OP_LE ? "<="
+            : op == OP_GT ? ">" : ">=";
+        ierror(S, std::string{"Arguments to "} + name + " not a number.");
+        return -1;
+    }
+    f64 a, b;
+    if (vis_int(x) && vis_int(y)) {
+        a = vint(x);
+        b = vint(y);
+    } else {
+        a = vcast_float(x);
+        b = vcast_float(y);
+    }
+    switch (op) {
+    case OP_LT:
+        return a < b;
+    case OP_LE:
+        return a <= b;
+    case OP_GT:
+        return a > b;
+    default:
+        return a >= b;
+    }
+}
+#endif
+
+// The interpreter loop keeps the code pointer, stack pointer, and base pointer
+// in local variables. sp is written back to the istate before anything outside
+// the loop looks at the stack (calls, allocation, errors), and the code and
+// stack pointers are reloaded afterwards, since the garbage collector may have
+// moved the stub and calls may have reallocated the stack.
+#define vm_push(v) stack[sp++] = v
+#define vm_peek(i) (stack[sp-((i))-1])
+#define vm_save() S->sp = sp
+#define vm_load() do {                          \
+        stack = S->stack;                       \
+        sp = S->sp;                             \
+        bp = S->bp;                             \
+        code = S->callee->stub->code;           \
+    } while (0)
+// used to leave execute_fun() early on error
+#define vm_fail() goto unwind
+// binary operations backing the arithmetic builtins. These must agree with the
+// builtins: ints stay ints (wrapping on overflow) unless a float is involved.
+#define vm_arith(op, name) do {                                         \
+        auto x = vm_peek(1);                                            \
+        auto y = vm_peek(0);                                            \
+        if (vis_int(x) && vis_int(y)) {                                 \
+            stack[sp-2] = vbox_int((i32)((u32)vint(x) op (u32)vint(y))); \
+        } else if (vis_number(x) && vis_number(y)) {                    \
+            stack[sp-2] = vbox_float(vcast_float(x) op vcast_float(y)); \
+        } else {                                                        \
+            add_trace_frame(S, S->callee, pc - 1);                      \
+            ierror(S, "Argument to " name " not a number.");            \
+            vm_fail();                                                  \
+        }                                                               \
+        --sp;                                                           \
+    } while (0)
+// evaluate a numeric comparison of the top two stack elements into the bool
+// res, popping them off
+#define vm_compare(res, op, name) do {                                  \
+        auto x = vm_peek(1);                                            \
+        auto y = vm_peek(0);                                            \
+        if (vis_int(x) && vis_int(y)) {                                 \
+            res = vint(x) op vint(y);                                   \
+        } else if (vis_number(x) && vis_number(y)) {                    \
+            res = vcast_float(x) op vcast_float(y);                     \
+        } else {                                                        \
+            add_trace_frame(S, S->callee, pc - 1);                      \
+            ierror(S, "Arguments to " name " not a number.");           \
+            vm_fail();                                                  \
+        }                                                               \
+        sp -= 2;                                                        \
+    } while (0)
+// typed versions of the above for operands whose types the compiler proved
+#define vm_arith_int(op) do {                                           \
+        stack[sp-2] = vbox_int((i32)((u32)vint(vm_peek(1))              \
+                        op (u32)vint(vm_peek(0))));                     \
+        --sp;                                                           \
+    } while (0)
+#define vm_arith_float(op) do {                                         \
+        stack[sp-2] = vbox_float(vcast_float(vm_peek(1))                \
+                op vcast_float(vm_peek(0)));                            \
+        --sp;                                                           \
+    } while (0)
+#define vm_compare_int(res, op) do {                                    \
+        res = vint(vm_peek(1)) op vint(vm_peek(0));                     \
+        sp -= 2;                                                        \
+    } while (0)
+// equality test, also popping the arguments
+#define vm_equal(res) do {                                              \
+        auto x = vm_peek(1);                                            \
+        auto y = vm_peek(0);                                            \
+        if (vsame(x, y)) {                                              \
+            res = true;                                                 \
+        } else if (vis_int(x) && vis_int(y)) {                          \
+            res = false;                                                \
+        } else {                                                        \
+            res = x == y;                                               \
+        }                                                               \
+        sp -= 2;                                                        \
+    } while (0)
+// read the operands of call-known, tcall-known, or call-foreign into argc and
+// insert the global variable's value below the arguments
+#define vm_known_callee() do {                                          \
+        auto v = S->G->def_arr[code_u32(pc)];                           \
+        if (v == V_UNIN) {                                              \
+            add_trace_frame(S, S->callee, pc - 1);                      \
+            global_error(S, code_u32(pc));                              \
+            vm_fail();                                                  \
+        }                                                               \
+        argc = code_byte(pc + 4);                                       \
+        pc += 5;                                                        \
+        for (u32 i = 0; i < argc; ++i) {                                \
+            stack[sp - i] = stack[sp - i - 1];                          \
+        }                                                               \
+        stack[sp - argc] = v;                                           \
+        ++sp;                                                           \
+    } while (0)
+// conditional jump with the offset at pc. Jumps if c is false.
+#define vm_cjump(c) do {                                                \
+        if (!(c)) {                                                     \
+            auto u = code_short(pc);                                    \
+            pc += 2 + *((i16*)&u);                                      \
+        } else {                                                        \
+            pc += 2;                                                    \
+        }                                                               \
+    } while (0)
+
+// count the instruction at pc (see NOTE (Opcode profiler) in profile.hpp)
+#ifdef FN_PROFILE_OPS
+#define vm_profile() if (S->op_prof) { profile_op(S->op_prof, code[pc]); }
+#else
+#define vm_profile()
+#endif
+
+#ifdef FN_COMPUTED_GOTO
+// direct threaded dispatch using the GNU labels-as-values extension. Every
+// instruction jumps straight to the handler for the next one, which gives each
+// handler its own indirect branch for the predictor to work with.
+#define vm_case(op) lbl_##op
+#define vm_next() {                             \
+        vm_profile();                           \
+        goto *dispatch_table[code[pc++]];       \
+    }
+#else
+#define vm_case(op) case op
+#define vm_next() continue
+#endif
+
+#ifdef FN_JIT
+// vm_enter() dispatches after entering a function at pc 0, counting the entry
+// for the JIT. vm_resume() dispatches after a call returns, switching back to
+// native code if the function has any.
+#define vm_enter() if (jit_enter(S, S->callee->stub)) { goto native; } vm_next()
+#define vm_resume() if (S->callee->stub->jit) { goto native; } vm_next()
+#else
+#define vm_enter() vm_next()
+#define vm_resume() vm_next()
+#endif
+
+#ifdef FN_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 void execute_fun(istate* S) {
+#ifdef FN_COMPUTED_GOTO
+    // this must list a label for every opcode, in order
+    static void* dispatch_table[] = {
+        &&lbl_OP_NOP,
+        &&lbl_OP_POP,
+        &&lbl_OP_LOCAL,
+        &&lbl_OP_SET_LOCAL,
+        &&lbl_OP_COPY,
+        &&lbl_OP_UPVALUE,
+        &&lbl_OP_SET_UPVALUE,
+        &&lbl_OP_FLAT_UPVALUE,
+        &&lbl_OP_CLOSURE,
+        &&lbl_OP_CLOSE,
+        &&lbl_OP_CLOSE_FROM,
+        &&lbl_OP_GLOBAL,
+        &&lbl_OP_SET_GLOBAL,
+        &&lbl_OP_OBJ_GET,
+        &&lbl_OP_OBJ_SET,
+        &&lbl_OP_GET_FIELD,
+        &&lbl_OP_SET_FIELD,
+        &&lbl_OP_MACRO,
+        &&lbl_OP_SET_MACRO,
+        &&lbl_OP_CALLM,
+        &&lbl_OP_TCALLM,
+        &&lbl_OP_CONST,
+        &&lbl_OP_NIL,
+        &&lbl_OP_NO,
+        &&lbl_OP_YES,
+        &&lbl_OP_ADD,
+        &&lbl_OP_SUB,
+        &&lbl_OP_MUL,
+        &&lbl_OP_EQ,
+        &&lbl_OP_LT,
+        &&lbl_OP_LE,
+        &&lbl_OP_GT,
+        &&lbl_OP_GE,
+        &&lbl_OP_ADD_INT,
+        &&lbl_OP_SUB_INT,
+        &&lbl_OP_MUL_INT,
+        &&lbl_OP_ADD_FLOAT,
+        &&lbl_OP_SUB_FLOAT,
+        &&lbl_OP_MUL_FLOAT,
+        &&lbl_OP_LT_INT,
+        &&lbl_OP_LE_INT,
+        &&lbl_OP_GT_INT,
+        &&lbl_OP_GE_INT,
+        &&lbl_OP_JUMP,
+        &&lbl_OP_CJUMP,
+        &&lbl_OP_GUARD_INT,
+        &&lbl_OP_GUARD_SELF,
+        &&lbl_OP_GUARD_GLOBAL,
+        &&lbl_OP_CALL,
+        &&lbl_OP_TCALL,
+        &&lbl_OP_CALL_KNOWN,
+        &&lbl_OP_TCALL_KNOWN,
+        &&lbl_OP_CALL_FOREIGN,
+        &&lbl_OP_APPLY,
+        &&lbl_OP_TAPPLY,
+        &&lbl_OP_RETURN,
+        &&lbl_OP_LOCAL2,
+        &&lbl_OP_LOCAL_CONST,
+        &&lbl_OP_GLOBAL_LOCAL,
+        &&lbl_OP_LOCAL_GET_FIELD,
+        &&lbl_OP_EQ_CJUMP,
+        &&lbl_OP_LT_CJUMP,
+        &&lbl_OP_LE_CJUMP,
+        &&lbl_OP_GT_CJUMP,
+        &&lbl_OP_GE_CJUMP,
+        &&lbl_OP_LT_INT_CJUMP,
+        &&lbl_OP_LE_INT_CJUMP,
+        &&lbl_OP_GT_INT_CJUMP,
+        &&lbl_OP_GE_INT_CJUMP,
+        &&lbl_OP_IMPORT,
+        &&lbl_OP_LIST,
+        &&lbl_OP_TABLE
+    };
+    static_assert(sizeof(dispatch_table)/sizeof(void*) == OP_TABLE + 1,
+            "dispatch_table is out of sync with OPCODES");
+#endif
+
     u32 pc = 0;
+    u8* code;
+    u32 sp, bp;
+    value* stack;
+    vm_load();
+    // frames below this belong to other activations of execute_fun()
+    u32 base_frame = S->frames.size;
+    // argument count and function used for shared call handling
+    u32 argc;
+    fn_function* fun;
+
+#ifdef FN_JIT
+    if (jit_enter(S, S->callee->stub)) {
+        goto native;
+    }
+#endif
     // main interpreter loop
+#ifdef FN_COMPUTED_GOTO
+    vm_next();
+    {
+        {
+#else
     while (true) {
-        switch (code_byte(S, pc++)) {
-        case OP_NOP:
-            break;
-        case OP_POP:
-            --S->sp;
-            break;
-        case OP_LOCAL:
-            push(S, S->stack[S->bp + code_byte(S, pc++)]);
-            break;
-        case OP_SET_LOCAL:
-            S->stack[S->bp+code_byte(S, pc++)] = peek(S, 0);
-            --S->sp;
-            break;
-        case OP_COPY:
-            push(S, S->stack[S->sp - code_byte(S, pc++) - 1]);
-            break;
-        case OP_UPVALUE: {
-            auto u = S->callee->upvals[code_byte(S, pc++)];
+        vm_profile();
+        switch (code[pc++]) {
+#endif
+        vm_case(OP_NOP):
+            vm_next();
+        vm_case(OP_POP):
+            --sp;
+            vm_next();
+        vm_case(OP_LOCAL):
+            vm_push(stack[bp + code_byte(pc++)]);
+            vm_next();
+        vm_case(OP_SET_LOCAL):
+            stack[bp + code_byte(pc++)] = vm_peek(0);
+            --sp;
+            vm_next();
+        vm_case(OP_COPY): {
+            auto v = stack[sp - code_byte(pc++) - 1];
+            vm_push(v);
+        }
+            vm_next();
+        vm_case(OP_UPVALUE): {
+            auto u = S->callee->upvals[code_byte(pc++)];
             if (u->closed) {
-                push(S, u->datum.val);
+                vm_push(u->datum.val);
             } else {
-                push(S, S->stack[u->datum.pos]);
+                vm_push(stack[u->datum.pos]);
             }
         }
-            break;
-        case OP_SET_UPVALUE: {
-            auto u = S->callee->upvals[code_byte(S, pc++)];
+            vm_next();
+        vm_case(OP_SET_UPVALUE): {
+            auto u = S->callee->upvals[code_byte(pc++)];
             if (u->closed) {
-                u->datum.val = peek(S, 0);
-                if (vhas_header(peek(S, 0))) {
-                    write_guard(get_gc_card_header(&u->h), vheader(peek(S,0)));
+                u->datum.val = vm_peek(0);
+                if (vhas_header(vm_peek(0))) {
+                    write_guard(get_gc_card_header(&u->h),
+                            vheader(vm_peek(0)));
                 }
             } else {
-                S->stack[u->datum.pos] = peek(S, 0);
+                stack[u->datum.pos] = vm_peek(0);
             }
-            --S->sp;
+            --sp;
         }
-            break;
-        case OP_CLOSURE: {
-            auto fid = code_short(S, pc);
+            vm_next();
+        vm_case(OP_FLAT_UPVALUE):
+            vm_push(S->callee->flat_upvals[code_byte(pc++)]);
+            vm_next();
+        vm_case(OP_CLOSURE): {
+            auto fid = code_short(pc);
             pc += 2;
-            create_fun(S, S->bp-1, fid);
+            vm_save();
+            create_fun(S, bp-1, fid);
+            vm_load();
         }
-            break;
-        case OP_CLOSE: {
-            auto num = code_byte(S, pc++);
+            vm_next();
+        vm_case(OP_CLOSE): {
+            auto num = code_byte(pc++);
             // computes highest stack address to close
-            auto new_sp = S->sp - num;
+            auto new_sp = sp - num;
             close_upvals(S, new_sp);
-            S->stack[new_sp] = S->stack[S->sp-1];
-            S->sp = new_sp + 1;
+            stack[new_sp] = stack[sp-1];
+            sp = new_sp + 1;
         }
-            break;
-        case OP_GLOBAL: {
-            auto id = code_u32(S, pc);
+            vm_next();
+        vm_case(OP_CLOSE_FROM):
+            close_upvals(S, bp + code_byte(pc++));
+            vm_next();
+        vm_case(OP_GLOBAL): {
+            auto id = code_u32(pc);
             pc += 4;
             auto v = S->G->def_arr[id];
             if (v == V_UNIN) {
                 add_trace_frame(S, S->callee, pc - 5);
-                if (id >= S->G->def_ids.size) {
-                    ierror(S, "Global variable with invalid ID.\n");
-                } else {
-                    ierror(S, "Failed to find global variable " +
-                            symname(S, S->G->def_ids[id]));
-                }
-                return;
+                global_error(S, id);
+                vm_fail();
             }
-            push(S, v);
-
+            vm_push(v);
         }
-            break;
-        case OP_SET_GLOBAL: {
-            auto id = code_u32(S, pc);
+            vm_next();
+        vm_case(OP_SET_GLOBAL): {
+            auto id = code_u32(pc);
             pc += 4;
-            S->G->def_arr[id] = peek(S, 0);
-            S->stack[S->sp-1] = V_NIL;
+            S->G->def_arr[id] = vm_peek(0);
+            stack[sp-1] = V_NIL;
         }
-            break;
-        case OP_OBJ_GET: {
-            if (!vis_table(peek(S, 1))) {
+            vm_next();
+        vm_case(OP_OBJ_GET): {
+            if (!vis_table(vm_peek(1))) {
                 add_trace_frame(S, S->callee, pc - 1);
                 ierror(S, "obj-get target is not a table.");
-                return;
+                vm_fail();
             }
-            auto x = table_get(vtable(peek(S, 1)), peek(S, 0));
-            S->sp -= 2;
+            auto x = table_get(vtable(vm_peek(1)), vm_peek(0));
+            sp -= 2;
             if (x) {
-                push(S, x[1]);
+                vm_push(x[1]);
             } else {
-                push(S, V_NIL);
+                vm_push(V_NIL);
             }
         }
-            break;
-        case OP_OBJ_SET: {
-            if (!vis_table(peek(S, 2))) {
+            vm_next();
+        vm_case(OP_OBJ_SET): {
+            if (!vis_table(vm_peek(2))) {
                 add_trace_frame(S, S->callee, pc - 1);
                 ierror(S, "obj-set target is not a table.");
-                return;
+                vm_fail();
             }
-            table_insert(S, S->sp - 3, S->sp - 2, S->sp - 1);
-            S->stack[S->sp - 3] = peek(S, 0);
-            S->sp -= 2;
+            vm_save();
+            table_insert(S, sp - 3, sp - 2, sp - 1);
+            vm_load();
+            stack[sp - 3] = vm_peek(0);
+            sp -= 2;
         }
-            break;
-        case OP_MACRO: {
-            auto id = code_short(S, pc);
+            vm_next();
+        vm_case(OP_GET_FIELD):
+        field_get: {
+            auto obj = vm_peek(0);
+            if (!vis_table(obj)) {
+                add_trace_frame(S, S->callee, pc - 1);
+                ierror(S, "obj-get target is not a table.");
+                vm_fail();
+            }
+            auto tab = vtable(obj);
+            auto cache = &S->callee->stub->field_caches[code_short(pc + 2)];
+            if (tab->shape && tab->shape == cache->shape) {
+                stack[sp - 1] = ((value*)tab->data->data)[cache->slot + 1];
+            } else {
+                auto key = S->callee->stub->const_arr[code_short(pc)];
+                vm_save();
+                get_field(S, key, cache);
+            }
+            pc += 4;
+        }
+            vm_next();
+        vm_case(OP_SET_FIELD): {
+            auto obj = vm_peek(1);
+            if (!vis_table(obj)) {
+                add_trace_frame(S, S->callee, pc - 1);
+                ierror(S, "obj-set target is not a table.");
+                vm_fail();
+            }
+            auto tab = vtable(obj);
+            auto cache_id = code_short(pc + 2);
+            auto cache = &S->callee->stub->field_caches[cache_id];
+            if (tab->shape && tab->shape == cache->shape) {
+                // the key is already present, so this doesn't change the shape
+                auto v = vm_peek(0);
+                ((value*)tab->data->data)[cache->slot + 1] = v;
+                ++tab->version;
+                if (vhas_header(v)) {
+                    write_guard(get_gc_card_header(&tab->h), vheader(v));
+                }
+                stack[sp - 2] = v;
+                --sp;
+            } else {
+                auto key = S->callee->stub->const_arr[code_short(pc)];
+                vm_save();
+                set_field(S, key, cache_id);
+                vm_load();
+            }
+            pc += 4;
+        }
+            vm_next();
+        vm_case(OP_MACRO): {
+            auto id = code_short(pc);
             pc += 2;
             auto fqn = vsymbol(S->callee->stub->const_arr[id]);
             auto x = S->G->macro_tab.get2(fqn);
             if (!x) {
                 add_trace_frame(S, S->callee, pc - 3);
-                ierror(S, "Failed to find global variable " + (*S->symtab)[fqn]);
-                return;
+                ierror(S, "Failed to find global variable "
+                        + (*S->symtab)[fqn]);
+                vm_fail();
             }
-            push(S, vbox_function(x->val));
+            vm_push(vbox_function(x->val));
         }
-            break;
-        case OP_SET_MACRO: {
+            vm_next();
+        vm_case(OP_SET_MACRO): {
             // FIXME: check whether the new macro is a function and the name is
             // a symbol.
-            auto id = code_short(S, pc);
+            auto id = code_short(pc);
             pc += 2;
             auto fqn = S->callee->stub->const_arr[id];
-            set_macro(S, vsymbol(fqn), vfunction(peek(S, 0)));
-            S->stack[S->sp-1] = fqn;
+            vm_save();
+            set_macro(S, vsymbol(fqn), vfunction(vm_peek(0)));
+            vm_load();
+            stack[sp-1] = fqn;
         }
-            break;
-        case OP_CONST:
-            push(S, S->callee->stub->const_arr[code_short(S, pc)]);
+            vm_next();
+        vm_case(OP_CONST):
+            vm_push(S->callee->stub->const_arr[code_short(pc)]);
             pc += 2;
-            break;
-        case OP_NIL:
-            push(S, V_NIL);
-            break;
-        case OP_NO:
-            push(S, V_NO);
-            break;
-        case OP_YES:
-            push(S, V_YES);
-            break;
+            vm_next();
+        vm_case(OP_NIL):
+            vm_push(V_NIL);
+            vm_next();
+        vm_case(OP_NO):
+            vm_push(V_NO);
+            vm_next();
+        vm_case(OP_YES):
+            vm_push(V_YES);
+            vm_next();
+
+        vm_case(OP_ADD):
+            vm_arith(+, "+");
+            vm_next();
+        vm_case(OP_SUB):
+            vm_arith(-, "-");
+            vm_next();
+        vm_case(OP_MUL):
+            vm_arith(*, "*");
+            vm_next();
+        vm_case(OP_EQ): {
+            bool res;
+            vm_equal(res);
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_LT): {
+            bool res;
+            vm_compare(res, <, "<");
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_LE): {
+            bool res;
+            vm_compare(res, <=, "<=");
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_GT): {
+            bool res;
+            vm_compare(res, >, ">");
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_GE): {
+            bool res;
+            vm_compare(res, >=, ">=");
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_ADD_INT):
+            vm_arith_int(+);
+            vm_next();
+        vm_case(OP_SUB_INT):
+            vm_arith_int(-);
+            vm_next();
+        vm_case(OP_MUL_INT):
+            vm_arith_int(*);
+            vm_next();
+        vm_case(OP_ADD_FLOAT):
+            vm_arith_float(+);
+            vm_next();
+        vm_case(OP_SUB_FLOAT):
+            vm_arith_float(-);
+            vm_next();
+        vm_case(OP_MUL_FLOAT):
+            vm_arith_float(*);
+            vm_next();
+        vm_case(OP_LT_INT): {
+            bool res;
+            vm_compare_int(res, <);
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_LE_INT): {
+            bool res;
+            vm_compare_int(res, <=);
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_GT_INT): {
+            bool res;
+            vm_compare_int(res, >);
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
+        vm_case(OP_GE_INT): {
+            bool res;
+            vm_compare_int(res, >=);
+            vm_push(vbox_bool(res));
+        }
+            vm_next();
 
-        case OP_JUMP: {
-            auto u = code_short(S, pc);
+        vm_case(OP_JUMP): {
+            auto u = code_short(pc);
             pc += 2 + *((i16*)&u);
         }
-            break;
-        case OP_CJUMP:
-            if (!vtruth(peek(S, 0))) {
-                auto u = code_short(S, pc);
-                pc += 2 + *((i16*)&u);
+            // self tail calls jump back to the start of the function, which
+            // counts as entering it again
+            if (pc == 0) {
+                vm_enter();
+            }
+            vm_next();
+        vm_case(OP_CJUMP): {
+            auto c = vtruth(vm_peek(0));
+            --sp;
+            vm_cjump(c);
+        }
+            vm_next();
+        vm_case(OP_GUARD_INT):
+            if (vis_int(stack[bp + code_byte(pc)])) {
+                pc += 3;
             } else {
-                pc += 2;
+                auto u = code_short(pc + 1);
+                pc += 3 + *((i16*)&u);
             }
-            --S->sp;
-            break;
-        case OP_CALL:
-            icall(S, code_byte(S, pc), pc - 1);
-            pc++;
-            if (has_error(S)) {
-                return;
+            vm_next();
+        vm_case(OP_GUARD_SELF): {
+            auto v = S->G->def_arr[code_u32(pc)];
+            if (vis_function(v) && vfunction(v) == S->callee) {
+                pc += 6;
+            } else {
+                auto u = code_short(pc + 4);
+                pc += 6 + *((i16*)&u);
             }
-            break;
-        case OP_TCALL:
-            if (!tail_call(S, code_byte(S, pc++), &pc)) {
-                add_trace_frame(S, S->callee, pc - 1);
-                return;
+        }
+            vm_next();
+        vm_case(OP_GUARD_GLOBAL): {
+            auto v = S->G->def_arr[code_u32(pc)];
+            if (vis_function(v)
+                    && vfunction(v)->stub->code_id == code_u64(pc + 4)) {
+                pc += 14;
+            } else {
+                auto u = code_short(pc + 12);
+                pc += 14 + *((i16*)&u);
             }
-            break;
-        case OP_CALLM: {
-            auto num_args = code_byte(S, pc++);
-            auto sym = peek(S, num_args);
-            auto tab = peek(S, num_args-1);
-            if (!get_method(S, tab, sym, S->sp - num_args - 1)) {
-                add_trace_frame(S, S->callee, pc - 2);
-                ierror(S, "Method lookup failed.");
-                return;
+        }
+            vm_next();
+        vm_case(OP_CALL):
+            argc = code_byte(pc++);
+            goto call;
+        vm_case(OP_TCALL):
+            vm_save();
+            if (!tail_call(S, code_byte(pc++), &pc)) {
+                vm_fail();
             }
-            icall(S, num_args, pc - 2);
-            if (has_error(S)) {
-                return;
+            vm_load();
+            if (pc == 0) {
+                vm_enter();
+            }
+            vm_next();
+        vm_case(OP_CALL_KNOWN):
+            vm_known_callee();
+            // the global may have been redefined
+            if (!vis_function(vm_peek(argc))) {
+                goto call;
+            }
+            fun = vfunction(vm_peek(argc));
+            vm_save();
+            goto call_fun;
+        vm_case(OP_TCALL_KNOWN):
+            vm_known_callee();
+            vm_save();
+            if (!tail_call(S, argc, &pc)) {
+                vm_fail();
+            }
+            vm_load();
+            if (pc == 0) {
+                vm_enter();
+            }
+            vm_next();
+        vm_case(OP_CALL_FOREIGN):
+            vm_known_callee();
+            if (!vis_function(vm_peek(argc))
+                    || !vfunction(vm_peek(argc))->stub->foreign) {
+                goto call;
+            }
+            fun = vfunction(vm_peek(argc));
+            vm_save();
+            if (!call_foreign(S, fun, argc, pc - 1)) {
+                vm_fail();
+            }
+            vm_load();
+            vm_resume();
+        vm_case(OP_CALLM): {
+            argc = code_byte(pc);
+            auto cache_id = code_short(pc + 1);
+            pc += 3;
+            auto sym = vm_peek(argc);
+            auto obj = vm_peek(argc-1);
+            if (!get_method_cached(S, obj, sym, cache_id, sp - argc - 1)) {
+                add_trace_frame(S, S->callee, pc - 4);
+                ierror(S, "Method lookup failed.");
+                vm_fail();
             }
         }
-            break;
-        case OP_TCALLM: {
-            auto num_args = code_byte(S, pc++);
-            auto sym = peek(S, num_args);
-            auto tab = peek(S, num_args-1);
-            if (!get_method(S, tab, sym, S->sp - num_args - 1)) {
-                add_trace_frame(S, S->callee, pc - 2);
+            goto call;
+        vm_case(OP_TCALLM): {
+            auto num_args = code_byte(pc);
+            auto cache_id = code_short(pc + 1);
+            pc += 3;
+            auto sym = vm_peek(num_args);
+            auto obj = vm_peek(num_args-1);
+            if (!get_method_cached(S, obj, sym, cache_id,
+                            sp - num_args - 1)) {
+                add_trace_frame(S, S->callee, pc - 4);
                 ierror(S, "Method lookup failed.");
-                return;
+                vm_fail();
             }
+            vm_save();
             if (!tail_call(S, num_args, &pc)) {
-                add_trace_frame(S, S->callee, pc - 2);
-                return;
+                vm_fail();
+            }
+            vm_load();
+            if (pc == 0) {
+                vm_enter();
             }
         }
-            break;
-        case OP_APPLY: {
+            vm_next();
+        vm_case(OP_APPLY):
             // unroll the list on top of the stack
-            if (!vis_list(peek(S, 0))) {
+            if (!vis_list(vm_peek(0))) {
                 add_trace_frame(S, S->callee, pc - 1);
                 ierror(S, "Final argument to apply must be a list.");
-                return;
+                vm_fail();
             }
-            auto n = code_byte(S, pc++) + unroll_list(S);
-            icall(S, n, pc - 2);
-            if (has_error(S)) {
-                return;
+            vm_save();
+            argc = code_byte(pc++);
+            if (!unroll_list(S, &argc)) {
+                add_trace_frame(S, S->callee, pc - 2);
+                vm_fail();
             }
-        }
-            break;
-        case OP_TAPPLY: {
+            vm_load();
+            goto call;
+        vm_case(OP_TAPPLY): {
             // unroll the list on top of the stack
-            if (!vis_list(peek(S, 0))) {
+            if (!vis_list(vm_peek(0))) {
                 add_trace_frame(S, S->callee, pc - 1);
                 ierror(S, "Final argument to apply must be a list.");
-                return;
+                vm_fail();
             }
-            auto n = code_byte(S, pc++) + unroll_list(S);
-            if (!tail_call(S, n, &pc)) {
+            vm_save();
+            u32 n = code_byte(pc++);
+            if (!unroll_list(S, &n)) {
                 add_trace_frame(S, S->callee, pc - 2);
-                return;
+                vm_fail();
+            }
+            if (!tail_call(S, n, &pc)) {
+                vm_fail();
+            }
+            vm_load();
+            if (pc == 0) {
+                vm_enter();
             }
         }
-            break;
+            vm_next();
 
-        case OP_RETURN:
-            // close upvalues and exit the loop. The icall() function will handle
-            // moving the return value.
-            close_upvals(S, S->bp);
-            return;
-            break;
+        vm_case(OP_RETURN):
+            close_upvals(S, bp);
+            if (S->frames.size == base_frame) {
+                // return to the native caller, which handles moving the return
+                // value.
+                vm_save();
+                return;
+            } else {
+                auto& f = S->frames[S->frames.size - 1];
+                stack[bp-1] = vm_peek(0);
+                sp = bp;
+                bp = f.bp;
+                pc = f.pc;
+                S->callee = f.callee;
+                S->bp = bp;
+                S->frames.pop();
+                code = S->callee->stub->code;
+            }
+            vm_resume();
 
-        case OP_IMPORT:
-            if (!vis_symbol(peek(S, 1)) || !vis_symbol(peek(S, 0))) {
+        vm_case(OP_LOCAL2):
+            vm_push(stack[bp + code_byte(pc)]);
+            vm_push(stack[bp + code_byte(pc + 1)]);
+            pc += 2;
+            vm_next();
+        vm_case(OP_LOCAL_CONST):
+            vm_push(stack[bp + code_byte(pc)]);
+            vm_push(S->callee->stub->const_arr[code_short(pc + 1)]);
+            pc += 3;
+            vm_next();
+        vm_case(OP_GLOBAL_LOCAL): {
+            auto id = code_u32(pc);
+            pc += 4;
+            auto v = S->G->def_arr[id];
+            if (v == V_UNIN) {
+                add_trace_frame(S, S->callee, pc - 5);
+                global_error(S, id);
+                vm_fail();
+            }
+            vm_push(v);
+            vm_push(stack[bp + code_byte(pc++)]);
+        }
+            vm_next();
+        vm_case(OP_LOCAL_GET_FIELD):
+            vm_push(stack[bp + code_byte(pc++)]);
+            goto field_get;
+        vm_case(OP_EQ_CJUMP): {
+            bool res;
+            vm_equal(res);
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_LT_CJUMP): {
+            bool res;
+            vm_compare(res, <, "<");
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_LE_CJUMP): {
+            bool res;
+            vm_compare(res, <=, "<=");
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_GT_CJUMP): {
+            bool res;
+            vm_compare(res, >, ">");
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_GE_CJUMP): {
+            bool res;
+            vm_compare(res, >=, ">=");
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_LT_INT_CJUMP): {
+            bool res;
+            vm_compare_int(res, <);
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_LE_INT_CJUMP): {
+            bool res;
+            vm_compare_int(res, <=);
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_GT_INT_CJUMP): {
+            bool res;
+            vm_compare_int(res, >);
+            vm_cjump(res);
+        }
+            vm_next();
+        vm_case(OP_GE_INT_CJUMP): {
+            bool res;
+            vm_compare_int(res, >=);
+            vm_cjump(res);
+        }
+            vm_next();
+
+        vm_case(OP_IMPORT):
+            if (!vis_symbol(vm_peek(1)) || !vis_symbol(vm_peek(0))) {
                 add_trace_frame(S, S->callee, pc - 1);
                 ierror(S, "import arguments must be symbols\n");
-                return;
+                vm_fail();
             }
-            if (!do_import(S, vsymbol(peek(S, 1)), vsymbol(peek(S, 0)))) {
+            vm_save();
+            if (!do_import(S, vsymbol(vm_peek(1)), vsymbol(vm_peek(0)))) {
                 add_trace_frame(S, S->callee, pc - 1);
-                return;
+                vm_fail();
             }
-            pop(S, 2);
-            break;
+            vm_load();
+            sp -= 2;
+            vm_next();
 
-        case OP_LIST:
-            pop_to_list(S, code_byte(S, pc++));
-            break;
+        vm_case(OP_LIST):
+            vm_save();
+            pop_to_list(S, code_byte(pc++));
+            vm_load();
+            vm_next();
+
+        vm_case(OP_TABLE):
+            // not emitted by the compiler
+            add_trace_frame(S, S->callee, pc - 1);
+            ierror(S, "Invalid instruction.");
+            vm_fail();
+        }
+
+        // Shared code for the non-tail calls. Expects argc to hold the number
+        // of arguments and pc to point at the next instruction. Fn functions
+        // are entered by pushing a call frame rather than by recursion.
+    call:
+        vm_save();
+        if (!vis_function(vm_peek(argc))) {
+            goto call_resolve;
+        }
+        fun = vfunction(vm_peek(argc));
+        // call-known and call-foreign enter here, having already checked that
+        // the callee is a function
+    call_fun:
+        // fast path for a Fn function called with exactly its number of
+        // parameters when it has no optional or variadic ones. Nothing needs to
+        // be arranged, so it's entered by moving the base pointer.
+        if (fun->stub->simple && argc == fun->stub->num_params
+                && sp - argc + fun->stub->space <= S->stack_size) {
+            push_frame(S, S->callee, bp, pc);
+            bp = sp - argc;
+            S->bp = bp;
+            S->callee = fun;
+            code = fun->stub->code;
+            pc = 0;
+            vm_enter();
+        }
+    call_resolve: {
+            fun = resolve_callee(S, &argc, pc - 1);
+            if (!fun) {
+                vm_fail();
+            }
+            if (fun->stub->foreign) {
+                if (!call_foreign(S, fun, argc, pc - 1)) {
+                    vm_fail();
+                }
+                vm_load();
+                vm_resume();
+            }
+            push_frame(S, S->callee, bp, pc);
+            if (!enter_fun(S, fun, argc, pc - 1)) {
+                S->frames.pop();
+                vm_fail();
+            }
+            pc = 0;
+            vm_load();
+        }
+        vm_enter();
+
+#ifdef FN_JIT
+        // run native code from pc, continuing in the interpreter at the
+        // instruction where it stops
+    native:
+        vm_save();
+        pc = S->callee->stub->jit->run(S, pc);
+        vm_load();
+        if (pc == JIT_ERROR) {
+            vm_fail();
         }
+        vm_next();
+#endif
+    }
+
+unwind:
+    // On error, add the suspended callers to the stack trace and restore the
+    // state to what it was when execute_fun() was entered. The native caller
+    // adds the rest of the trace.
+    vm_save();
+    if (S->frames.size > base_frame) {
+        while (S->frames.size > base_frame + 1) {
+            auto& f = S->frames[S->frames.size - 1];
+            add_trace_frame(S, f.callee, f.pc - 1);
+            S->frames.pop();
+        }
+        auto& f = S->frames[base_frame];
+        add_trace_frame(S, f.callee, f.pc - 1);
+        S->bp = f.bp;
+        S->callee = f.callee;
+        S->frames.pop();
     }
 }
 
+#ifdef FN_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 }
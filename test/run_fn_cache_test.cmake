@@ -0,0 +1,38 @@
+# Check that a file's .fnc file isn't used after a file it requires changes.
+# This is invoked by ctest with these variables set:
+#   FN        the interpreter
+#   WORK      a scratch directory for the run
+# main.fn requires dep.fn and uses a macro defined there, so its compiled code
+# holds the macro's expansion. It's run once to write both .fnc files, again
+# after dep.fn changes, and a third time with nothing changed.
+
+file(REMOVE_RECURSE "${WORK}")
+file(MAKE_DIRECTORY "${WORK}")
+file(WRITE "${WORK}/main.fn"
+  "(require \"./dep.fn\")\n"
+  "[(version) (dep-fun)]\n")
+
+function(run_main dep_version expected)
+  execute_process(COMMAND "${FN}" "main.fn"
+    WORKING_DIRECTORY "${WORK}"
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+  if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "Output of main.fn with dep.fn version ${dep_version} "
+      "is wrong.\nExpected:\n${expected}\nGot:\n${output}")
+  endif()
+endfunction()
+
+file(WRITE "${WORK}/dep.fn"
+  "(defmacro version () 1)\n"
+  "(defn dep-fun () 'one)\n")
+run_main(1 "[1 'one]\n")
+if (NOT EXISTS "${WORK}/main.fnc" OR NOT EXISTS "${WORK}/dep.fnc")
+  message(FATAL_ERROR "No .fnc files were written.")
+endif()
+
+file(WRITE "${WORK}/dep.fn"
+  "(defmacro version () 2)\n"
+  "(defn dep-fun () 'two)\n")
+run_main(2 "[2 'two]\n")
+run_main(2 "[2 'two]\n")
@@ -0,0 +1,43 @@
+# Run a test script and compare what it prints to the expected output. This is
+# invoked by ctest with these variables set:
+#   FN        the interpreter
+#   SCRIPT    the .fn file to run
+#   EXPECTED  the file holding its expected output
+#   WORK      a scratch directory for the run
+#   CACHED    if true, the script is run twice: once compiling it and writing
+#             its .fnc file, and once loading the .fnc file. Otherwise it's run
+#             once with --no-cache.
+# Output printed at compile time, e.g. by macros, is missing from the run that
+# loads the .fnc file. Scripts which print any have a second file of expected
+# output for that run, ending in .cached.out.
+
+get_filename_component(name "${SCRIPT}" NAME)
+file(MAKE_DIRECTORY "${WORK}")
+configure_file("${SCRIPT}" "${WORK}/${name}" COPYONLY)
+file(REMOVE "${WORK}/${name}c")
+string(REGEX REPLACE "\\.out$" ".cached.out" expected_cached "${EXPECTED}")
+
+if (CACHED)
+  set(runs "compiled" "cached")
+  set(flags "")
+else()
+  set(runs "uncached")
+  set(flags "--no-cache")
+endif()
+
+foreach(run ${runs})
+  if (run STREQUAL "cached" AND EXISTS "${expected_cached}")
+    file(READ "${expected_cached}" expected)
+  else()
+    file(READ "${EXPECTED}" expected)
+  endif()
+  # stdout and stderr are collected together
+  execute_process(COMMAND "${FN}" ${flags} "${name}"
+    WORKING_DIRECTORY "${WORK}"
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+  if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "Output of ${name} (${run}) is wrong.\n"
+      "Expected:\n${expected}\nGot:\n${output}")
+  endif()
+endforeach()